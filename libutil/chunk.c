@@ -101,6 +101,51 @@ exported gboolean iu_chunk_crypto_digest(enum iu_chunk_crypto crypto,
 	return TRUE;
 }
 
+struct iu_chunk_digest {
+	struct isrcry_hash_ctx *hash;
+};
+
+exported struct iu_chunk_digest *iu_chunk_digest_new(
+			enum iu_chunk_crypto crypto)
+{
+	struct iu_chunk_digest *ctx;
+	enum isrcry_hash alg;
+
+	if (!crypto_get_algs(crypto, NULL, NULL, NULL, &alg, NULL)) {
+		g_log(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL,
+					"Invalid crypto suite requested");
+		return NULL;
+	}
+	ctx = g_slice_new(struct iu_chunk_digest);
+	ctx->hash = isrcry_hash_alloc(alg);
+	if (ctx->hash == NULL) {
+		g_log(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL,
+					"Couldn't allocate digest context");
+		g_slice_free(struct iu_chunk_digest, ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+exported void iu_chunk_digest_update(struct iu_chunk_digest *ctx,
+			const void *in, unsigned len)
+{
+	isrcry_hash_update(ctx->hash, in, len);
+}
+
+exported void iu_chunk_digest_final(struct iu_chunk_digest *ctx, void *out)
+{
+	isrcry_hash_final(ctx->hash, out);
+}
+
+exported void iu_chunk_digest_free(struct iu_chunk_digest *ctx)
+{
+	if (ctx == NULL)
+		return;
+	isrcry_hash_free(ctx->hash);
+	g_slice_free(struct iu_chunk_digest, ctx);
+}
+
 /* Compress */
 
 exported enum iu_chunk_compress iu_chunk_compress_parse(const char *desc)
@@ -55,6 +55,15 @@ unsigned iu_chunk_crypto_hashlen(enum iu_chunk_crypto type);
 gboolean iu_chunk_crypto_digest(enum iu_chunk_crypto crypto, void *out,
 			const void *in, unsigned len);
 
+/* Incremental form of iu_chunk_crypto_digest(), for data that arrives in
+   pieces.  iu_chunk_digest_final() resets the context for reuse. */
+struct iu_chunk_digest;
+struct iu_chunk_digest *iu_chunk_digest_new(enum iu_chunk_crypto crypto);
+void iu_chunk_digest_update(struct iu_chunk_digest *ctx, const void *in,
+			unsigned len);
+void iu_chunk_digest_final(struct iu_chunk_digest *ctx, void *out);
+void iu_chunk_digest_free(struct iu_chunk_digest *ctx);
+
 enum iu_chunk_compress iu_chunk_compress_parse(const char *desc);
 gboolean iu_chunk_compress_is_enabled(unsigned enabled_map,
 			enum iu_chunk_compress type);
@@ -63,6 +72,7 @@ gboolean iu_chunk_encode(enum iu_chunk_crypto crypto,
 			const void *in, unsigned inlen,
 			void *out, unsigned *outlen, void *tag, void *key,
 			enum iu_chunk_compress *compress);
+/* @in and @out may be the same buffer */
 gboolean iu_chunk_decode(enum iu_chunk_crypto crypto,
 			enum iu_chunk_compress compress, unsigned chunk,
 			const void *in, unsigned inlen, const void *key,
@@ -49,6 +49,26 @@ struct pk_shm {
 	GMutex *lock;
 };
 
+/* Convergent encryption gives every all-zero chunk the same encoding for a
+   given compression type.  We compute those encodings at startup, so that
+   a chunk whose keyring entry matches one of them can be read without
+   touching the cache file, and so that a guest write of zeroes only needs
+   to update the keyring. */
+struct zero_encoding {
+	enum iu_chunk_compress compress;	/* as actually encoded */
+	void *data;			/* NULL if type not enabled */
+	unsigned len;
+	char *tag;
+	char *key;
+};
+
+struct pk_zero {
+	/* Indexed by requested compression type */
+	struct zero_encoding enc[IU_CHUNK_COMP_LZF + 1];
+	GMutex *lock;
+	unsigned char *map;	/* one bit per chunk; set if all zeroes */
+};
+
 enum shm_chunk_status {
 	SHM_PRESENT		= 0x01,
 	SHM_DIRTY		= 0x02,
@@ -320,6 +340,24 @@ void cache_shm_set_cache_dirty(struct pk_state *state, unsigned chunk,
 				dirty ? 0 : SHM_CACHE_DIRTY);
 }
 
+/* Must be within transaction.  Create temp.modified_chunks, listing the
+   chunks whose tags differ between the previous and current keyrings,
+   with both tags.  The caller must drop it. */
+pk_err_t _cache_find_modified(struct pk_state *state)
+{
+	if (!query(NULL, state->db, "CREATE TEMP TABLE modified_chunks AS "
+				"SELECT main.keys.chunk AS chunk, "
+				"prev.keys.tag AS old_tag, "
+				"main.keys.tag AS new_tag "
+				"FROM main.keys JOIN prev.keys "
+				"ON main.keys.chunk == prev.keys.chunk "
+				"WHERE main.keys.tag != prev.keys.tag", NULL)) {
+		sql_log_err(state->db, "Couldn't find modified chunks");
+		return PK_SQLERR;
+	}
+	return PK_SUCCESS;
+}
+
 static pk_err_t shm_init(struct pk_state *state)
 {
 	int fd;
@@ -379,17 +417,19 @@ again:
 		goto bad_sql;
 	}
 
-	for (query(&qry, state->db, "SELECT main.keys.chunk "
-				"FROM main.keys JOIN prev.keys "
-				"ON main.keys.chunk == prev.keys.chunk "
-				"WHERE main.keys.tag != prev.keys.tag", NULL);
-				query_has_row(state->db); query_next(qry)) {
+	/* The rollback drops the table */
+	ret=_cache_find_modified(state);
+	if (ret)
+		goto bad_sql;
+	for (query(&qry, state->db, "SELECT chunk FROM temp.modified_chunks",
+				NULL); query_has_row(state->db);
+				query_next(qry)) {
 		query_row(qry, "d", &chunk);
 		shm_update(state, chunk, SHM_DIRTY, 0);
 	}
 	query_free(qry);
 	if (!query_ok(state->db)) {
-		sql_log_err(state->db, "Couldn't find modified chunks");
+		sql_log_err(state->db, "Couldn't read modified chunks");
 		ret=PK_SQLERR;
 		goto bad_sql;
 	}
@@ -415,8 +455,157 @@ bad_open:
 	return ret;
 }
 
+static struct zero_encoding *zero_lookup(struct pk_state *state,
+			const void *tag)
+{
+	struct zero_encoding *enc;
+	unsigned i;
+
+	if (state->zero == NULL)
+		return NULL;
+	for (i = 0; i <= IU_CHUNK_COMP_LZF; i++) {
+		enc = &state->zero->enc[i];
+		if (enc->data != NULL && !memcmp(enc->tag, tag,
+					state->parcel->hashlen))
+			return enc;
+	}
+	return NULL;
+}
+
+/* Return the encoded form of an all-zero chunk if @tag is one of the zero
+   tags, or NULL otherwise.  @len may be NULL. */
+const void *cache_zero_data(struct pk_state *state, const void *tag,
+			unsigned *len)
+{
+	struct zero_encoding *enc;
+
+	enc = zero_lookup(state, tag);
+	if (enc == NULL)
+		return NULL;
+	if (len != NULL)
+		*len = enc->len;
+	return enc->data;
+}
+
+/* Must be thread-safe */
+static void zero_mark(struct pk_state *state, unsigned chunk,
+			gboolean zero)
+{
+	if (state->zero == NULL || chunk >= state->parcel->chunks)
+		return;
+	g_mutex_lock(state->zero->lock);
+	if (zero)
+		state->zero->map[chunk / 8] |= 1 << (chunk % 8);
+	else
+		state->zero->map[chunk / 8] &= ~(1 << (chunk % 8));
+	g_mutex_unlock(state->zero->lock);
+}
+
+/* Returns TRUE if @chunk is known to contain only zeroes.  Must be
+   thread-safe. */
+gboolean cache_chunk_is_zero(struct pk_state *state, unsigned chunk)
+{
+	gboolean ret;
+
+	if (state->zero == NULL || chunk >= state->parcel->chunks)
+		return FALSE;
+	g_mutex_lock(state->zero->lock);
+	ret = !!(state->zero->map[chunk / 8] & (1 << (chunk % 8)));
+	g_mutex_unlock(state->zero->lock);
+	return ret;
+}
+
+static void zero_free(struct pk_state *state)
+{
+	unsigned i;
+
+	if (state->zero == NULL)
+		return;
+	for (i = 0; i <= IU_CHUNK_COMP_LZF; i++) {
+		g_free(state->zero->enc[i].data);
+		g_free(state->zero->enc[i].tag);
+		g_free(state->zero->enc[i].key);
+	}
+	g_free(state->zero->map);
+	g_mutex_free(state->zero->lock);
+	g_slice_free(struct pk_zero, state->zero);
+	state->zero = NULL;
+}
+
+static pk_err_t zero_init(struct pk_state *state)
+{
+	struct zero_encoding *enc;
+	struct query *qry;
+	void *buf;
+	unsigned chunk;
+	unsigned i;
+	gboolean retry;
+
+	state->zero = g_slice_new0(struct pk_zero);
+	state->zero->lock = g_mutex_new();
+	state->zero->map = g_malloc0((state->parcel->chunks + 7) / 8);
+	buf = g_malloc0(state->parcel->chunksize);
+	for (i = IU_CHUNK_COMP_NONE; i <= IU_CHUNK_COMP_LZF; i++) {
+		if (!iu_chunk_compress_is_enabled(
+					state->parcel->required_compress, i))
+			continue;
+		enc = &state->zero->enc[i];
+		enc->compress = i;
+		enc->data = g_malloc(state->parcel->chunksize);
+		enc->tag = g_malloc(state->parcel->hashlen);
+		enc->key = g_malloc(state->parcel->hashlen);
+		if (!iu_chunk_encode(state->parcel->crypto, buf,
+					state->parcel->chunksize, enc->data,
+					&enc->len, enc->tag, enc->key,
+					&enc->compress)) {
+			pk_log(LOG_ERROR, "Couldn't encode zero chunk");
+			g_free(buf);
+			zero_free(state);
+			return PK_CALLFAIL;
+		}
+	}
+	g_free(buf);
+
+again:
+	if (!begin(state->db))
+		goto bad_free;
+	for (i = 0; i <= IU_CHUNK_COMP_LZF; i++) {
+		enc = &state->zero->enc[i];
+		if (enc->data == NULL)
+			continue;
+		for (query(&qry, state->db, "SELECT chunk FROM keys "
+					"WHERE tag == ?", "b", enc->tag,
+					state->parcel->hashlen);
+					query_has_row(state->db);
+					query_next(qry)) {
+			query_row(qry, "d", &chunk);
+			zero_mark(state, chunk, TRUE);
+			shm_update(state, chunk, SHM_PRESENT, 0);
+		}
+		query_free(qry);
+		if (!query_ok(state->db)) {
+			sql_log_err(state->db, "Couldn't find zero chunks");
+			goto bad;
+		}
+	}
+	rollback(state->db);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->db);
+	rollback(state->db);
+	if (retry) {
+		query_backoff(state->db);
+		goto again;
+	}
+bad_free:
+	zero_free(state);
+	return PK_IOERR;
+}
+
 void cache_shutdown(struct pk_state *state)
 {
+	zero_free(state);
 	if (state->shm) {
 		g_mutex_free(state->shm->lock);
 		munmap(state->shm->base, state->shm->len);
@@ -509,6 +698,12 @@ pk_err_t cache_init(struct pk_state *state)
 			pk_log(LOG_ERROR, "Couldn't set up shared memory "
 						"segment; continuing");
 
+	if ((state->conf->flags & WANT_CACHE) && state->parcel != NULL) {
+		ret=zero_init(state);
+		if (ret)
+			goto bad;
+	}
+
 	interrupter_add(state->db);
 	return PK_SUCCESS;
 
@@ -547,20 +742,14 @@ pk_err_t _cache_read_chunk(struct pk_state *state, unsigned chunk,
 static pk_err_t _cache_write_chunk(struct pk_state *state, unsigned chunk,
 			const void *buf, unsigned len)
 {
-	char data[state->parcel->chunksize];
-	ssize_t count;
-
 	if (len > state->parcel->chunksize)
 		return PK_INVALID;
 	/* Write out the entire slot, not just the utilized bytes.  This
 	   allows the kernel to coalesce I/O to adjacent chunks.  On
 	   systems too old for fallocate(), it may also convince the
 	   filesystem to allocate contiguous sectors for the chunk. */
-	memcpy(data, buf, len);
-	memset(data + len, 0, state->parcel->chunksize - len);
-	count = pwrite(state->cache_fd, data, state->parcel->chunksize,
-				cache_chunk_to_offset(state, chunk));
-	if (count != (int) state->parcel->chunksize) {
+	if (pwrite_padded(state->cache_fd, buf, len, state->parcel->chunksize,
+				cache_chunk_to_offset(state, chunk))) {
 		pk_log(LOG_ERROR, "Couldn't write chunk %u to backing store",
 					chunk);
 		return PK_IOERR;
@@ -576,12 +765,14 @@ static pk_err_t _cache_write_chunk(struct pk_state *state, unsigned chunk,
 	return PK_SUCCESS;
 }
 
+/* @buf must be chunksize bytes.  The encrypted chunk is read or fetched
+   directly into it and then decoded in place. */
 pk_err_t cache_get(struct pk_state *state, unsigned chunk, void *buf)
 {
+	struct zero_encoding *zero;
 	struct query *qry;
 	void *rowtag;
 	void *rowkey;
-	char encrypted[state->parcel->chunksize];
 	char tag[state->parcel->hashlen];
 	char key[state->parcel->hashlen];
 	unsigned compress;
@@ -589,6 +780,7 @@ pk_err_t cache_get(struct pk_state *state, unsigned chunk, void *buf)
 	unsigned taglen;
 	unsigned keylen;
 	gchar *ftag;
+	uint64_t start;
 	pk_err_t ret;
 	gboolean retry;
 
@@ -626,6 +818,18 @@ again:
 	memcpy(key, rowkey, state->parcel->hashlen);
 	query_free(qry);
 
+	zero = zero_lookup(state, tag);
+	if (zero != NULL && !memcmp(zero->key, key, state->parcel->hashlen)) {
+		/* All zeroes; no need to read or decrypt anything */
+		if (!commit(state->db)) {
+			ret=PK_IOERR;
+			goto bad;
+		}
+		memset(buf, 0, state->parcel->chunksize);
+		stats_increment(state, zero_chunk_reads, 1);
+		goto out;
+	}
+
 	if (!query(&qry, state->db, "SELECT length FROM cache.chunks "
 				"WHERE chunk == ?", "d", chunk)) {
 		sql_log_err(state->db, "Couldn't query cache index");
@@ -646,21 +850,27 @@ again:
 		goto bad;
 	}
 
+	start = timestamp_usec();
 	if (len) {
 		/* Read the chunk from the local cache.  Don't check the
 		   tag, since decrypt will check the key */
-		ret = _cache_read_chunk(state, chunk, encrypted, len, NULL);
+		ret = _cache_read_chunk(state, chunk, buf, len, NULL);
 		if (ret)
 			return ret;
-	} else if (hoard_get_chunk(state, tag, encrypted, &len)) {
+		xfer_record(state, XFER_CACHE, len, start);
+	} else if (hoard_get_chunk(state, tag, buf, &len)) {
 		/* Chunk is not in hoard cache; fetch from network */
 		ftag = format_tag(tag, state->parcel->hashlen);
 		pk_log(LOG_CHUNK, "Tag %s not in hoard cache", ftag);
 		g_free(ftag);
-		ret = transport_fetch_chunk(state->cpool, encrypted, chunk,
-					tag, &len);
+		ret = transport_fetch_chunk(state->cpool, buf, chunk, tag,
+					&len);
 		if (ret)
 			return ret;
+		prefetch_miss(state, chunk);
+	} else {
+		xfer_record(state, XFER_HOARD, len, start);
+		prefetch_hit(state, chunk);
 	}
 
 	if (len > state->parcel->chunksize) {
@@ -669,12 +879,14 @@ again:
 		return PK_INVALID;
 	}
 
-
+	start = timestamp_usec();
 	if (!iu_chunk_decode(state->parcel->crypto, compress, chunk,
-				encrypted, len, key, buf,
+				buf, len, key, buf,
 				state->parcel->chunksize))
 		return PK_IOERR;
+	xfer_record(state, XFER_DECODE, len, start);
 
+out:
 	stats_increment(state, chunk_reads, 1);
 	shm_update(state, chunk, SHM_ACCESSED_SESSION, 0);
 	return PK_SUCCESS;
@@ -689,6 +901,55 @@ bad:
 	return ret;
 }
 
+/* Record that @chunk contains only zeroes.  This is purely a keyring
+   update: the chunk's cache index record is dropped, and later reads are
+   satisfied without I/O. */
+pk_err_t cache_set_zero(struct pk_state *state, unsigned chunk)
+{
+	struct zero_encoding *enc;
+	gboolean retry;
+
+	if (state->zero == NULL)
+		return PK_INVALID;
+	enc = &state->zero->enc[state->conf->compress];
+	if (enc->data == NULL)
+		return PK_INVALID;
+	pk_log(LOG_CHUNK, "Zero: %u", chunk);
+
+again:
+	if (!begin(state->db))
+		return PK_IOERR;
+	if (!query(NULL, state->db, "UPDATE keys SET tag = ?, key = ?, "
+				"compression = ? WHERE chunk == ?", "bbdd",
+				enc->tag, state->parcel->hashlen, enc->key,
+				state->parcel->hashlen, enc->compress, chunk)) {
+		sql_log_err(state->db, "Couldn't update keyring");
+		goto bad;
+	}
+	if (!query(NULL, state->db, "DELETE FROM cache.chunks "
+				"WHERE chunk == ?", "d", chunk)) {
+		sql_log_err(state->db, "Couldn't update cache index");
+		goto bad;
+	}
+	if (!commit(state->db))
+		goto bad;
+	zero_mark(state, chunk, TRUE);
+	stats_increment(state, chunk_writes, 1);
+	stats_increment(state, zero_chunk_writes, 1);
+	shm_update(state, chunk, SHM_PRESENT | SHM_ACCESSED_SESSION |
+				SHM_DIRTY | SHM_DIRTY_SESSION, 0);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->db);
+	rollback(state->db);
+	if (retry) {
+		query_backoff(state->db);
+		goto again;
+	}
+	return PK_IOERR;
+}
+
 pk_err_t cache_update(struct pk_state *state, unsigned chunk, const void *buf)
 {
 	gboolean retry;
@@ -698,6 +959,9 @@ pk_err_t cache_update(struct pk_state *state, unsigned chunk, const void *buf)
 	unsigned compress;
 	unsigned len;
 
+	if (state->zero != NULL && buf_is_zero(buf, state->parcel->chunksize))
+		return cache_set_zero(state, chunk);
+
 	pk_log(LOG_CHUNK, "Update: %u", chunk);
 
 	compress = state->conf->compress;
@@ -726,6 +990,7 @@ again:
 	}
 	if (!commit(state->db))
 		goto bad;
+	zero_mark(state, chunk, FALSE);
 	stats_increment(state, chunk_writes, 1);
 	stats_increment(state, data_bytes_written, len);
 	shm_update(state, chunk, SHM_PRESENT | SHM_ACCESSED_SESSION |
@@ -59,6 +59,8 @@ int copy_for_upload(struct pk_state *state)
 	void *tag;
 	unsigned taglen;
 	unsigned length;
+	const void *zero;
+	unsigned zerolen;
 	gchar *path;
 	int fd;
 	unsigned modified_chunks;
@@ -136,22 +138,28 @@ again:
 						state->parcel->hashlen, taglen);
 			goto damaged;
 		}
-		if (length == 0) {
+		zero = cache_zero_data(state, tag, &zerolen);
+		if (length == 0 && zero != NULL) {
+			/* Zeroed chunks are only recorded in the keyring */
+			memcpy(buf, zero, zerolen);
+			length = zerolen;
+		} else if (length == 0) {
 			/* No cache index record */
 			pk_log(LOG_WARNING, "Chunk %u: modified but not "
 						"present", chunk);
 			goto damaged;
-		}
-		if (length > state->parcel->chunksize) {
+		} else if (length > state->parcel->chunksize) {
 			pk_log(LOG_WARNING, "Chunk %u: absurd length %u",
 						chunk, length);
 			goto damaged;
+		} else {
+			err = _cache_read_chunk(state, chunk, buf, length,
+						tag);
+			if (err == PK_TAGFAIL)
+				goto damaged;
+			else if (err)
+				goto out;
 		}
-		err = _cache_read_chunk(state, chunk, buf, length, tag);
-		if (err == PK_TAGFAIL)
-			goto damaged;
-		else if (err)
-			goto out;
 		path=form_chunk_path(state->parcel, state->conf->dest_dir,
 					chunk);
 		fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
@@ -384,7 +392,8 @@ again:
 	query_row(qry, "D", &valid_bytes);
 	query_free(qry);
 
-	for (query(&qry, state->db, "SELECT main.keys.chunk FROM "
+	for (query(&qry, state->db, "SELECT main.keys.chunk, "
+				"main.keys.tag FROM "
 				"main.keys JOIN prev.keys ON "
 				"main.keys.chunk == prev.keys.chunk "
 				"LEFT JOIN cache.chunks ON "
@@ -392,7 +401,10 @@ again:
 				"WHERE main.keys.tag != prev.keys.tag AND "
 				"cache.chunks.chunk ISNULL", NULL);
 				query_has_row(state->db); query_next(qry)) {
-		query_row(qry, "d", &chunk);
+		query_row(qry, "db", &chunk, &tag, &taglen);
+		if (taglen == state->parcel->hashlen &&
+					cache_zero_data(state, tag, NULL))
+			continue;
 		pk_log(LOG_WARNING, "Chunk %u: modified but not present",
 					chunk);
 		if (state->conf->flags & WANT_SPLICE) {
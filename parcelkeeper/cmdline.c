@@ -27,6 +27,8 @@ static struct pk_config default_config = {
 	.log_stderr_mask = 1 << LOG_WARNING,
 	.compress = IU_CHUNK_COMP_NONE,
 	.chunk_cache = 32, /* MB */
+	.cache_policy = CACHE_POLICY_ARC,
+	.prefetch = 4, /* chunks */
 };
 
 enum arg_type {
@@ -51,8 +53,12 @@ enum option {
 	OPT_COMPACT,
 	OPT_ALLOW_ROOT,
 	OPT_SINGLE_THREAD,
+	OPT_LOCK_MEMORY,
+	OPT_AUTO_CACHE,
 	OPT_MODE,
 	OPT_CHUNK_CACHE,
+	OPT_CACHE_POLICY,
+	OPT_PREFETCH,
 	END_OPTS
 };
 
@@ -83,6 +89,8 @@ static const struct pk_option pk_options[] = {
 	{"uuid",           OPT_UUID,           "uuid"},
 	{"destdir",        OPT_DESTDIR,        "dir"},
 	{"chunk-cache",    OPT_CHUNK_CACHE,    "MB",                       "Size of the decrypted chunk cache"},
+	{"cache-policy",   OPT_CACHE_POLICY,   "policy",                   "Chunk cache replacement policy: lru, 2q, arc (default)"},
+	{"prefetch",       OPT_PREFETCH,       "chunks",                   "Radius of hoard prefetch on network misses (0 to disable)"},
 	{"compression",    OPT_COMPRESSION,    "algorithm",                "Accepted algorithms: none (default), zlib, lzf"},
 	{"log",            OPT_LOG,            "file"},
 	{"log-filter",     OPT_MASK_FILE,      "comma_separated_list",     "Override default list of log types"},
@@ -94,6 +102,8 @@ static const struct pk_option pk_options[] = {
 	{"compact",        OPT_COMPACT,        NULL,                       "Compact the hoard cache"},
 	{"allow-root",     OPT_ALLOW_ROOT,     NULL,                       "Allow the root user to access the virtual filesystem"},
 	{"single-thread",  OPT_SINGLE_THREAD,  NULL,                       "Don't run multi-threaded"},
+	{"lock-memory",    OPT_LOCK_MEMORY,    NULL,                       "Lock the chunk cache into RAM"},
+	{"auto-cache",     OPT_AUTO_CACHE,     NULL,                       "Resize the chunk cache in response to memory pressure"},
 	{"mode",           OPT_MODE,           "mode",                     "Print detailed usage message about the given mode"},
 	{0}
 };
@@ -111,12 +121,16 @@ mode(RUN) = {
 	{OPT_PARCEL,        REQUIRED},
 	{OPT_HOARD,         OPTIONAL},
 	{OPT_CHUNK_CACHE,   OPTIONAL},
+	{OPT_CACHE_POLICY,  OPTIONAL},
+	{OPT_PREFETCH,      OPTIONAL},
 	{OPT_COMPRESSION,   OPTIONAL},
 	{OPT_LOG,           OPTIONAL},
 	{OPT_MASK_FILE,     OPTIONAL},
 	{OPT_MASK_STDERR,   OPTIONAL},
 	{OPT_ALLOW_ROOT,    OPTIONAL},
 	{OPT_SINGLE_THREAD, OPTIONAL},
+	{OPT_LOCK_MEMORY,   OPTIONAL},
+	{OPT_AUTO_CACHE,    OPTIONAL},
 	{OPT_FOREGROUND,    OPTIONAL},
 	{END_OPTS}
 };
@@ -222,7 +236,7 @@ mode(VERSION) = {
 #define EXAMINE_flags		WANT_CACHE|WANT_PREV
 #define VALIDATE_flags		WANT_LOCK|WANT_CACHE|WANT_PREV
 #define LISTHOARD_flags		0
-#define CHECKHOARD_flags	0
+#define CHECKHOARD_flags	WANT_GC
 #define RMHOARD_flags		0
 #define GCHOARD_flags		0
 #define REFRESH_flags		WANT_PREV|WANT_GC
@@ -390,6 +404,29 @@ static const struct pk_mode *parse_mode(const char *name)
 	return NULL;
 }
 
+static const char *cache_policies[] = {
+	[CACHE_POLICY_LRU] = "lru",
+	[CACHE_POLICY_2Q] = "2q",
+	[CACHE_POLICY_ARC] = "arc",
+};
+
+static enum pk_cache_policy parse_cache_policy(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(cache_policies); i++)
+		if (!strcmp(name, cache_policies[i]))
+			return i;
+	return CACHE_POLICY_UNKNOWN;
+}
+
+const char *cache_policy_name(enum pk_cache_policy policy)
+{
+	if (policy >= G_N_ELEMENTS(cache_policies))
+		return "unknown";
+	return cache_policies[policy];
+}
+
 static void check_dir(struct pk_cmdline_parse_ctx *ctx, const char *dir)
 {
 	if (!g_file_test(dir, G_FILE_TEST_IS_DIR))
@@ -464,6 +501,10 @@ enum mode parse_cmdline(struct pk_config **out, int argc, char **argv)
 						0);
 			conf->hoard_index=filepath(&ctx, ctx.optparam,
 						"hoard.idx", 0);
+			conf->hoard_gen=filepath(&ctx, ctx.optparam,
+						"hoard.gen", 0);
+			conf->hoard_map=filepath(&ctx, ctx.optparam,
+						"hoard.map", 0);
 			break;
 		case OPT_LOG:
 			conf->log_file=g_strdup(ctx.optparam);
@@ -507,6 +548,14 @@ enum mode parse_cmdline(struct pk_config **out, int argc, char **argv)
 			/* Abuse of WANT_ flags? */
 			conf->flags |= WANT_SINGLE_THREAD;
 			break;
+		case OPT_LOCK_MEMORY:
+			/* Abuse of WANT_ flags? */
+			conf->flags |= WANT_LOCK_MEMORY;
+			break;
+		case OPT_AUTO_CACHE:
+			/* Abuse of WANT_ flags? */
+			conf->flags |= WANT_AUTO_CACHE;
+			break;
 		case OPT_MODE:
 			helpmode=parse_mode(ctx.optparam);
 			if (helpmode == NULL)
@@ -520,6 +569,17 @@ enum mode parse_cmdline(struct pk_config **out, int argc, char **argv)
 				PARSE_ERROR(&ctx, "invalid integer value: %s",
 							ctx.optparam);
 			break;
+		case OPT_CACHE_POLICY:
+			conf->cache_policy = parse_cache_policy(ctx.optparam);
+			if (conf->cache_policy == CACHE_POLICY_UNKNOWN)
+				PARSE_ERROR(&ctx, "invalid cache policy: %s",
+							ctx.optparam);
+			break;
+		case OPT_PREFETCH:
+			if (parseuint(&conf->prefetch, ctx.optparam, 10))
+				PARSE_ERROR(&ctx, "invalid integer value: %s",
+							ctx.optparam);
+			break;
 		case END_OPTS:
 			/* Silence compiler warning */
 			break;
@@ -553,6 +613,8 @@ void cmdline_free(struct pk_config *conf)
 	g_free(conf->hoard_dir);
 	g_free(conf->hoard_file);
 	g_free(conf->hoard_index);
+	g_free(conf->hoard_gen);
+	g_free(conf->hoard_map);
 	g_free(conf->dest_dir);
 	g_free(conf->log_file);
 	g_free(conf->uuid);
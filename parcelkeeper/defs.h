@@ -90,12 +90,28 @@ enum mode_flags {
 	WANT_GC		= 0x0400,  /* Enable slower hoard cleanup steps */
 	WANT_ALLOW_ROOT	= 0x0800,  /* Allow root to access FUSE FS */
 	WANT_SINGLE_THREAD = 0x1000,  /* Run FUSE single-threaded */
+	WANT_LOCK_MEMORY = 0x2000,  /* mlock() the chunk cache */
+	WANT_AUTO_CACHE	= 0x4000,  /* Resize cache on memory pressure */
+};
+
+/* Replacement policy for the decrypted chunk cache */
+enum pk_cache_policy {
+	CACHE_POLICY_LRU,
+	CACHE_POLICY_2Q,
+	CACHE_POLICY_ARC,
+	CACHE_POLICY_UNKNOWN,
 };
 
 struct pk_shm;
 struct pk_fuse;
 struct pk_connection;
 struct pk_lockfile;
+struct pk_prefetch;
+struct pk_profile;
+struct pk_hoard_tags;
+struct pk_hoard_map;
+struct pk_hoard_compactor;
+struct pk_slot_cache;
 
 struct pk_config {
 	/* mode data */
@@ -117,6 +133,8 @@ struct pk_config {
 	gchar *hoard_dir;
 	gchar *hoard_file;
 	gchar *hoard_index;
+	gchar *hoard_gen;
+	gchar *hoard_map;
 
 	/* upload directory */
 	gchar *dest_dir;
@@ -130,6 +148,8 @@ struct pk_config {
 	enum iu_chunk_compress compress;
 	gchar *uuid;
 	unsigned chunk_cache; /* MB */
+	enum pk_cache_policy cache_policy;
+	unsigned prefetch; /* chunks */
 };
 
 struct pk_parcel {
@@ -146,6 +166,20 @@ struct pk_parcel {
 	gchar *master;
 };
 
+/* Where chunk data comes from on a chunk cache miss, plus the time spent
+   decoding it, for the transfer statistics */
+enum pk_xfer_source {
+	XFER_CACHE,
+	XFER_HOARD,
+	XFER_NETWORK,
+	XFER_DECODE,
+	XFER_NR
+};
+
+/* Latency histogram buckets are powers of two in microseconds; the last
+   bucket catches everything longer */
+#define XFER_LATENCY_BUCKETS 25
+
 struct pk_state {
 	struct pk_config *conf;
 	struct pk_parcel *parcel;
@@ -155,7 +189,14 @@ struct pk_state {
 	int hoard_fd;
 	struct pk_fuse *fuse;
 	struct pk_shm *shm;
+	struct pk_zero *zero;
 	struct pk_connection_pool *cpool;
+	struct pk_prefetch *prefetch;
+	struct pk_profile *profile;
+	struct pk_hoard_tags *hoard_tags;
+	struct pk_hoard_map *hoard_map;
+	struct pk_hoard_compactor *hoard_compactor;
+	struct pk_slot_cache *slot_cache;
 	struct db *db;
 	struct db *hoard;
 
@@ -175,9 +216,45 @@ struct pk_state {
 		uint64_t cache_misses;
 		uint64_t cache_evictions;
 		uint64_t cache_evictions_dirty;
+		uint64_t cache_precleans;
+		uint64_t cache_ghost_hits_recent;
+		uint64_t cache_ghost_hits_frequent;
+		uint64_t cache_shrink_releases;
+		uint64_t parallel_misses;
 		uint64_t data_bytes_written;
 		uint64_t whole_chunk_updates;
+		uint64_t zero_chunk_reads;
+		uint64_t zero_chunk_writes;
+		uint64_t absorbed_writes;
+		uint64_t absorb_covered;
+		uint64_t absorb_merges;
+		uint64_t prefetch_fetched;
+		uint64_t prefetch_used;
+		uint64_t profile_fetched;
 	} stats;
+
+	/* Updated with atomic operations rather than under stats_lock,
+	   since they're on the miss path */
+	struct {
+		uint64_t chunks[XFER_NR];
+		uint64_t bytes[XFER_NR];
+		uint64_t usec[XFER_NR];
+		uint64_t latency[XFER_NR][XFER_LATENCY_BUCKETS];
+		uint64_t retries;
+		uint64_t failures;
+		uint64_t in_flight;
+	} xfer;
+};
+
+/* Chunk counts and sizes from the hoard index.  "Present" chunks are
+   referenced and in the hoard cache; "unique" chunks are present and
+   referenced by no other parcel. */
+struct pk_hoard_stats {
+	int referenced;
+	int present;
+	int unique;
+	int64_t present_bytes;
+	int64_t unique_bytes;
 };
 
 struct pk_sigstate {
@@ -193,6 +270,7 @@ extern const char rcs_revision[];
 /* cmdline.c */
 enum mode parse_cmdline(struct pk_config **out, int argc, char **argv);
 void cmdline_free(struct pk_config *conf);
+const char *cache_policy_name(enum pk_cache_policy policy);
 
 /* log.c */
 void log_start(const char *path, unsigned file_mask, unsigned stderr_mask);
@@ -210,8 +288,13 @@ pk_err_t cache_init(struct pk_state *state);
 void cache_shutdown(struct pk_state *state);
 pk_err_t _cache_read_chunk(struct pk_state *state, unsigned chunk,
 			void *buf, unsigned chunklen, const void *tag);
+pk_err_t _cache_find_modified(struct pk_state *state);
 pk_err_t cache_get(struct pk_state *state, unsigned chunk, void *buf);
 pk_err_t cache_update(struct pk_state *state, unsigned chunk, const void *buf);
+pk_err_t cache_set_zero(struct pk_state *state, unsigned chunk);
+gboolean cache_chunk_is_zero(struct pk_state *state, unsigned chunk);
+const void *cache_zero_data(struct pk_state *state, const void *tag,
+			unsigned *len);
 pk_err_t cache_count_chunks(struct pk_state *state, unsigned *valid,
 			unsigned *dirty);
 pk_err_t cache_set_flag(struct pk_state *state, unsigned flag);
@@ -237,17 +320,70 @@ void fuse_shutdown(struct pk_state *state);
 pk_err_t hoard_init(struct pk_state *state);
 void hoard_shutdown(struct pk_state *state);
 pk_err_t _hoard_read_chunk(struct pk_state *state, int offset, int length,
-			int crypto, const void *tag, int taglen, void *buf);
+			int crypto, const void *tag, int taglen, void *buf,
+			gboolean quiet);
+unsigned hoard_block_round(unsigned length);
 pk_err_t _hoard_write_chunk(struct pk_state *state, unsigned offset,
 			unsigned length, const void *buf);
 pk_err_t hoard_get_chunk(struct pk_state *state, const void *tag, void *buf,
 			unsigned *len);
 pk_err_t hoard_put_chunk(struct pk_state *state, const void *tag,
 			const void *buf, unsigned len);
+gboolean hoard_has_chunk(struct pk_state *state, const void *tag);
 pk_err_t hoard_sync_refs(struct pk_state *state, gboolean new_chunks);
 pk_err_t hoard_gc(struct pk_state *state);
+pk_err_t hoard_get_stats(struct pk_state *state,
+			struct pk_hoard_stats *parcel,
+			struct pk_hoard_stats *totals);
+void hoard_recount_stats(struct pk_state *state);
 void hoard_invalidate_chunk(struct pk_state *state, int offset,
 			const void *tag, unsigned taglen);
+void hoard_slot_cache_foreach(struct pk_state *state,
+			void (*func)(const void *tag, int offset, int length,
+			void *data), void *data);
+
+/* hoard_map.c */
+/* Chunks in the hoard file are aligned to this boundary */
+#define HOARD_BLOCK_SIZE 4096
+/* Largest chunk the hoard cache will store.  Must be a plain number,
+   since it's pasted into SQL. */
+#define HOARD_MAX_CHUNK_SIZE 4194304
+pk_err_t hoard_map_init(struct pk_state *state);
+void hoard_map_shutdown(struct pk_state *state);
+pk_err_t hoard_map_reserve(struct pk_state *state, unsigned min,
+			unsigned max, int *offset, unsigned *length);
+void hoard_map_release(struct pk_state *state, int offset, unsigned length);
+void hoard_map_release_deferred(struct pk_state *state, int offset,
+			unsigned length);
+void hoard_map_commit(struct pk_state *state);
+void hoard_map_rollback(struct pk_state *state);
+pk_err_t hoard_map_get_usage(struct pk_state *state, off64_t *used,
+			off64_t *end);
+void hoard_map_punch(struct pk_state *state, int offset, unsigned length);
+pk_err_t hoard_map_truncate(struct pk_state *state, int *offset);
+pk_err_t _hoard_map_rebuild(struct pk_state *state, gboolean force);
+
+/* hoard_compact.c */
+pk_err_t hoard_compact_batch(struct pk_state *state, void *buf,
+			unsigned *moved, gboolean *done);
+pk_err_t hoard_compact_truncate(struct pk_state *state);
+pk_err_t hoard_compactor_init(struct pk_state *state);
+void hoard_compactor_shutdown(struct pk_state *state);
+
+/* hoard_tags.c */
+pk_err_t hoard_tags_init(struct pk_state *state);
+void hoard_tags_shutdown(struct pk_state *state);
+void hoard_tags_stop(struct pk_state *state);
+void hoard_tags_refresh(struct pk_state *state);
+pk_err_t hoard_tags_lookup(struct pk_state *state, const void *tag,
+			int *offset, int *length);
+void hoard_tags_add(struct pk_state *state, const void *tag, int offset,
+			int length);
+void hoard_tags_remove(struct pk_state *state, const void *tag);
+void hoard_tags_bump(struct pk_state *state);
+void hoard_tags_changed(struct pk_state *state);
+guint hoard_tag_hash(gconstpointer key);
+gboolean hoard_tag_equal(gconstpointer a, gconstpointer b);
 
 /* hoard_modes.c */
 int hoard(struct pk_state *state);
@@ -258,10 +394,25 @@ int gchoard(struct pk_state *state);
 int check_hoard(struct pk_state *state);
 int hoard_refresh(struct pk_state *state);
 
+/* prefetch.c */
+pk_err_t prefetch_init(struct pk_state *state);
+void prefetch_shutdown(struct pk_state *state);
+void prefetch_miss(struct pk_state *state, unsigned chunk);
+void prefetch_hit(struct pk_state *state, unsigned chunk);
+unsigned prefetch_get_radius(struct pk_state *state);
+
+/* profile.c */
+pk_err_t profile_init(struct pk_state *state);
+void profile_shutdown(struct pk_state *state);
+void profile_touch(struct pk_state *state, unsigned chunk);
+pk_err_t profile_get_order(struct pk_state *state, unsigned max,
+			GArray **chunks);
+
 /* transport.c */
 pk_err_t transport_init(void);
 struct pk_connection_pool *transport_pool_alloc(struct pk_state *state);
 void transport_pool_free(struct pk_connection_pool *cpool);
+void transport_warm(struct pk_connection_pool *cpool);
 pk_err_t transport_fetch_chunk(struct pk_connection_pool *cpool, void *buf,
 			unsigned chunk, const void *tag, unsigned *length);
 
@@ -287,6 +438,11 @@ pk_err_t put_file_lock(int fd);
 pk_err_t acquire_lockfile(struct pk_lockfile **out, const char *path);
 void release_lockfile(struct pk_lockfile *lf);
 pk_err_t create_pidfile(const char *path);
+void *chunk_buf_alloc(struct pk_parcel *parcel);
+void chunk_buf_free(void *buf);
+pk_err_t pwrite_padded(int fd, const void *buf, unsigned len,
+			unsigned padded_len, off64_t offset);
+gboolean buf_is_zero(const void *buf, unsigned len);
 gchar *form_chunk_path(struct pk_parcel *parcel, const char *prefix,
 			unsigned chunk);
 gchar *format_tag(const void *tag, unsigned len);
@@ -297,5 +453,12 @@ pk_err_t cleanup_action(struct db *db, const char *sql,
 void _stats_increment(struct pk_state *state, uint64_t *var, uint64_t val);
 #define stats_increment(state, field, count) \
 	_stats_increment(state, &(state)->stats.field, count)
+uint64_t timestamp_usec(void);
+void xfer_record(struct pk_state *state, enum pk_xfer_source src,
+			unsigned bytes, uint64_t start_usec);
+#define xfer_increment(state, field, count) \
+	__sync_fetch_and_add(&(state)->xfer.field, count)
+#define xfer_get(state, field) \
+	__sync_fetch_and_add(&(state)->xfer.field, 0)
 
 #endif
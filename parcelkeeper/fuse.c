@@ -15,22 +15,40 @@
  * for more details.
  */
 
+
 #include <sys/utsname.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include "defs.h"
 #include "fuse_defs.h"
 #include "config.h"
 
-enum fuse_directory {
-	DIR_ROOT,
-	DIR_STATS,
+/* We use the low-level FUSE API, so that requests are dispatched by inode
+   number rather than path, and reads can be answered directly from chunk
+   buffers. */
+
+/* Inode numbers.  Statistics files, then control files, are numbered
+   from INO_FIRST_FILE in the order that stat_list() and control_list()
+   return them, which is fixed for the life of the process. */
+enum fuse_inode {
+	INO_ROOT = FUSE_ROOT_ID,
+	INO_IMAGE,
+	INO_STATS,
+	INO_CONTROL,
+	INO_FIRST_FILE,
 };
 
+/* Largest read or write request we ask the kernel for.  This is the most
+   that the FUSE protocol allows. */
+#define MAX_IO (128 << 10)
+/* Seconds for which the kernel may cache attributes of files whose size
+   never changes */
+#define ATTR_TIMEOUT 1.0
+
 static const int ignored_signals[]={SIGINT, SIGTERM, SIGUSR1, SIGUSR2,
 			SIGTSTP, SIGTTOU, 0};
 static const int caught_signals[]={SIGQUIT, SIGHUP, 0};
@@ -39,191 +57,469 @@ static void fuse_signal_handler(int sig)
 {
 	sigstate.signal = sig;
 	if (sigstate.fuse != NULL)
-		fuse_exit(sigstate.fuse->fuse);
+		fuse_session_exit(sigstate.fuse->session);
+}
+
+/* Returns the name of the statistics file with inode @ino, or NULL. */
+static const char *stat_file(struct pk_fuse *fuse, fuse_ino_t ino)
+{
+	if (ino < INO_FIRST_FILE || ino >= INO_FIRST_FILE +
+				fuse->stat_file_count)
+		return NULL;
+	return fuse->stat_files[ino - INO_FIRST_FILE];
+}
+
+/* Returns the name of the control file with inode @ino, or NULL. */
+static const char *control_file(struct pk_fuse *fuse, fuse_ino_t ino)
+{
+	fuse_ino_t first = INO_FIRST_FILE + fuse->stat_file_count;
+
+	if (ino < first || ino >= first + fuse->control_file_count)
+		return NULL;
+	return fuse->control_files[ino - first];
+}
+
+static fuse_ino_t find_file(gchar **names, fuse_ino_t first,
+			const char *name)
+{
+	unsigned i;
+
+	for (i = 0; names[i] != NULL; i++)
+		if (g_str_equal(names[i], name))
+			return first + i;
+	return 0;
 }
 
-static int do_getattr(const char *path, struct stat *st)
+/* Returns 0 or a positive error code. */
+static int get_attr(struct pk_state *state, fuse_ino_t ino, struct stat *st)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	const char *name;
 	gchar *value;
 
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
 	st->st_nlink = 1;
 	st->st_uid = getuid();
 	st->st_gid = getgid();
-	st->st_size = 0;
 	st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
 
-	if (g_str_equal(path, "/")) {
-		st->st_nlink = 3;
+	switch (ino) {
+	case INO_ROOT:
+		st->st_nlink = 4;
 		st->st_mode = S_IFDIR | 0500;
-	} else if (g_str_equal(path, "/stats")) {
+		break;
+	case INO_STATS:
+	case INO_CONTROL:
 		st->st_nlink = 2;
 		st->st_mode = S_IFDIR | 0500;
-	} else if (g_str_equal(path, "/image")) {
+		break;
+	case INO_IMAGE:
 		st->st_mode = S_IFREG | 0600;
 		st->st_size = ((off_t) state->parcel->chunks) *
 					state->parcel->chunksize;
-	} else if (g_str_has_prefix(path, "/stats/")) {
-		/* Statistics file */
-		value = stat_get(state, path + strlen("/stats/"));
+		break;
+	default:
+		if ((name = stat_file(state->fuse, ino)) != NULL) {
+			value = stat_get(state, name);
+			st->st_mode = S_IFREG | 0400;
+		} else if ((name = control_file(state->fuse, ino)) != NULL) {
+			value = control_get(state, name);
+			st->st_mode = S_IFREG | 0600;
+		} else {
+			return ENOENT;
+		}
 		if (value == NULL)
-			return -ENOENT;
-		st->st_mode = S_IFREG | 0400;
+			return ENOENT;
 		st->st_size = strlen(value);
 		g_free(value);
-	} else {
-		return -ENOENT;
+		break;
 	}
 	st->st_blocks = (st->st_size + 511) / 512;
 	return 0;
 }
 
-static int do_truncate(const char *path, off_t len)
+/* The size of statistics and control files changes, so the kernel
+   mustn't cache their attributes */
+static double attr_timeout(fuse_ino_t ino)
+{
+	return ino < INO_FIRST_FILE ? ATTR_TIMEOUT : 0;
+}
+
+static void do_init(void *data, struct fuse_conn_info *conn)
 {
+	conn->async_read = 1;
+	conn->max_write = MAX_IO;
+	conn->max_readahead = MAX_IO;
+#ifdef FUSE_CAP_SPLICE_READ
+	/* Older versions of libfuse don't support splice. */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+}
+
+static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct pk_state *state = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	fuse_ino_t ino = 0;
+	int ret;
+
+	switch (parent) {
+	case INO_ROOT:
+		if (g_str_equal(name, "image"))
+			ino = INO_IMAGE;
+		else if (g_str_equal(name, "stats"))
+			ino = INO_STATS;
+		else if (g_str_equal(name, "control"))
+			ino = INO_CONTROL;
+		break;
+	case INO_STATS:
+		ino = find_file(state->fuse->stat_files, INO_FIRST_FILE,
+					name);
+		break;
+	case INO_CONTROL:
+		ino = find_file(state->fuse->control_files, INO_FIRST_FILE +
+					state->fuse->stat_file_count, name);
+		break;
+	}
+	if (ino == 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	ret = get_attr(state, ino, &e.attr);
+	if (ret) {
+		fuse_reply_err(req, ret);
+		return;
+	}
+	e.ino = ino;
+	e.attr_timeout = e.entry_timeout = attr_timeout(ino);
+	fuse_reply_entry(req, &e);
+}
+
+static void do_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct pk_state *state = fuse_req_userdata(req);
 	struct stat st;
 	int ret;
 
-	ret = do_getattr(path, &st);
+	ret = get_attr(state, ino, &st);
+	if (ret)
+		fuse_reply_err(req, ret);
+	else
+		fuse_reply_attr(req, &st, attr_timeout(ino));
+}
+
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi)
+{
+	struct pk_state *state = fuse_req_userdata(req);
+	struct stat st;
+	int ret;
+
+	ret = get_attr(state, ino, &st);
 	if (ret) {
-		return ret;
+		fuse_reply_err(req, ret);
+	} else if (!(to_set & FUSE_SET_ATTR_SIZE)) {
+		/* Timestamps are always reported as the current time, so
+		   we ignore attempts to set them along with the size, as
+		   the kernel does for open(O_TRUNC).  Nothing else can be
+		   changed. */
+		fuse_reply_err(req, ENOSYS);
 	} else if (S_ISDIR(st.st_mode)) {
-		return -EISDIR;
-	} else if (g_str_equal(path, "/image")) {
+		fuse_reply_err(req, EISDIR);
+	} else if (ino == INO_IMAGE ||
+				control_file(state->fuse, ino) != NULL) {
 		/* Pretend to truncate the image file.  This allows
-		   "dd of=image" to work without "conv=notrunc". */
-		return 0;
+		   "dd of=image" to work without "conv=notrunc".  Control
+		   files are replaced by each write, so truncating them
+		   does nothing either. */
+		fuse_reply_attr(req, &st, attr_timeout(ino));
 	} else {
-		return -EPERM;
+		fuse_reply_err(req, EPERM);
 	}
 }
 
-static int do_open(const char *path, struct fuse_file_info *fi)
+static void do_open(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	struct pk_state *state = fuse_req_userdata(req);
+	const char *name;
 	int fh;
 
-	if (g_str_has_prefix(path, "/stats/")) {
+	if (ino == INO_IMAGE) {
+		fi->fh = 0;
+	} else if ((name = stat_file(state->fuse, ino)) != NULL) {
 		/* Statistics file */
-		fh = stat_open(state, path + strlen("/stats/"));
-		if (fh < 0)
-			return fh;
+		fh = stat_open(state, name);
+		if (fh < 0) {
+			fuse_reply_err(req, -fh);
+			return;
+		}
+		fi->fh = fh;
+	} else if ((name = control_file(state->fuse, ino)) != NULL) {
+		/* Control file */
+		fh = control_open(state, name);
+		if (fh < 0) {
+			fuse_reply_err(req, -fh);
+			return;
+		}
 		fi->fh = fh;
-	} else if (!g_str_equal(path, "/image")) {
-		return -ENOENT;
+		/* Don't cache the value across writes */
+		fi->direct_io = 1;
+	} else if (ino == INO_ROOT || ino == INO_STATS ||
+				ino == INO_CONTROL) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	} else {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	return 0;
+	if (fuse_reply_open(req, fi) && fi->fh)
+		stat_release(state, fi->fh);
 }
 
-static int do_read(const char *path, char *buf, size_t count, off_t start,
-			struct fuse_file_info *fi)
+/* Called by image_read_direct() while the chunk buffer is held */
+static void reply_read(void *arg, const void *buf, size_t count)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	fuse_req_t req = arg;
+#ifdef HAVE_FUSE_BUFVEC
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(count);
+
+	bufv.buf[0].mem = (void *) buf;
+	fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+#else
+	fuse_reply_buf(req, buf, count);
+#endif
+}
+
+static void do_read(fuse_req_t req, fuse_ino_t ino, size_t count,
+			off_t start, struct fuse_file_info *fi)
+{
+	struct pk_state *state = fuse_req_userdata(req);
+	char *buf;
+	int ret;
+
+	if (fi->fh) {
+		buf = g_malloc(count);
+		ret = stat_read(state, fi->fh, buf, start, count);
+		if (ret < 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_buf(req, buf, ret);
+		g_free(buf);
+		return;
+	}
+	ret = image_read_direct(state, start, count, reply_read, req);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+}
+
+static void reply_write(fuse_req_t req, int ret)
+{
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void do_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			size_t count, off_t start, struct fuse_file_info *fi)
+{
+	struct pk_state *state = fuse_req_userdata(req);
 
 	if (fi->fh)
-		return stat_read(state, fi->fh, buf, start, count);
+		reply_write(req, control_write(state, fi->fh, buf, start,
+					count));
 	else
-		return image_read(state, buf, start, count);
+		reply_write(req, image_write(state, buf, start, count));
 }
 
-static int do_write(const char *path, const char *buf, size_t count,
-			off_t start, struct fuse_file_info *fi)
+#ifdef HAVE_FUSE_BUFVEC
+/* Called by image_write_copy() to take the next part of the write from
+   the request, which may still be in the pipe it was spliced into */
+static ssize_t copy_write(void *arg, void *dst, size_t count)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	struct fuse_bufvec *src = arg;
+	struct fuse_bufvec dstv = FUSE_BUFVEC_INIT(count);
 
-	g_assert(fi->fh == 0);
-	return image_write(state, buf, start, count);
+	dstv.buf[0].mem = dst;
+	return fuse_buf_copy(&dstv, src, 0);
 }
 
-static int do_statfs(const char *path, struct statvfs *st)
+static void do_write_buf(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_bufvec *bufv, off_t start,
+			struct fuse_file_info *fi)
+{
+	struct pk_state *state = fuse_req_userdata(req);
+	size_t count = fuse_buf_size(bufv);
+	char *buf;
+	ssize_t ret;
+
+	if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+		/* Already in memory */
+		do_write(req, ino, bufv->buf[0].mem, count, start, fi);
+	} else if (fi->fh) {
+		buf = g_malloc(count);
+		ret = copy_write(bufv, buf, count);
+		if (ret < 0)
+			fuse_reply_err(req, -ret);
+		else
+			reply_write(req, control_write(state, fi->fh, buf,
+						start, ret));
+		g_free(buf);
+	} else {
+		reply_write(req, image_write_copy(state, copy_write, bufv,
+					start, count));
+	}
+}
+#endif
+
+static void do_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	struct pk_state *state = fuse_req_userdata(req);
+	struct statvfs st;
 	unsigned validchunks;
 
-	if (cache_count_chunks(state, &validchunks, NULL))
-		return -EIO;
-	st->f_bsize = state->parcel->chunksize;
-	st->f_blocks = state->parcel->chunks;
-	st->f_bfree = st->f_bavail = state->parcel->chunks - validchunks;
-	st->f_namemax = 256;
-	return 0;
+	if (cache_count_chunks(state, &validchunks, NULL)) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = state->parcel->chunksize;
+	st.f_blocks = state->parcel->chunks;
+	st.f_bfree = st.f_bavail = state->parcel->chunks - validchunks;
+	st.f_namemax = 256;
+	fuse_reply_statfs(req, &st);
 }
 
-static int do_release(const char *path, struct fuse_file_info *fi)
+static void do_release(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	struct pk_state *state = fuse_req_userdata(req);
 
 	if (fi->fh)
 		stat_release(state, fi->fh);
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+static void do_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info *fi)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
+	struct pk_state *state = fuse_req_userdata(req);
 	int ret;
 
-	if (fi->fh)
-		return -EINVAL;
+	if (fi->fh) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
 	/* Write out dirty chunks */
-	image_sync(state);
+	ret = image_sync(state);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
 	/* Synchronize the cache file.  Note that we do not synchronize the
 	   SQLite databases. */
 	if (datasync)
 		ret = fdatasync(state->cache_fd);
 	else
 		ret = fsync(state->cache_fd);
-	if (ret)
-		return -errno;
-	return 0;
+	fuse_reply_err(req, ret ? errno : 0);
 }
 
-static int do_opendir(const char *path, struct fuse_file_info *fi)
+static void dir_add(fuse_req_t req, GByteArray *dir, const char *name,
+			fuse_ino_t ino)
 {
-	if (g_str_equal(path, "/"))
-		fi->fh = DIR_ROOT;
-	else if (g_str_equal(path, "/stats"))
-		fi->fh = DIR_STATS;
-	else
-		return -ENOENT;
-	return 0;
+	struct stat st;
+	size_t start = dir->len;
+	size_t len;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	g_byte_array_set_size(dir, start + len);
+	fuse_add_direntry(req, (char *) dir->data + start, len, name, &st,
+				dir->len);
 }
 
-static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			off_t off, struct fuse_file_info *fi)
+/* The directory listing is built at open, so that it doesn't change
+   between readdir calls */
+static void do_opendir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
 {
-	struct pk_state *state = fuse_get_context()->private_data;
-	gchar **stats;
-	gchar **cur;
-
-	switch (fi->fh) {
-	case DIR_ROOT:
-		filler(buf, "image", NULL, 0);
-		filler(buf, "stats", NULL, 0);
-		return 0;
-	case DIR_STATS:
-		for (cur = stats = stat_list(state); *cur != NULL; cur++)
-			filler(buf, *cur, NULL, 0);
-		g_strfreev(stats);
-		return 0;
-	default:
-		return -EIO;
+	struct pk_state *state = fuse_req_userdata(req);
+	GByteArray *dir;
+	fuse_ino_t first;
+	unsigned i;
+
+	if (ino != INO_ROOT && ino != INO_STATS && ino != INO_CONTROL) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	dir = g_byte_array_new();
+	dir_add(req, dir, ".", ino);
+	dir_add(req, dir, "..", INO_ROOT);
+	switch (ino) {
+	case INO_ROOT:
+		dir_add(req, dir, "image", INO_IMAGE);
+		dir_add(req, dir, "stats", INO_STATS);
+		dir_add(req, dir, "control", INO_CONTROL);
+		break;
+	case INO_STATS:
+		for (i = 0; i < state->fuse->stat_file_count; i++)
+			dir_add(req, dir, state->fuse->stat_files[i],
+						INO_FIRST_FILE + i);
+		break;
+	case INO_CONTROL:
+		first = INO_FIRST_FILE + state->fuse->stat_file_count;
+		for (i = 0; i < state->fuse->control_file_count; i++)
+			dir_add(req, dir, state->fuse->control_files[i],
+						first + i);
+		break;
 	}
+	fi->fh = (uintptr_t) dir;
+	if (fuse_reply_open(req, fi))
+		g_byte_array_free(dir, TRUE);
 }
 
-static const struct fuse_operations pk_fuse_ops = {
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t count,
+			off_t start, struct fuse_file_info *fi)
+{
+	GByteArray *dir = (GByteArray *) (uintptr_t) fi->fh;
+
+	if (start < (off_t) dir->len)
+		fuse_reply_buf(req, (char *) dir->data + start,
+					MIN(dir->len - (size_t) start, count));
+	else
+		fuse_reply_buf(req, NULL, 0);
+}
+
+static void do_releasedir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	g_byte_array_free((GByteArray *) (uintptr_t) fi->fh, TRUE);
+	fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops pk_fuse_ops = {
+	.init = do_init,
+	.lookup = do_lookup,
 	.getattr = do_getattr,
-	.truncate = do_truncate,
+	.setattr = do_setattr,
 	.open = do_open,
 	.read = do_read,
 	.write = do_write,
+#ifdef HAVE_FUSE_BUFVEC
+	.write_buf = do_write_buf,
+#endif
 	.statfs = do_statfs,
 	.release = do_release,
 	.fsync = do_fsync,
 	.opendir = do_opendir,
 	.readdir = do_readdir,
-#ifdef HAVE_FUSE_NULLPATH_OK
-	.flag_nullpath_ok = 1,
-#endif
+	.releasedir = do_releasedir,
 };
 
 pk_err_t fuse_init(struct pk_state *state)
@@ -256,9 +552,17 @@ pk_err_t fuse_init(struct pk_state *state)
 	/* Set up data structures */
 	state->fuse = g_slice_new0(struct pk_fuse);
 	stat_init(state);
+	state->fuse->stat_files = stat_list(state);
+	state->fuse->stat_file_count = g_strv_length(state->fuse->stat_files);
+	state->fuse->control_files = control_list(state);
+	state->fuse->control_file_count = g_strv_length(
+				state->fuse->control_files);
 	ret = image_init(state);
 	if (ret)
 	        goto bad_dealloc;
+	ret = tune_init(state);
+	if (ret)
+		goto bad_dealloc_image;
 
 	/* Create mountpoint and canonical symlink.  We mount the filesystem
 	   off of /var/tmp because mounting it in $HOME will cause Nautilus
@@ -302,6 +606,7 @@ pk_err_t fuse_init(struct pk_state *state)
 		   will fail. */
 		g_ptr_array_add(argv, g_strdup("-oallow_root"));
 	}
+	g_ptr_array_add(argv, g_strdup_printf("-omax_read=%u", MAX_IO));
 	g_ptr_array_add(argv, NULL);
 	args.argv = (gchar **) g_ptr_array_free(argv, FALSE);
 	args.argc = g_strv_length(args.argv);
@@ -318,14 +623,15 @@ pk_err_t fuse_init(struct pk_state *state)
 		ret = PK_IOERR;
 		goto bad_unflag;
 	}
-	state->fuse->fuse = fuse_new(state->fuse->chan, &args, &pk_fuse_ops,
+	state->fuse->session = fuse_lowlevel_new(&args, &pk_fuse_ops,
 				sizeof(pk_fuse_ops), state);
 	g_strfreev(args.argv);
-	if (state->fuse->fuse == NULL) {
+	if (state->fuse->session == NULL) {
 		pk_log(LOG_ERROR, "Couldn't create FUSE filesystem");
 		ret = PK_CALLFAIL;
 		goto bad_unmount;
 	}
+	fuse_session_add_chan(state->fuse->session, state->fuse->chan);
 
 	/* Register FUSE-specific signal handler */
 	sigstate.fuse = state->fuse;
@@ -336,14 +642,16 @@ pk_err_t fuse_init(struct pk_state *state)
 	/* If there's already a signal pending from the generic handlers,
 	   make sure we respect it */
 	if (pending_signal())
-		fuse_exit(state->fuse->fuse);
+		fuse_session_exit(state->fuse->session);
 
 	pk_log(LOG_INFO, "Initialized FUSE");
 	return PK_SUCCESS;
 
 bad_destroy_fuse:
 	sigstate.fuse = NULL;
-	fuse_destroy(state->fuse->fuse);
+	/* Destroying the session would destroy the channel too */
+	fuse_session_remove_chan(state->fuse->chan);
+	fuse_session_destroy(state->fuse->session);
 bad_unmount:
 	fuse_unmount(state->fuse->mountpoint, state->fuse->chan);
 bad_unflag:
@@ -357,8 +665,12 @@ bad_rmdir:
 					state->fuse->mountpoint);
 bad_dealloc_mountpoint:
 	g_free(state->fuse->mountpoint);
+	tune_shutdown(state);
+bad_dealloc_image:
 	image_shutdown(state);
 bad_dealloc:
+	g_strfreev(state->fuse->control_files);
+	g_strfreev(state->fuse->stat_files);
 	stat_shutdown(state, FALSE);
 	g_slice_free(struct pk_fuse, state->fuse);
 	return ret;
@@ -369,9 +681,9 @@ void fuse_run(struct pk_state *state)
 	int sig;
 
 	if (state->conf->flags & WANT_SINGLE_THREAD)
-		fuse_loop(state->fuse->fuse);
+		fuse_session_loop(state->fuse->session);
 	else
-		fuse_loop_mt(state->fuse->fuse);
+		fuse_session_loop_mt(state->fuse->session);
 	sig = pending_signal();
 	if (sig)
 		pk_log(LOG_INFO, "Caught signal %d, shutting down FUSE "
@@ -393,8 +705,12 @@ void fuse_run(struct pk_state *state)
 void fuse_shutdown(struct pk_state *state)
 {
 	sigstate.fuse = NULL;
-	fuse_destroy(state->fuse->fuse);
+	/* fuse_unmount() has already destroyed the channel */
+	fuse_session_destroy(state->fuse->session);
+	tune_shutdown(state);
 	image_shutdown(state);
+	g_strfreev(state->fuse->control_files);
+	g_strfreev(state->fuse->stat_files);
 	stat_shutdown(state, TRUE);
 	if (!state->fuse->leave_dirty)
 		cache_clear_flag(state, CA_F_DIRTY);
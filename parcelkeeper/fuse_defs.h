@@ -20,29 +20,120 @@
 
 /* Shared header for source files in the FUSE module. */
 
+/* Lists of the chunk cache replacement policy.  Under LRU, every entry is
+   on the recent list. */
+enum cache_list {
+	CACHE_RECENT,		/* referenced once since being loaded */
+	CACHE_FREQUENT,		/* referenced again, or was a ghost */
+	CACHE_LISTS
+};
+
+/* Number of condition variables shared by cache entries for waiting on the
+   busy flag */
+#define CACHE_WAIT_QUEUES 16
+
+/* How the chunk buffer arena is backed */
+enum arena_backing {
+	ARENA_SMALL_PAGES,
+	ARENA_TRANSPARENT_HUGE,	/* madvise(MADV_HUGEPAGE) */
+	ARENA_HUGETLB,		/* MAP_HUGETLB */
+};
+
+struct cache_entry;
+
+/* Intrusive list of cache entries */
+struct entry_list {
+	struct cache_entry *head;
+	struct cache_entry *tail;
+	unsigned length;
+};
+
+/* Called by image_read_direct() with the data for a read */
+typedef void (image_reply_fn)(void *arg, const void *buf, size_t count);
+/* Called by image_write_copy() to obtain the next @count bytes of a write.
+   Returns the number of bytes stored at @dst, or a negative error code. */
+typedef ssize_t (image_copy_fn)(void *arg, void *dst, size_t count);
+
 struct pk_fuse {
 	/* Fileystem handles */
-	struct fuse *fuse;
+	struct fuse_session *session;
 	struct fuse_chan *chan;
 	gchar *mountpoint;
 
 	/* Chunk cache */
 	struct {
 		GMutex *lock;
-		GHashTable *chunks;
-		GQueue *dirty;
-		GQueue *reclaimable;
+		/* Entries indexed by chunk number, in pages which are
+		   allocated on first use */
+		struct cache_entry **entries;
+		unsigned pages;
+		GCond *wait[CACHE_WAIT_QUEUES];
+		struct entry_list dirty;
+		/* Dirty entries whose partial writes couldn't be merged
+		   with the chunk's old contents, oldest failure first */
+		struct entry_list failed;
+		/* Unbusy entries with buffers, least recently released
+		   first */
+		struct entry_list reclaimable[CACHE_LISTS];
 		GCond *reclaimable_cond;
-		unsigned allocatable;
+		/* Chunk buffers are carved in order from a single arena
+		   sized for the largest allowed cache, or for the startup
+		   cache if it is backed by hugetlb pages.  Buffers released
+		   when the cache shrinks are kept on the free stack, and
+		   their memory is returned to the system when no buffer
+		   in the same huge page is in use. */
+		char *arena;
+		size_t arena_size;
+		enum arena_backing arena_backing;
+		gboolean arena_locked;
+		unsigned *huge_users;	/* buffers using each huge page */
+		unsigned max_buffers;
+		unsigned carved;
+		char **free_buffers;
+		unsigned free_count;
 		gboolean stopping;
+
+		/* Replacement policy state */
+		enum pk_cache_policy policy;
+		unsigned capacity;	/* entries; may change at runtime */
+		unsigned resident[CACHE_LISTS];
+		/* Chunks recently evicted from each list, oldest first */
+		struct entry_list ghosts[CACHE_LISTS];
+		/* ARC's target size for the recent list */
+		unsigned target;
+		/* Number of chunks loaded into the cache so far */
+		unsigned loads;
+
+		/* Writeback from snapshots of dirty buffers */
+		unsigned writebacks;	/* in progress */
+		gboolean write_failed;	/* data has been lost */
+		GCond *writeback_cond;
+		GQueue *spares;		/* unused snapshot buffers */
+
+		/* A chunk of zeroes, for replying to reads of zero chunks
+		   in place */
+		void *zeroes;
+
+		/* Threads loading cold chunks of multi-chunk reads; NULL
+		   if running single-threaded */
+		GThreadPool *loaders;
 	} image;
 	struct {
 		GThread *thread;
 		GCond *cond;
 	} cleaner;
+	/* Cache size tuning from memory pressure; see fuse_tune.c */
+	struct pk_tune *tune;
+
+	/* Names of statistics and control files, indexed by inode number */
+	gchar **stat_files;
+	unsigned stat_file_count;
+	gchar **control_files;
+	unsigned control_file_count;
 
-	/* Open statistics files */
+	/* Open statistics and control files */
 	GHashTable *stat_buffers;
+	GHashTable *control_names;	/* file handle -> control name */
 	GMutex *stat_buffer_lock;
 
 	/* Leave the local cache file dirty flag set at shutdown to force
@@ -56,7 +147,17 @@ void image_shutdown(struct pk_state *state);
 int image_read(struct pk_state *state, char *buf, off_t start, size_t count);
 int image_write(struct pk_state *state, const char *buf, off_t start,
 			size_t count);
-void image_sync(struct pk_state *state);
+int image_read_direct(struct pk_state *state, off_t start, size_t count,
+			image_reply_fn *reply, void *arg);
+int image_write_copy(struct pk_state *state, image_copy_fn *copy, void *arg,
+			off_t start, size_t count);
+int image_sync(struct pk_state *state);
+const char *image_arena_backing_name(enum arena_backing backing);
+uint64_t image_arena_huge_kb(struct pk_state *state);
+unsigned image_get_cache_size(struct pk_state *state);
+unsigned image_get_max_cache_size(struct pk_state *state);
+pk_err_t image_set_cache_size(struct pk_state *state, unsigned mb);
+void image_shrink(struct pk_state *state);
 
 /* fuse_stats.c */
 gchar **stat_list(struct pk_state *state);
@@ -67,5 +168,16 @@ int stat_read(struct pk_state *state, int fh, char *buf, off_t start,
 void stat_release(struct pk_state *state, int fh);
 void stat_init(struct pk_state *state);
 void stat_shutdown(struct pk_state *state, gboolean normal);
+gchar **control_list(struct pk_state *state);
+gchar *control_get(struct pk_state *state, const char *name);
+int control_open(struct pk_state *state, const char *name);
+int control_write(struct pk_state *state, int fh, const char *buf,
+			off_t start, size_t count);
+
+/* fuse_tune.c */
+pk_err_t tune_init(struct pk_state *state);
+void tune_shutdown(struct pk_state *state);
+pk_err_t tune_set_enabled(struct pk_state *state, gboolean enabled);
+gboolean tune_get_enabled(struct pk_state *state);
 
 #endif
@@ -15,8 +15,10 @@
  * for more details.
  */
 
+#include <sys/mman.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <time.h>
 #include <errno.h>
 #include "defs.h"
@@ -25,18 +27,78 @@
 #define MAX_CACHE_MULT 1
 #define MAX_CACHE_DIV 10
 #define DIRTY_WRITEBACK_DELAY 5 /* seconds */
+/* Once more than DIRTY_HIGH_PCT of the cache is dirty, the cleaner writes
+   back the oldest dirty entries, whatever their age, until no more than
+   DIRTY_LOW_PCT is */
+#define DIRTY_HIGH_PCT 40
+#define DIRTY_LOW_PCT 20
+/* Once the cache is within this fraction of its capacity of being full,
+   the cleaner also keeps that many entries at the front of each
+   reclaimable list clean, so that demand reclaim rarely has to write back
+   a chunk in the guest's I/O thread */
+#define CLEAN_RESERVE_DIV 16
+#define CLEAN_RESERVE_MIN 4
+/* Longest the cleaner sleeps while any entries are dirty */
+#define PRECLEAN_INTERVAL 1 /* seconds */
+/* A hit on a recently loaded entry only counts as a second reference if
+   at least this many other chunks have been loaded since.  Otherwise a
+   sequential scan, which makes many small accesses to each chunk in quick
+   succession, would promote every chunk it touches. */
+#define CORRELATED_LOADS 8
+/* Granularity at which we track the parts of a chunk the guest has
+   written before the rest of the chunk has been loaded */
+#define ABSORB_BLOCK 512
+/* Snapshot buffers kept for reuse by later writebacks */
+#define WRITEBACK_SPARES 2
+/* Cache entries are allocated this many at a time */
+#define ENTRY_PAGE_SHIFT 10
+#define ENTRY_PAGE_SIZE (1 << ENTRY_PAGE_SHIFT)
+/* The buffer arena is rounded up to a multiple of this, so that it can be
+   backed entirely by huge pages */
+#define ARENA_HUGE_PAGE (2 << 20)
+/* Threads loading the cold chunks of a multi-chunk read concurrently */
+#define MISS_LOADERS 8
+/* Offset by one so that chunk 0 isn't a NULL pool item */
+#define CHUNK_ITEM(chunk) GUINT_TO_POINTER((chunk) + 1)
+
+enum entry_link_type {
+	LINK_DIRTY,		/* dirty list */
+	LINK_LRU,		/* reclaimable list if data != NULL, else
+				   ghost list */
+	LINK_TYPES
+};
+
+/* What entry_acquire() should put in a newly allocated buffer */
+enum entry_fill {
+	FILL_DATA,		/* the chunk's contents */
+	FILL_PARTIAL,		/* nothing; caller writes part of it and
+				   the rest is merged in later */
+	FILL_NONE,		/* nothing; caller writes all of it */
+};
+
+struct entry_link {
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct entry_list *list;	/* NULL if not on a list */
+};
 
 struct cache_entry {
 	/* Protected by image lock */
 	unsigned chunk;
 	gboolean busy;
 	unsigned waiters;
-	GCond *available;
-	GList *dirty_link;
-	GList *reclaimable_link;
+	struct entry_link links[LINK_TYPES];
+	gboolean writeback;	/* snapshot being written back */
+	unsigned generation;	/* incremented whenever dirtied */
+	enum cache_list list;	/* valid if data != NULL */
+	unsigned loaded;	/* value of image.loads when loaded */
 
 	/* Protected by busy flag */
 	void *data;		/* NULL if no buffer allocated */
+	/* If data has only been partially loaded, a bitmap of the blocks
+	   the guest has written; otherwise NULL */
+	guint8 *valid;
+	unsigned valid_blocks;
 	time_t dirty;		/* 0 if clean */
 	gboolean error;
 };
@@ -56,20 +118,326 @@ struct io_cursor {
 };
 
 
-static void queue_push_tail_with_link(GQueue *queue, GList **link, void *data)
+static void list_push_tail(struct entry_list *list, struct cache_entry *ent,
+			enum entry_link_type type)
+{
+	struct entry_link *link = &ent->links[type];
+
+	g_assert(link->list == NULL);
+	link->list = list;
+	link->prev = list->tail;
+	link->next = NULL;
+	if (list->tail != NULL)
+		list->tail->links[type].next = ent;
+	else
+		list->head = ent;
+	list->tail = ent;
+	list->length++;
+}
+
+static void list_push_head(struct entry_list *list, struct cache_entry *ent,
+			enum entry_link_type type)
+{
+	struct entry_link *link = &ent->links[type];
+
+	g_assert(link->list == NULL);
+	link->list = list;
+	link->prev = NULL;
+	link->next = list->head;
+	if (list->head != NULL)
+		list->head->links[type].prev = ent;
+	else
+		list->tail = ent;
+	list->head = ent;
+	list->length++;
+}
+
+/* No-op if @ent is not on a list of this type */
+static void list_remove(struct cache_entry *ent, enum entry_link_type type)
+{
+	struct entry_link *link = &ent->links[type];
+	struct entry_list *list = link->list;
+
+	if (list == NULL)
+		return;
+	if (link->prev != NULL)
+		link->prev->links[type].next = link->next;
+	else
+		list->head = link->next;
+	if (link->next != NULL)
+		link->next->links[type].prev = link->prev;
+	else
+		list->tail = link->prev;
+	list->length--;
+	link->list = NULL;
+	link->prev = NULL;
+	link->next = NULL;
+}
+
+/* Return the entry for @chunk, allocating its page if @create is TRUE.
+   Returns NULL if the page doesn't exist and @create is FALSE.  Image lock
+   must be held. */
+static struct cache_entry *entry_lookup(struct pk_state *state,
+			unsigned chunk, gboolean create)
+{
+	struct cache_entry **page;
+	unsigned i;
+
+	page = &state->fuse->image.entries[chunk >> ENTRY_PAGE_SHIFT];
+	if (*page == NULL) {
+		if (!create)
+			return NULL;
+		*page = g_new0(struct cache_entry, ENTRY_PAGE_SIZE);
+		for (i = 0; i < ENTRY_PAGE_SIZE; i++)
+			(*page)[i].chunk = (chunk & ~(ENTRY_PAGE_SIZE - 1)) + i;
+	}
+	return &(*page)[chunk & (ENTRY_PAGE_SIZE - 1)];
+}
+
+/* Returns TRUE if the entry holds data or is held or awaited by some
+   thread.  Image lock must be held. */
+static gboolean entry_in_use(struct cache_entry *ent)
+{
+	return ent != NULL && (ent->data != NULL || ent->busy ||
+				ent->waiters > 0);
+}
+
+/* Entries share a small pool of condition variables for waiting on the
+   busy flag, so waking must be done with a broadcast */
+static GCond *entry_wait_queue(struct pk_state *state,
+			struct cache_entry *ent)
+{
+	return state->fuse->image.wait[ent->chunk % CACHE_WAIT_QUEUES];
+}
+
+/* Image lock must be held */
+static unsigned image_resident(struct pk_state *state)
 {
-	g_assert(*link == NULL);
-	*link = g_list_alloc();
-	(*link)->data = data;
-	g_queue_push_tail_link(queue, *link);
+	return state->fuse->image.resident[CACHE_RECENT] +
+				state->fuse->image.resident[CACHE_FREQUENT];
 }
 
-static void queue_delete_with_link(GQueue *queue, GList **link)
+/* Return the index of the huge page containing byte @offset of the
+   arena */
+static unsigned arena_huge_page(size_t offset)
 {
-	if (*link != NULL) {
-		g_queue_delete_link(queue, *link);
-		*link = NULL;
+	return offset / ARENA_HUGE_PAGE;
+}
+
+/* Get an unused chunk buffer.  The caller must ensure that the cache is
+   below capacity.  Image lock must be held. */
+static void *arena_get(struct pk_state *state)
+{
+	struct pk_fuse *fuse = state->fuse;
+	size_t offset;
+	unsigned page;
+	char *buf;
+
+	if (fuse->image.free_count > 0)
+		buf = fuse->image.free_buffers[--fuse->image.free_count];
+	else
+		buf = fuse->image.arena + (size_t) fuse->image.carved++ *
+					state->parcel->chunksize;
+	g_assert(buf < fuse->image.arena + fuse->image.arena_size);
+	offset = buf - fuse->image.arena;
+	for (page = arena_huge_page(offset); page <= arena_huge_page(offset +
+				state->parcel->chunksize - 1); page++)
+		fuse->image.huge_users[page]++;
+	if (fuse->image.arena_locked && mlock(buf, state->parcel->chunksize)) {
+		pk_log(LOG_WARNING, "Couldn't lock chunk buffer into "
+					"memory: %s", strerror(errno));
+		fuse->image.arena_locked = FALSE;
 	}
+	return buf;
+}
+
+/* Return a chunk buffer to the arena.  Memory is released a whole huge
+   page at a time, once no buffer in the page is in use, so that transparent
+   huge pages aren't split.  hugetlb memory can't be released at all.
+   Image lock must be held. */
+static void arena_put(struct pk_state *state, void *buf)
+{
+	struct pk_fuse *fuse = state->fuse;
+	size_t offset = (char *) buf - fuse->image.arena;
+	unsigned page;
+
+	if (fuse->image.arena_locked)
+		munlock(buf, state->parcel->chunksize);
+	for (page = arena_huge_page(offset); page <= arena_huge_page(offset +
+				state->parcel->chunksize - 1); page++)
+		if (--fuse->image.huge_users[page] == 0 &&
+					fuse->image.arena_backing !=
+					ARENA_HUGETLB)
+			madvise(fuse->image.arena + (size_t) page *
+						ARENA_HUGE_PAGE,
+						ARENA_HUGE_PAGE,
+						MADV_DONTNEED);
+	fuse->image.free_buffers[fuse->image.free_count++] = buf;
+}
+
+/* Remember that @ent was evicted from @list.  Image lock must be held, and
+   @ent must have no buffer. */
+static void ghost_add(struct pk_state *state, enum cache_list list,
+			struct cache_entry *ent)
+{
+	struct entry_list *ghosts = &state->fuse->image.ghosts[list];
+
+	list_push_tail(ghosts, ent, LINK_LRU);
+	/* The capacity may have shrunk since the last time */
+	while (ghosts->length > state->fuse->image.capacity)
+		list_remove(ghosts->head, LINK_LRU);
+}
+
+/* Forget @ent if it was recently evicted from @list, and return whether
+   it was.  Image lock must be held. */
+static gboolean ghost_remove(struct pk_state *state, enum cache_list list,
+			struct cache_entry *ent)
+{
+	if (ent->links[LINK_LRU].list != &state->fuse->image.ghosts[list])
+		return FALSE;
+	list_remove(ent, LINK_LRU);
+	return TRUE;
+}
+
+/* Choose the list for an entry which has just been given a buffer.  A
+   chunk that was evicted recently goes on the frequent list, since a
+   larger cache would still have it.  Under ARC, the list whose ghost was
+   hit gets a larger share of the cache.  Image lock must be held. */
+static void policy_admit(struct pk_state *state, struct cache_entry *ent)
+{
+	struct pk_fuse *fuse = state->fuse;
+	unsigned recent = fuse->image.ghosts[CACHE_RECENT].length;
+	unsigned frequent = fuse->image.ghosts[CACHE_FREQUENT].length;
+	unsigned delta;
+
+	ent->list = CACHE_RECENT;
+	ent->loaded = ++fuse->image.loads;
+	if (ghost_remove(state, CACHE_RECENT, ent)) {
+		stats_increment(state, cache_ghost_hits_recent, 1);
+		delta = MAX(frequent / recent, 1);
+		fuse->image.target = MIN(fuse->image.target + delta,
+					fuse->image.capacity);
+		ent->list = CACHE_FREQUENT;
+	} else if (ghost_remove(state, CACHE_FREQUENT, ent)) {
+		stats_increment(state, cache_ghost_hits_frequent, 1);
+		delta = MAX(recent / frequent, 1);
+		fuse->image.target -= MIN(fuse->image.target, delta);
+		ent->list = CACHE_FREQUENT;
+	}
+	if (fuse->image.policy == CACHE_POLICY_LRU)
+		ent->list = CACHE_RECENT;
+	fuse->image.resident[ent->list]++;
+}
+
+/* Account for a cache hit on @ent.  2Q never promotes on a hit, since
+   recently loaded entries which are referenced again soon are usually
+   part of the same burst of access.  Image lock must be held. */
+static void policy_hit(struct pk_state *state, struct cache_entry *ent)
+{
+	struct pk_fuse *fuse = state->fuse;
+
+	if (fuse->image.policy != CACHE_POLICY_ARC ||
+				ent->list != CACHE_RECENT ||
+				fuse->image.loads - ent->loaded <
+				CORRELATED_LOADS)
+		return;
+	fuse->image.resident[CACHE_RECENT]--;
+	fuse->image.resident[CACHE_FREQUENT]++;
+	ent->list = CACHE_FREQUENT;
+}
+
+/* Pick the entry whose buffer should be reclaimed.  The preferred list may
+   have no reclaimable entries if they're all busy, in which case we take
+   one from the other list.  Image lock must be held, and at least one
+   entry must be reclaimable. */
+static struct cache_entry *policy_victim(struct pk_state *state)
+{
+	struct pk_fuse *fuse = state->fuse;
+	unsigned recent = fuse->image.resident[CACHE_RECENT];
+	enum cache_list list;
+
+	switch (fuse->image.policy) {
+	case CACHE_POLICY_2Q:
+		/* Fixed share of the cache for chunks seen once */
+		list = recent > fuse->image.capacity / 4 ? CACHE_RECENT :
+					CACHE_FREQUENT;
+		break;
+	case CACHE_POLICY_ARC:
+		list = recent > fuse->image.target ? CACHE_RECENT :
+					CACHE_FREQUENT;
+		break;
+	default:
+		list = CACHE_RECENT;
+		break;
+	}
+	if (fuse->image.reclaimable[list].head == NULL)
+		list = !list;
+	return fuse->image.reclaimable[list].head;
+}
+
+/* Number of entries at the front of each reclaimable list that the
+   cleaner keeps clean */
+static unsigned clean_reserve(struct pk_state *state)
+{
+	return MAX(CLEAN_RESERVE_MIN, state->fuse->image.capacity /
+				CLEAN_RESERVE_DIV);
+}
+
+/* Return the first clean entry in replacement order, looking no more than
+   @limit entries into each reclaimable list, or NULL if there is none.
+   Image lock must be held. */
+static struct cache_entry *policy_clean_victim(struct pk_state *state,
+			unsigned limit)
+{
+	struct cache_entry *victim;
+	struct cache_entry *ent;
+	unsigned n;
+
+	victim = policy_victim(state);
+	if (victim == NULL)
+		return NULL;
+	/* Prefer the victim's list, but take any clean entry */
+	for (ent = victim, n = 0; ent != NULL && n < limit;
+				ent = ent->links[LINK_LRU].next, n++)
+		if (!ent->dirty)
+			return ent;
+	for (ent = state->fuse->image.reclaimable[!victim->list].head, n = 0;
+				ent != NULL && n < limit;
+				ent = ent->links[LINK_LRU].next, n++)
+		if (!ent->dirty)
+			return ent;
+	return NULL;
+}
+
+/* Return the first entry on the dirty list within the clean reserve of
+   either reclaimable list, or NULL.  Entries waiting to retry a failed
+   merge are skipped.  Image lock must be held. */
+static struct cache_entry *policy_reserve_dirty(struct pk_state *state)
+{
+	struct cache_entry *ent;
+	unsigned limit = clean_reserve(state);
+	unsigned list;
+	unsigned n;
+
+	for (list = 0; list < CACHE_LISTS; list++)
+		for (ent = state->fuse->image.reclaimable[list].head, n = 0;
+					ent != NULL && n < limit;
+					ent = ent->links[LINK_LRU].next, n++)
+			if (ent->links[LINK_DIRTY].list ==
+						&state->fuse->image.dirty)
+				return ent;
+	return NULL;
+}
+
+/* Account for the removal of @ent's buffer.  Busy flag and image lock
+   must be held. */
+static void policy_evict(struct pk_state *state, struct cache_entry *ent)
+{
+	/* A partially-loaded buffer's bitmap goes with it */
+	g_free(ent->valid);
+	ent->valid = NULL;
+	state->fuse->image.resident[ent->list]--;
+	ghost_add(state, ent->list, ent);
 }
 
 /* Set error flag for an entry.  Busy flag must be held. */
@@ -80,13 +448,107 @@ static void entry_set_error(struct pk_state *state, struct cache_entry *ent)
 	ent->error = TRUE;
 }
 
+/* Record that the guest has written @length bytes at @offset in a
+   partially-loaded entry.  Once every block has been written, the old
+   contents of the chunk are no longer needed.  Busy flag must be held. */
+static void entry_mark_valid(struct pk_state *state, struct cache_entry *ent,
+			unsigned offset, unsigned length)
+{
+	unsigned block;
+
+	if (ent->valid == NULL)
+		return;
+	for (block = offset / ABSORB_BLOCK;
+				block < (offset + length) / ABSORB_BLOCK;
+				block++) {
+		if (ent->valid[block / 8] & (1 << (block % 8)))
+			continue;
+		ent->valid[block / 8] |= 1 << (block % 8);
+		ent->valid_blocks++;
+	}
+	if (ent->valid_blocks == state->parcel->chunksize / ABSORB_BLOCK) {
+		g_free(ent->valid);
+		ent->valid = NULL;
+		stats_increment(state, absorb_covered, 1);
+	}
+}
+
+/* Complete a partially-loaded entry by filling in the blocks the guest
+   hasn't written from the chunk's previous contents.  If the old contents
+   can't be fetched, the entry is left partially loaded so that the merge
+   can be retried, and FALSE is returned.  Busy flag must be held and
+   image lock must not be. */
+static gboolean entry_merge(struct pk_state *state, struct cache_entry *ent)
+{
+	unsigned blocks = state->parcel->chunksize / ABSORB_BLOCK;
+	unsigned block;
+	char *base;
+
+	if (ent->valid == NULL)
+		return TRUE;
+	base = chunk_buf_alloc(state->parcel);
+	if (cache_get(state, ent->chunk, base)) {
+		chunk_buf_free(base);
+		stats_increment(state, chunk_errors, 1);
+		return FALSE;
+	}
+	for (block = 0; block < blocks; block++)
+		if (!(ent->valid[block / 8] & (1 << (block % 8))))
+			memcpy(ent->data + block * ABSORB_BLOCK,
+						base + block * ABSORB_BLOCK,
+						ABSORB_BLOCK);
+	stats_increment(state, absorb_merges, 1);
+	chunk_buf_free(base);
+	g_free(ent->valid);
+	ent->valid = NULL;
+	return TRUE;
+}
+
+/* Returns TRUE if @ent's buffer doesn't hold the chunk's contents, either
+   because they couldn't be loaded or because a partial write couldn't be
+   merged with them.  Busy flag must be held. */
+static gboolean entry_unreadable(struct cache_entry *ent)
+{
+	return ent->error || ent->valid != NULL;
+}
+
+/* Park a dirty entry whose merge failed on the failed list, keeping its
+   data, until entry_retry_failed() gives it another try.  Image lock
+   must be held. */
+static void entry_merge_failed(struct pk_state *state,
+			struct cache_entry *ent)
+{
+	pk_log(LOG_WARNING, "Couldn't merge write to chunk %u; will retry",
+				ent->chunk);
+	ent->dirty = time(NULL);
+	list_push_tail(&state->fuse->image.failed, ent, LINK_DIRTY);
+}
+
+/* Move failed entries back to the dirty list for another writeback
+   attempt: all of them if @all is TRUE, otherwise those that failed at
+   least DIRTY_WRITEBACK_DELAY ago.  Image lock must be held. */
+static void entry_retry_failed(struct pk_state *state, gboolean all)
+{
+	struct cache_entry *ent;
+
+	while ((ent = state->fuse->image.failed.head) != NULL && (all ||
+				ent->dirty + DIRTY_WRITEBACK_DELAY <=
+				time(NULL))) {
+		list_remove(ent, LINK_DIRTY);
+		list_push_tail(&state->fuse->image.dirty, ent, LINK_DIRTY);
+	}
+}
+
 /* Clean a dirty entry.  Busy flag and image lock must be held.  Image
-   lock will be released and reacquired.  @ent must not have been removed
-   from the dirty list. */
-static void entry_clean(struct pk_state *state, struct cache_entry *ent)
+   lock will be released and reacquired.  @ent must be on the dirty or
+   failed list.  Returns FALSE if the entry is still dirty because its
+   merge failed. */
+static gboolean entry_clean(struct pk_state *state, struct cache_entry *ent)
 {
+	gboolean merged;
+
 	g_assert(ent->dirty > 0);
-	g_assert(ent->dirty_link != NULL);
+	g_assert(ent->links[LINK_DIRTY].list != NULL);
 	g_assert(ent->data != NULL);
 
 	/* Remove the chunk from the dirty list early, so that if we're
@@ -94,26 +556,38 @@ static void entry_clean(struct pk_state *state, struct cache_entry *ent)
 	   to deal with this chunk.  Removing this entry can only move the
 	   next cleaner wakeup *later*, so we don't bother signalling the
 	   cleaner here. */
-	queue_delete_with_link(state->fuse->image.dirty, &ent->dirty_link);
+	list_remove(ent, LINK_DIRTY);
 
 	g_mutex_unlock(state->fuse->image.lock);
-	if (cache_update(state, ent->chunk, ent->data))
+	merged = entry_merge(state, ent);
+	if (merged && !ent->error && cache_update(state, ent->chunk,
+				ent->data))
 		entry_set_error(state, ent);
 	g_mutex_lock(state->fuse->image.lock);
 
+	if (!merged) {
+		entry_merge_failed(state, ent);
+		return FALSE;
+	}
+	if (ent->error)
+		state->fuse->image.write_failed = TRUE;
 	ent->dirty = 0;
 	cache_shm_set_cache_dirty(state, ent->chunk, FALSE);
+	return TRUE;
 }
 
 /* Acquire the busy flag for an entry.  Image lock must be held, and may be
    released and reacquired. */
 static void _entry_acquire(struct pk_state *state, struct cache_entry *ent)
 {
-	queue_delete_with_link(state->fuse->image.reclaimable,
-				&ent->reclaimable_link);
+	/* An entry without a buffer may be on a ghost list, which is
+	   none of our business */
+	if (ent->data != NULL)
+		list_remove(ent, LINK_LRU);
 	ent->waiters++;
 	while (ent->busy)
-		g_cond_wait(ent->available, state->fuse->image.lock);
+		g_cond_wait(entry_wait_queue(state, ent),
+					state->fuse->image.lock);
 	ent->busy = TRUE;
 	ent->waiters--;
 }
@@ -123,85 +597,109 @@ static void _entry_release(struct pk_state *state, struct cache_entry *ent)
 {
 	ent->busy = FALSE;
 	if (ent->waiters > 0) {
-		g_cond_signal(ent->available);
-	} else if (ent->data == NULL) {
-		/* No data buffer and no waiters; there's no reason to
-		   keep this cache entry around anymore. */
-		g_assert(ent->reclaimable_link == NULL);
-		g_hash_table_remove(state->fuse->image.chunks, &ent->chunk);
-		g_cond_free(ent->available);
-		g_slice_free(struct cache_entry, ent);
-	} else {
+		g_cond_broadcast(entry_wait_queue(state, ent));
+	} else if (ent->data != NULL && !ent->writeback) {
 		/* We have cached data but no waiters.  Make this entry
-		   reclaimable. */
-		queue_push_tail_with_link(state->fuse->image.reclaimable,
-					&ent->reclaimable_link, ent);
+		   reclaimable.  An entry being written back from a
+		   snapshot is not reclaimable until the writeback is
+		   finished, since until then the keyring doesn't reflect
+		   the buffer contents. */
+		list_push_tail(&state->fuse->image.reclaimable[ent->list],
+					ent, LINK_LRU);
 		g_cond_signal(state->fuse->image.reclaimable_cond);
 	}
 }
 
 /* Get a cache_entry for the specified @chunk, acquire its busy flag,
-   allocate a buffer if necessary, populate the buffer with chunk data if
-   requested, and return the entry. */
+   allocate a buffer if necessary, fill it as specified by @fill, and
+   return the entry.  With FILL_PARTIAL, a new buffer is left partially
+   loaded: the caller writes into it, and the rest of the chunk is merged
+   in before the entry is next read or written back.  With FILL_DATA, an
+   existing partially-loaded buffer is merged now. */
 static struct cache_entry *entry_acquire(struct pk_state *state,
-			unsigned chunk, gboolean with_data)
+			unsigned chunk, enum entry_fill fill)
 {
 	struct cache_entry *ent;
 	struct cache_entry *reclaim;
 
 	/* Obtain a cache_entry and get its busy flag. */
 	g_mutex_lock(state->fuse->image.lock);
-	ent = g_hash_table_lookup(state->fuse->image.chunks, &chunk);
-	if (ent == NULL) {
-		ent = g_slice_new0(struct cache_entry);
-		ent->chunk = chunk;
-		ent->available = g_cond_new();
-		g_hash_table_replace(state->fuse->image.chunks, &ent->chunk,
-					ent);
-	}
+	ent = entry_lookup(state, chunk, TRUE);
 	_entry_acquire(state, ent);
 
 	if (ent->data == NULL) {
-		/* This entry has no buffer.  Get one. */
-		if (state->fuse->image.allocatable > 0) {
-			state->fuse->image.allocatable--;
-			ent->data = g_slice_alloc(state->parcel->chunksize);
-		} else {
-			while (g_queue_is_empty(state->fuse->
-						image.reclaimable))
-				g_cond_wait(state->fuse->
-						image.reclaimable_cond,
+		/* This entry has no buffer.  Get one.  Any error belonged
+		   to the contents of the old one. */
+		ent->error = FALSE;
+		/* The capacity may grow while we wait */
+		while (image_resident(state) >= state->fuse->image.capacity &&
+					state->fuse->image.reclaimable[
+					CACHE_RECENT].head == NULL &&
+					state->fuse->image.reclaimable[
+					CACHE_FREQUENT].head == NULL)
+			g_cond_wait(state->fuse->image.reclaimable_cond,
 						state->fuse->image.lock);
-			/* _entry_acquire() will pop, so we just peek */
-			reclaim = g_queue_peek_head(
-					state->fuse->image.reclaimable);
+		if (image_resident(state) < state->fuse->image.capacity) {
+			ent->data = arena_get(state);
+		} else {
+			/* Pass over dirty entries the cleaner hasn't
+			   reached yet, if there's a clean one nearby.
+			   _entry_acquire() will pop, so we just peek. */
+			reclaim = policy_clean_victim(state,
+						clean_reserve(state));
+			if (reclaim != policy_victim(state))
+				g_cond_signal(state->fuse->cleaner.cond);
+			if (reclaim == NULL)
+				reclaim = policy_victim(state);
 			pk_log(LOG_FUSE, "Reclaim: %u", reclaim->chunk);
 			stats_increment(state, cache_evictions, 1);
 			_entry_acquire(state, reclaim);
 			if (reclaim->dirty) {
-				entry_clean(state, reclaim);
+				/* Write back in the foreground */
+				if (!entry_clean(state, reclaim)) {
+					/* Fail this I/O rather than drop
+					   the victim's data */
+					_entry_release(state, reclaim);
+					ent->error = TRUE;
+					g_mutex_unlock(
+						state->fuse->image.lock);
+					return ent;
+				}
 				stats_increment(state, cache_evictions_dirty,
 							1);
 			}
 			g_assert(reclaim->data != NULL);
 			ent->data = reclaim->data;
 			reclaim->data = NULL;
+			policy_evict(state, reclaim);
 			cache_shm_set_cached(state, reclaim->chunk, FALSE);
 			_entry_release(state, reclaim);
 		}
+		policy_admit(state, ent);
 		cache_shm_set_cached(state, ent->chunk, TRUE);
 		g_mutex_unlock(state->fuse->image.lock);
 
 		/* Populate it if requested. */
-		if (with_data) {
+		if (fill == FILL_DATA) {
 			if (cache_get(state, ent->chunk, ent->data))
 				entry_set_error(state, ent);
 			stats_increment(state, cache_misses, 1);
+		} else if (fill == FILL_PARTIAL) {
+			ent->valid = g_malloc0((state->parcel->chunksize /
+						ABSORB_BLOCK + 7) / 8);
+			ent->valid_blocks = 0;
 		}
 	} else {
+		policy_hit(state, ent);
 		g_mutex_unlock(state->fuse->image.lock);
-		if (with_data)
+		if (fill == FILL_DATA && ent->valid != NULL) {
+			/* On failure the entry stays partially loaded,
+			   and the caller sees it as unreadable */
+			entry_merge(state, ent);
+			stats_increment(state, cache_misses, 1);
+		} else if (fill == FILL_DATA) {
 			stats_increment(state, cache_hits, 1);
+		}
 	}
 	return ent;
 }
@@ -213,13 +711,18 @@ static void entry_release(struct pk_state *state, struct cache_entry *ent,
 	if (dirty)
 		cache_shm_set_dirty(state, ent->chunk);
 	g_mutex_lock(state->fuse->image.lock);
+	if (dirty)
+		ent->generation++;
 	if (dirty && !ent->dirty) {
 		ent->dirty = time(NULL);
-		queue_push_tail_with_link(state->fuse->image.dirty,
-					&ent->dirty_link, ent);
-		if (g_queue_peek_head(state->fuse->image.dirty) == ent) {
+		list_push_tail(&state->fuse->image.dirty, ent, LINK_DIRTY);
+		if (state->fuse->image.dirty.head == ent ||
+					state->fuse->image.dirty.length ==
+					state->fuse->image.capacity *
+					DIRTY_HIGH_PCT / 100 + 1) {
 			/* We've changed the queue head, so the cleaner
-			   needs to recalculate its wakeup time */
+			   needs to recalculate its wakeup time, or we've
+			   crossed the high watermark */
 			g_cond_signal(state->fuse->cleaner.cond);
 		}
 		cache_shm_set_cache_dirty(state, ent->chunk, TRUE);
@@ -228,27 +731,294 @@ static void entry_release(struct pk_state *state, struct cache_entry *ent,
 	g_mutex_unlock(state->fuse->image.lock);
 }
 
+/* Write back a dirty entry from a snapshot of its buffer, so that the
+   guest can continue to use the chunk while it is encoded and stored.  If
+   the entry is dirtied again in the meantime, its generation will have
+   changed when we finish, and it goes back on the dirty list.  If @to_head
+   is TRUE and the entry comes back clean, it returns to the front of its
+   reclaimable list rather than the back, keeping its place in line for
+   reclaim.  If a partial write can't be merged, the entry moves to the
+   failed list instead.  Busy flag and image lock must be held.  The busy
+   flag will be released, and the image lock will be released and
+   reacquired. */
+static void entry_writeback(struct pk_state *state, struct cache_entry *ent,
+			gboolean to_head)
+{
+	struct pk_fuse *fuse = state->fuse;
+	unsigned chunk = ent->chunk;
+	unsigned generation = 0;
+	void *snapshot;
+	gboolean merged;
+	gboolean ok = FALSE;
+
+	g_assert(ent->dirty > 0);
+	g_assert(ent->links[LINK_DIRTY].list != NULL);
+	g_assert(ent->data != NULL);
+	g_assert(!ent->writeback);
+
+	/* As in entry_clean(), leave the dirty list early.  ent->dirty
+	   stays set, so that redirtying the entry doesn't put it back on
+	   the list while the writeback is in progress. */
+	list_remove(ent, LINK_DIRTY);
+	ent->writeback = TRUE;
+	fuse->image.writebacks++;
+	snapshot = g_queue_pop_head(fuse->image.spares);
+	g_mutex_unlock(fuse->image.lock);
+
+	if (snapshot == NULL)
+		snapshot = chunk_buf_alloc(state->parcel);
+	merged = entry_merge(state, ent);
+	if (merged) {
+		ok = !ent->error;
+		memcpy(snapshot, ent->data, state->parcel->chunksize);
+		generation = ent->generation;
+
+		g_mutex_lock(fuse->image.lock);
+		_entry_release(state, ent);
+		g_mutex_unlock(fuse->image.lock);
+
+		/* The entry can't be reclaimed, and therefore can't be
+		   freed, until we clear the writeback flag */
+		if (ok && cache_update(state, chunk, snapshot))
+			ok = FALSE;
+	}
+
+	g_mutex_lock(fuse->image.lock);
+	if (g_queue_get_length(fuse->image.spares) < WRITEBACK_SPARES)
+		g_queue_push_head(fuse->image.spares, snapshot);
+	else
+		chunk_buf_free(snapshot);
+	ent->writeback = FALSE;
+	if (!merged) {
+		/* We still hold the busy flag */
+		entry_merge_failed(state, ent);
+		_entry_release(state, ent);
+		goto out;
+	}
+	if (!ok) {
+		_entry_acquire(state, ent);
+		entry_set_error(state, ent);
+		fuse->image.write_failed = TRUE;
+	}
+	if (ent->generation == generation || !ok) {
+		ent->dirty = 0;
+		cache_shm_set_cache_dirty(state, chunk, FALSE);
+	} else {
+		ent->dirty = time(NULL);
+		list_push_tail(&fuse->image.dirty, ent, LINK_DIRTY);
+		if (fuse->image.dirty.head == ent)
+			g_cond_signal(fuse->cleaner.cond);
+	}
+	if (!ok) {
+		_entry_release(state, ent);
+	} else if (!ent->busy && ent->waiters == 0) {
+		/* Nobody else will make it reclaimable.  If it was
+		   redirtied meanwhile, it's no longer next in line. */
+		if (to_head && !ent->dirty)
+			list_push_head(&fuse->image.reclaimable[ent->list],
+						ent, LINK_LRU);
+		else
+			list_push_tail(&fuse->image.reclaimable[ent->list],
+						ent, LINK_LRU);
+		g_cond_signal(fuse->image.reclaimable_cond);
+	}
+out:
+	fuse->image.writebacks--;
+	g_cond_broadcast(fuse->image.writeback_cond);
+}
+
+/* Release clean, unbusy buffers, in replacement order, until the cache is
+   no larger than its capacity.  Dirty and busy entries are skipped; the
+   cleaner comes back for them later.  Image lock must be held. */
+static void _image_shrink(struct pk_state *state)
+{
+	struct pk_fuse *fuse = state->fuse;
+	struct cache_entry *ent;
+
+	while (image_resident(state) > fuse->image.capacity) {
+		ent = policy_clean_victim(state, G_MAXUINT);
+		if (ent == NULL)
+			return;
+		_entry_acquire(state, ent);
+		arena_put(state, ent->data);
+		ent->data = NULL;
+		policy_evict(state, ent);
+		cache_shm_set_cached(state, ent->chunk, FALSE);
+		_entry_release(state, ent);
+		stats_increment(state, cache_shrink_releases, 1);
+	}
+}
+
+void image_shrink(struct pk_state *state)
+{
+	g_mutex_lock(state->fuse->image.lock);
+	_image_shrink(state);
+	g_mutex_unlock(state->fuse->image.lock);
+}
+
+/* Cache sizes are in MB */
+unsigned image_get_cache_size(struct pk_state *state)
+{
+	unsigned ret;
+
+	g_mutex_lock(state->fuse->image.lock);
+	ret = (uint64_t) state->fuse->image.capacity *
+				state->parcel->chunksize >> 20;
+	g_mutex_unlock(state->fuse->image.lock);
+	return ret;
+}
+
+unsigned image_get_max_cache_size(struct pk_state *state)
+{
+	return (uint64_t) state->fuse->image.max_buffers *
+				state->parcel->chunksize >> 20;
+}
+
+pk_err_t image_set_cache_size(struct pk_state *state, unsigned mb)
+{
+	struct pk_fuse *fuse = state->fuse;
+	unsigned capacity;
+
+	capacity = (uint64_t) mb * (1 << 20) / state->parcel->chunksize;
+	if (capacity == 0 || capacity > fuse->image.max_buffers)
+		return PK_INVALID;
+	g_mutex_lock(fuse->image.lock);
+	if (capacity != fuse->image.capacity)
+		pk_log(LOG_INFO, "Chunk cache: %u -> %u entries",
+					fuse->image.capacity, capacity);
+	fuse->image.capacity = capacity;
+	fuse->image.target = MIN(fuse->image.target, capacity);
+	_image_shrink(state);
+	/* Threads waiting for a reclaimable buffer may now be able to
+	   allocate one */
+	g_cond_broadcast(fuse->image.reclaimable_cond);
+	g_mutex_unlock(fuse->image.lock);
+	return PK_SUCCESS;
+}
+
+/* Returns TRUE if @chunk can be read as zeroes without using its cache
+   entry.  A chunk whose entry is in use may have newer data in its
+   buffer. */
+static gboolean entry_read_zero(struct pk_state *state, unsigned chunk)
+{
+	gboolean ret;
+
+	g_mutex_lock(state->fuse->image.lock);
+	ret = !entry_in_use(entry_lookup(state, chunk, FALSE)) &&
+				cache_chunk_is_zero(state, chunk);
+	g_mutex_unlock(state->fuse->image.lock);
+	return ret;
+}
+
+/* Overwrite @chunk with zeroes.  If the chunk is cached, zero its buffer
+   and let writeback handle it as usual.  Otherwise record the change
+   directly in the keyring rather than evicting another chunk to make room
+   for a buffer of zeroes.  Returns FALSE on error. */
+static gboolean entry_write_zero(struct pk_state *state, unsigned chunk)
+{
+	struct cache_entry *ent;
+	gboolean ok = TRUE;
+
+	g_mutex_lock(state->fuse->image.lock);
+	ent = entry_lookup(state, chunk, TRUE);
+	if (!entry_in_use(ent) && cache_chunk_is_zero(state, chunk)) {
+		/* Nothing to do */
+		g_mutex_unlock(state->fuse->image.lock);
+		return TRUE;
+	}
+	_entry_acquire(state, ent);
+	if (ent->data != NULL) {
+		g_mutex_unlock(state->fuse->image.lock);
+		if (ent->error) {
+			entry_release(state, ent, FALSE);
+			return FALSE;
+		}
+		memset(ent->data, 0, state->parcel->chunksize);
+		entry_mark_valid(state, ent, 0, state->parcel->chunksize);
+		entry_release(state, ent, TRUE);
+		return TRUE;
+	}
+	g_mutex_unlock(state->fuse->image.lock);
+	if (cache_set_zero(state, chunk)) {
+		entry_set_error(state, ent);
+		ok = FALSE;
+	}
+	g_mutex_lock(state->fuse->image.lock);
+	_entry_release(state, ent);
+	g_mutex_unlock(state->fuse->image.lock);
+	return ok;
+}
+
 /* Clean all dirty entries that are ripe for writeback.  If @force is TRUE,
-   clean all dirty entries.  Image lock must be held. */
+   clean all dirty entries and wait for writebacks started elsewhere.  Image
+   lock must be held. */
 static void entry_clean_all(struct pk_state *state, gboolean force)
 {
 	struct cache_entry *ent;
 
-	while ((ent = g_queue_peek_head(state->fuse->image.dirty))) {
+	for (;;) {
+		while ((ent = state->fuse->image.dirty.head) != NULL) {
+			_entry_acquire(state, ent);
+			if (!ent->dirty ||
+						ent->links[LINK_DIRTY].list !=
+						&state->fuse->image.dirty) {
+				/* By the time we acquired the busy flag,
+				   the chunk was no longer dirty, was
+				   being written back by someone else, or
+				   had failed to merge. */
+				_entry_release(state, ent);
+				continue;
+			}
+			if (!force && ent->dirty + DIRTY_WRITEBACK_DELAY >
+						time(NULL)) {
+				_entry_release(state, ent);
+				break;
+			}
+			entry_writeback(state, ent, FALSE);
+		}
+		if (!force || state->fuse->image.writebacks == 0)
+			break;
+		/* Writebacks that finish may requeue redirtied entries */
+		while (state->fuse->image.writebacks > 0)
+			g_cond_wait(state->fuse->image.writeback_cond,
+						state->fuse->image.lock);
+	}
+}
+
+/* Write back dirty entries early, before demand reclaim reaches them:
+   first any in the clean reserve, if the cache is nearly full, then the
+   oldest, if too much of the cache is dirty.  Until reclaim is near,
+   dirty entries wait out DIRTY_WRITEBACK_DELAY so that repeated writes
+   to a chunk are batched.  Image lock must be held. */
+static void entry_preclean(struct pk_state *state)
+{
+	struct pk_fuse *fuse = state->fuse;
+	struct cache_entry *ent;
+
+	while (!fuse->image.stopping && image_resident(state) +
+				clean_reserve(state) >= fuse->image.capacity &&
+				(ent = policy_reserve_dirty(state)) != NULL) {
+		/* Reclaimable, so not busy or being written back */
 		_entry_acquire(state, ent);
-		if (!ent->dirty) {
-			/* By the time we acquired the busy flag, the
-			   chunk was no longer dirty. */
+		entry_writeback(state, ent, TRUE);
+		stats_increment(state, cache_precleans, 1);
+	}
+
+	if (fuse->image.dirty.length <= fuse->image.capacity *
+				DIRTY_HIGH_PCT / 100)
+		return;
+	while (!fuse->image.stopping && fuse->image.dirty.length >
+				fuse->image.capacity * DIRTY_LOW_PCT / 100 &&
+				(ent = fuse->image.dirty.head) != NULL) {
+		_entry_acquire(state, ent);
+		if (!ent->dirty || ent->links[LINK_DIRTY].list !=
+					&fuse->image.dirty) {
+			/* Cleaned by someone else while we waited */
 			_entry_release(state, ent);
 			continue;
 		}
-		if (!force && ent->dirty + DIRTY_WRITEBACK_DELAY >
-					time(NULL)) {
-			_entry_release(state, ent);
-			break;
-		}
-		entry_clean(state, ent);
-		_entry_release(state, ent);
+		entry_writeback(state, ent, FALSE);
+		stats_increment(state, cache_precleans, 1);
 	}
 }
 
@@ -261,17 +1031,26 @@ static void *entry_cleaner(void *data)
 
 	g_mutex_lock(state->fuse->image.lock);
 	while (!state->fuse->image.stopping) {
-		/* Clean what we can */
+		/* Clean what we can, and release anything the cache has
+		   to give back after shrinking */
+		entry_retry_failed(state, FALSE);
 		entry_clean_all(state, FALSE);
+		entry_preclean(state);
+		_image_shrink(state);
 
 		/* Sleep until we're needed again */
-		ent = g_queue_peek_head(state->fuse->image.dirty);
+		ent = state->fuse->image.dirty.head;
+		if (ent == NULL)
+			ent = state->fuse->image.failed.head;
 		if (ent != NULL) {
 			/* Set wakeup based on the expiration time of the
-			   head-of-queue.  Round off for better energy use. */
+			   head-of-queue, but check the clean reserve at
+			   least every PRECLEAN_INTERVAL.  Round off for
+			   better energy use. */
 			g_get_current_time(&timeout);
-			timeout.tv_sec += ent->dirty + DIRTY_WRITEBACK_DELAY -
-						time(NULL);
+			timeout.tv_sec += MIN(PRECLEAN_INTERVAL, ent->dirty +
+						DIRTY_WRITEBACK_DELAY -
+						time(NULL));
 			timeout.tv_usec = 0;
 			g_cond_timed_wait(state->fuse->cleaner.cond,
 						state->fuse->image.lock,
@@ -287,13 +1066,155 @@ static void *entry_cleaner(void *data)
 	return NULL;
 }
 
+/* Loader pool worker: bring a chunk into the cache and leave it there
+   for the read that asked for it */
+static void entry_loader(void *data, void *user_data)
+{
+	struct pk_state *state = user_data;
+	struct cache_entry *ent;
+
+	ent = entry_acquire(state, GPOINTER_TO_UINT(data) - 1, FILL_DATA);
+	entry_release(state, ent, FALSE);
+}
+
+const char *image_arena_backing_name(enum arena_backing backing)
+{
+	switch (backing) {
+	case ARENA_SMALL_PAGES:
+		return "small_pages";
+	case ARENA_TRANSPARENT_HUGE:
+		return "transparent_huge_pages";
+	case ARENA_HUGETLB:
+		return "hugetlb";
+	}
+	return "unknown";
+}
+
+/* Return the amount of the arena currently backed by huge pages, in KB.
+   For transparent huge pages this comes from /proc/self/smaps, and shows
+   how much of the cache is actually getting the TLB benefit. */
+uint64_t image_arena_huge_kb(struct pk_state *state)
+{
+	gchar *buf;
+	gchar **lines;
+	unsigned long start;
+	uint64_t kb = 0;
+	gboolean ours = FALSE;
+	int i;
+
+	if (state->fuse->image.arena_backing == ARENA_HUGETLB)
+		return state->fuse->image.arena_size >> 10;
+	if (read_file("/proc/self/smaps", &buf, NULL))
+		return 0;
+	lines = g_strsplit(buf, "\n", 0);
+	g_free(buf);
+	for (i = 0; lines[i] != NULL; i++) {
+		/* Mapping headers begin with an address range; field lines
+		   begin with a capitalized name */
+		if (!g_ascii_isupper(lines[i][0]) &&
+					sscanf(lines[i], "%lx-", &start) == 1)
+			ours = start == (unsigned long)
+						state->fuse->image.arena;
+		else if (ours && sscanf(lines[i], "AnonHugePages: %"SCNu64,
+					&kb) == 1)
+			break;
+	}
+	g_strfreev(lines);
+	return kb;
+}
+
+/* Allocate the chunk buffer arena, preferring explicit huge pages and
+   then transparent ones.  A cache of 128 KB buffers spread across base
+   pages needs 32 TLB entries per buffer, so random guest I/O over a large
+   cache would otherwise spend much of its time in page walks.  hugetlb
+   pages are reserved from the system's pool up front and can't be given
+   back, so a hugetlb arena only holds the startup cache, which then can't
+   grow.  Otherwise the arena is sized for the largest cache we allow, but
+   memory is only committed as buffers are first used. */
+static pk_err_t arena_init(struct pk_state *state)
+{
+	size_t size;
+	void *base = MAP_FAILED;
+
+	state->fuse->image.arena_backing = ARENA_SMALL_PAGES;
+#ifdef MAP_HUGETLB
+	size = (size_t) state->fuse->image.capacity *
+				state->parcel->chunksize;
+	size = (size + ARENA_HUGE_PAGE - 1) & ~((size_t) ARENA_HUGE_PAGE - 1);
+	base = mmap(NULL, size, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (base != MAP_FAILED) {
+		state->fuse->image.arena_backing = ARENA_HUGETLB;
+		state->fuse->image.max_buffers = size /
+					state->parcel->chunksize;
+		pk_log(LOG_INFO, "Chunk cache limited to %u entries by "
+					"hugetlb arena",
+					state->fuse->image.max_buffers);
+	}
+#endif
+	if (base == MAP_FAILED) {
+		size = (size_t) state->fuse->image.max_buffers *
+					state->parcel->chunksize;
+		size = (size + ARENA_HUGE_PAGE - 1) &
+					~((size_t) ARENA_HUGE_PAGE - 1);
+		base = mmap(NULL, size, PROT_READ|PROT_WRITE,
+					MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			pk_log(LOG_ERROR, "Couldn't allocate %"PRIu64
+						"-byte chunk cache: %s",
+						(uint64_t) size,
+						strerror(errno));
+			return PK_NOMEM;
+		}
+#ifdef MADV_HUGEPAGE
+		if (!madvise(base, size, MADV_HUGEPAGE))
+			state->fuse->image.arena_backing =
+						ARENA_TRANSPARENT_HUGE;
+#endif
+	}
+	state->fuse->image.arena = base;
+	state->fuse->image.arena_size = size;
+	state->fuse->image.free_buffers = g_new(char *,
+				state->fuse->image.max_buffers);
+	state->fuse->image.huge_users = g_new0(unsigned,
+				size / ARENA_HUGE_PAGE);
+	/* Buffers are locked as they're handed out, so that the cache can
+	   still shrink */
+	if (state->conf->flags & WANT_LOCK_MEMORY)
+		state->fuse->image.arena_locked = TRUE;
+	pk_log(LOG_INFO, "Chunk cache arena: %"PRIu64" KB, %s%s",
+				(uint64_t) size >> 10,
+				image_arena_backing_name(
+				state->fuse->image.arena_backing),
+				state->fuse->image.arena_locked ?
+				", locked" : "");
+	return PK_SUCCESS;
+}
+
 static void _image_shutdown(struct pk_state *state)
 {
+	void *buf;
+	unsigned i;
+
 	g_cond_free(state->fuse->cleaner.cond);
 	g_cond_free(state->fuse->image.reclaimable_cond);
-	g_queue_free(state->fuse->image.reclaimable);
-	g_queue_free(state->fuse->image.dirty);
-	g_hash_table_destroy(state->fuse->image.chunks);
+	g_cond_free(state->fuse->image.writeback_cond);
+	while ((buf = g_queue_pop_head(state->fuse->image.spares)))
+		chunk_buf_free(buf);
+	g_queue_free(state->fuse->image.spares);
+	for (i = 0; i < CACHE_WAIT_QUEUES; i++)
+		g_cond_free(state->fuse->image.wait[i]);
+	/* Ghost lists are threaded through the entries, so they go
+	   away with them */
+	for (i = 0; i < state->fuse->image.pages; i++)
+		g_free(state->fuse->image.entries[i]);
+	g_free(state->fuse->image.entries);
+	if (state->fuse->image.arena != NULL)
+		munmap(state->fuse->image.arena,
+					state->fuse->image.arena_size);
+	g_free(state->fuse->image.free_buffers);
+	g_free(state->fuse->image.huge_users);
+	g_free(state->fuse->image.zeroes);
 	g_mutex_free(state->fuse->image.lock);
 }
 
@@ -301,6 +1222,10 @@ void image_shutdown(struct pk_state *state)
 {
 	struct cache_entry *ent;
 
+	/* Drop queued loads and wait for those in progress */
+	if (state->fuse->image.loaders != NULL)
+		g_thread_pool_free(state->fuse->image.loaders, TRUE, TRUE);
+
 	/* Stop the cleaner thread */
 	g_mutex_lock(state->fuse->image.lock);
 	state->fuse->image.stopping = TRUE;
@@ -308,22 +1233,36 @@ void image_shutdown(struct pk_state *state)
 	g_mutex_unlock(state->fuse->image.lock);
 	g_thread_join(state->fuse->cleaner.thread);
 
-	/* Write back dirty chunks */
+	/* Write back dirty chunks, giving failed merges one last try.
+	   Whatever still can't be merged is lost. */
 	g_mutex_lock(state->fuse->image.lock);
+	entry_retry_failed(state, TRUE);
 	entry_clean_all(state, TRUE);
+	while ((ent = state->fuse->image.failed.head) != NULL) {
+		pk_log(LOG_ERROR, "Discarding unmerged write to chunk %u",
+					ent->chunk);
+		_entry_acquire(state, ent);
+		list_remove(ent, LINK_DIRTY);
+		entry_set_error(state, ent);
+		ent->dirty = 0;
+		cache_shm_set_cache_dirty(state, ent->chunk, FALSE);
+		_entry_release(state, ent);
+	}
 
 	/* Free chunk buffers */
-	while ((ent = g_queue_peek_head(state->fuse->image.reclaimable))) {
+	while ((ent = state->fuse->image.reclaimable[CACHE_RECENT].head) ||
+				(ent = state->fuse->image.reclaimable[
+				CACHE_FREQUENT].head)) {
 		_entry_acquire(state, ent);
 		g_assert(!ent->dirty);
 		g_assert(ent->data != NULL);
-		g_slice_free1(state->parcel->chunksize, ent->data);
 		ent->data = NULL;
+		g_free(ent->valid);
+		ent->valid = NULL;
+		state->fuse->image.resident[ent->list]--;
 		cache_shm_set_cached(state, ent->chunk, FALSE);
-		/* Since the entry has no buffer, it will be freed */
 		_entry_release(state, ent);
 	}
-	g_assert(g_hash_table_size(state->fuse->image.chunks) == 0);
 	g_mutex_unlock(state->fuse->image.lock);
 
 	/* Free data structures */
@@ -334,6 +1273,9 @@ pk_err_t image_init(struct pk_state *state)
 {
 	GError *err = NULL;
 	unsigned max_mb;
+	unsigned capacity;
+	unsigned max_buffers;
+	unsigned i;
 
 	max_mb = (uint64_t) MAX_CACHE_MULT * sysconf(_SC_PHYS_PAGES) *
 				sysconf(_SC_PAGE_SIZE) / (MAX_CACHE_DIV << 20);
@@ -348,24 +1290,62 @@ pk_err_t image_init(struct pk_state *state)
 					" of system RAM (%u MB)", max_mb);
 		return PK_INVALID;
 	}
+	/* Chunks may be larger than 1 MB */
+	capacity = (uint64_t) state->conf->chunk_cache * (1 << 20) /
+				state->parcel->chunksize;
+	max_buffers = (uint64_t) max_mb * (1 << 20) /
+				state->parcel->chunksize;
+	if (capacity == 0) {
+		pk_log(LOG_WARNING, "Chunk cache must hold at least one "
+					"%u KB chunk",
+					state->parcel->chunksize >> 10);
+		return PK_INVALID;
+	}
 
 	state->fuse->image.lock = g_mutex_new();
-	state->fuse->image.chunks = g_hash_table_new(g_int_hash, g_int_equal);
-	state->fuse->image.dirty = g_queue_new();
-	state->fuse->image.reclaimable = g_queue_new();
+	state->fuse->image.pages = (state->parcel->chunks +
+				ENTRY_PAGE_SIZE - 1) >> ENTRY_PAGE_SHIFT;
+	state->fuse->image.entries = g_new0(struct cache_entry *,
+				state->fuse->image.pages);
+	for (i = 0; i < CACHE_WAIT_QUEUES; i++)
+		state->fuse->image.wait[i] = g_cond_new();
 	state->fuse->image.reclaimable_cond = g_cond_new();
-	state->fuse->image.allocatable = state->conf->chunk_cache *
-				((1 << 20) / state->parcel->chunksize);
-	pk_log(LOG_INFO, "Chunk cache: %u entries",
-				state->fuse->image.allocatable);
+	state->fuse->image.writeback_cond = g_cond_new();
+	state->fuse->image.spares = g_queue_new();
+	state->fuse->image.zeroes = g_malloc0(state->parcel->chunksize);
+	state->fuse->image.capacity = capacity;
+	state->fuse->image.max_buffers = MAX(capacity, max_buffers);
+	state->fuse->image.policy = state->conf->cache_policy;
+	pk_log(LOG_INFO, "Chunk cache: %u entries (maximum %u), %s "
+				"replacement", state->fuse->image.capacity,
+				state->fuse->image.max_buffers,
+				cache_policy_name(state->conf->cache_policy));
 
 	state->fuse->cleaner.cond = g_cond_new();
+	if (arena_init(state)) {
+		_image_shutdown(state);
+		return PK_NOMEM;
+	}
+	if (!(state->conf->flags & WANT_SINGLE_THREAD)) {
+		state->fuse->image.loaders = g_thread_pool_new(entry_loader,
+					state, MISS_LOADERS, FALSE, &err);
+		if (state->fuse->image.loaders == NULL) {
+			pk_log(LOG_ERROR, "Couldn't create loader thread "
+						"pool: %s", err->message);
+			g_clear_error(&err);
+			_image_shutdown(state);
+			return PK_CALLFAIL;
+		}
+	}
 	state->fuse->cleaner.thread = g_thread_create(entry_cleaner, state,
 				TRUE, &err);
 	if (state->fuse->cleaner.thread == NULL) {
 		pk_log(LOG_ERROR, "Couldn't create cleaner thread: %s",
 					err->message);
 		g_clear_error(&err);
+		if (state->fuse->image.loaders != NULL)
+			g_thread_pool_free(state->fuse->image.loaders, TRUE,
+						TRUE);
 		_image_shutdown(state);
 		return PK_CALLFAIL;
 	}
@@ -405,6 +1385,39 @@ static gboolean io_chunk(struct io_cursor *cur)
 	return TRUE;
 }
 
+/* Hand the cold chunks of a read to the loader pool, so that their
+   misses are resolved concurrently rather than one after another.  The
+   first cold chunk is left for the reader, which will get to it before
+   a loader could.  Later chunks are copied out in order as the loaders
+   release them; if the reader gets to one first, it simply loads it
+   itself and the loader finds it cached. */
+static void entry_load_ahead(struct pk_state *state, off_t start,
+			size_t count)
+{
+	struct io_cursor cur;
+	struct cache_entry *ent;
+	gboolean first = TRUE;
+	gboolean cold;
+
+	for (io_start(state, &cur, start, count); io_chunk(&cur); ) {
+		g_mutex_lock(state->fuse->image.lock);
+		ent = entry_lookup(state, cur.chunk, FALSE);
+		cold = (ent == NULL || (ent->data == NULL && !ent->busy)) &&
+					!cache_chunk_is_zero(state,
+					cur.chunk);
+		g_mutex_unlock(state->fuse->image.lock);
+		if (!cold)
+			continue;
+		if (first) {
+			first = FALSE;
+			continue;
+		}
+		g_thread_pool_push(state->fuse->image.loaders,
+					CHUNK_ITEM(cur.chunk), NULL);
+		stats_increment(state, parallel_misses, 1);
+	}
+}
+
 int image_read(struct pk_state *state, char *buf, off_t start, size_t count)
 {
 	struct io_cursor cur;
@@ -412,9 +1425,21 @@ int image_read(struct pk_state *state, char *buf, off_t start, size_t count)
 
 	pk_log(LOG_FUSE, "Read %"PRIu64" at %"PRIu64, (uint64_t) count,
 				(uint64_t) start);
+	if (state->fuse->image.loaders != NULL &&
+				start % state->parcel->chunksize + count >
+				state->parcel->chunksize)
+		entry_load_ahead(state, start, count);
 	for (io_start(state, &cur, start, count); io_chunk(&cur); ) {
-		ent = entry_acquire(state, cur.chunk, TRUE);
-		if (ent->error) {
+		/* Count reads answered from the chunk cache too */
+		profile_touch(state, cur.chunk);
+		if (entry_read_zero(state, cur.chunk)) {
+			memset(buf + cur.buf_offset, 0, cur.length);
+			stats_increment(state, zero_chunk_reads, 1);
+			stats_increment(state, bytes_read, cur.length);
+			continue;
+		}
+		ent = entry_acquire(state, cur.chunk, FILL_DATA);
+		if (entry_unreadable(ent)) {
 			entry_release(state, ent, FALSE);
 			return (int) cur.buf_offset ?: -EIO;
 		}
@@ -426,24 +1451,125 @@ int image_read(struct pk_state *state, char *buf, off_t start, size_t count)
 	return cur.buf_offset;
 }
 
-int image_write(struct pk_state *state, const char *buf, off_t start,
+/* Answer a read by passing @reply the data in place, without copying it
+   out of the chunk cache.  Only reads contained in a single chunk can be
+   answered this way, since each chunk buffer must stay busy until the
+   reply has been sent, and holding several at once could deadlock against
+   reclaim; larger reads are copied into a temporary buffer.  Returns 0
+   if @reply was called, or a negative error code, in which case the
+   caller must report the error itself. */
+int image_read_direct(struct pk_state *state, off_t start, size_t count,
+			image_reply_fn *reply, void *arg)
+{
+	struct io_cursor cur;
+	struct cache_entry *ent;
+	char *buf;
+	int ret;
+
+	if (start % state->parcel->chunksize + count >
+				state->parcel->chunksize) {
+		buf = g_malloc(count);
+		ret = image_read(state, buf, start, count);
+		if (ret >= 0) {
+			reply(arg, buf, ret);
+			ret = 0;
+		}
+		g_free(buf);
+		return ret;
+	}
+
+	pk_log(LOG_FUSE, "Read %"PRIu64" at %"PRIu64, (uint64_t) count,
+				(uint64_t) start);
+	io_start(state, &cur, start, count);
+	if (!io_chunk(&cur)) {
+		/* Empty read or end of disk */
+		reply(arg, state->fuse->image.zeroes, 0);
+		return 0;
+	}
+	profile_touch(state, cur.chunk);
+	if (entry_read_zero(state, cur.chunk)) {
+		reply(arg, state->fuse->image.zeroes, cur.length);
+		stats_increment(state, zero_chunk_reads, 1);
+		stats_increment(state, bytes_read, cur.length);
+		return 0;
+	}
+	ent = entry_acquire(state, cur.chunk, FILL_DATA);
+	if (entry_unreadable(ent)) {
+		entry_release(state, ent, FALSE);
+		return -EIO;
+	}
+	reply(arg, ent->data + cur.offset, cur.length);
+	entry_release(state, ent, FALSE);
+	stats_increment(state, bytes_read, cur.length);
+	return 0;
+}
+
+/* If @buf is NULL, data is obtained from @copy instead, in order. */
+static int write_chunks(struct pk_state *state, const char *buf,
+			image_copy_fn *copy, void *arg, off_t start,
 			size_t count)
 {
 	struct io_cursor cur;
 	struct cache_entry *ent;
 	gboolean whole_chunk;
+	enum entry_fill fill;
+	ssize_t copied;
 
 	pk_log(LOG_FUSE, "Write %"PRIu64" at %"PRIu64, (uint64_t) count,
 				(uint64_t) start);
 	for (io_start(state, &cur, start, count); io_chunk(&cur); ) {
 		whole_chunk = cur.length == state->parcel->chunksize;
-		ent = entry_acquire(state, cur.chunk, !whole_chunk);
-		if (ent->error) {
+		/* Data from @copy can't be checked until it's in the
+		   buffer, but writeback still records all-zero chunks
+		   without storing them */
+		if (whole_chunk && buf != NULL && buf_is_zero(buf +
+					cur.buf_offset, cur.length)) {
+			if (!entry_write_zero(state, cur.chunk))
+				return (int) cur.buf_offset ?: -EIO;
+			stats_increment(state, bytes_written, cur.length);
+			stats_increment(state, whole_chunk_updates, 1);
+			continue;
+		}
+		/* Block-aligned writes don't need the old contents of the
+		   chunk until later.  A whole-chunk write from @copy may
+		   come up short, so it still needs them then. */
+		if (whole_chunk && buf != NULL)
+			fill = FILL_NONE;
+		else if (whole_chunk || (state->parcel->chunksize %
+					ABSORB_BLOCK == 0 &&
+					cur.offset % ABSORB_BLOCK == 0 &&
+					cur.length % ABSORB_BLOCK == 0))
+			fill = FILL_PARTIAL;
+		else
+			fill = FILL_DATA;
+		ent = entry_acquire(state, cur.chunk, fill);
+		if (ent->error || (fill == FILL_DATA &&
+					ent->valid != NULL)) {
 			entry_release(state, ent, FALSE);
 			return (int) cur.buf_offset ?: -EIO;
 		}
-		memcpy(ent->data + cur.offset, buf + cur.buf_offset,
-					cur.length);
+		if (!whole_chunk && ent->valid != NULL)
+			stats_increment(state, absorbed_writes, 1);
+		if (buf != NULL) {
+			memcpy(ent->data + cur.offset, buf + cur.buf_offset,
+						cur.length);
+		} else {
+			copied = copy(arg, ent->data + cur.offset,
+						cur.length);
+			if (copied < (ssize_t) cur.length) {
+				/* Keep whatever arrived, as a torn write.
+				   A partial block isn't marked valid, so
+				   a partially-loaded entry will get the
+				   rest of it from the old contents. */
+				copied = MAX(copied, 0);
+				entry_mark_valid(state, ent, cur.offset,
+							copied);
+				entry_release(state, ent, copied > 0);
+				return (int) (cur.buf_offset + copied) ?:
+							-EIO;
+			}
+		}
+		entry_mark_valid(state, ent, cur.offset, cur.length);
 		entry_release(state, ent, TRUE);
 		stats_increment(state, bytes_written, cur.length);
 		if (whole_chunk)
@@ -454,9 +1580,32 @@ int image_write(struct pk_state *state, const char *buf, off_t start,
 	return cur.buf_offset;
 }
 
-void image_sync(struct pk_state *state)
+int image_write(struct pk_state *state, const char *buf, off_t start,
+			size_t count)
+{
+	return write_chunks(state, buf, NULL, NULL, start, count);
+}
+
+/* Write data obtained from @copy directly into the chunk cache, so that
+   data arriving through a pipe needn't be staged in a separate buffer. */
+int image_write_copy(struct pk_state *state, image_copy_fn *copy, void *arg,
+			off_t start, size_t count)
 {
+	return write_chunks(state, NULL, copy, arg, start, count);
+}
+
+/* Write back all dirty entries.  Returns -EIO if a partial write still
+   can't be merged or if written data has ever been lost, 0 otherwise. */
+int image_sync(struct pk_state *state)
+{
+	int ret = 0;
+
 	g_mutex_lock(state->fuse->image.lock);
+	entry_retry_failed(state, TRUE);
 	entry_clean_all(state, TRUE);
+	if (state->fuse->image.failed.head != NULL ||
+				state->fuse->image.write_failed)
+		ret = -EIO;
 	g_mutex_unlock(state->fuse->image.lock);
+	return ret;
 }
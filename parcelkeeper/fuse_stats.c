@@ -16,6 +16,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <errno.h>
 #include "defs.h"
@@ -30,9 +31,100 @@ typedef gboolean (stat_handler)(void *data, const char *name);
 	return ret;				\
 } while (0)
 
+static const char *xfer_source_names[XFER_NR] = {
+	[XFER_CACHE] = "cache",
+	[XFER_HOARD] = "hoard",
+	[XFER_NETWORK] = "network",
+	[XFER_DECODE] = "decode",
+};
+
+static gchar *format_latency_histogram(struct pk_state *state,
+			enum pk_xfer_source src)
+{
+	uint64_t counts[XFER_LATENCY_BUCKETS];
+	GString *str;
+	int last = -1;
+	int i;
+
+	for (i = 0; i < XFER_LATENCY_BUCKETS; i++) {
+		counts[i] = xfer_get(state, latency[src][i]);
+		if (counts[i])
+			last = i;
+	}
+	/* One line per bucket: lower bound in usec, count */
+	str = g_string_new("");
+	for (i = 0; i <= last; i++)
+		g_string_append_printf(str, "%"PRIu64" %"PRIu64"\n",
+					i ? ((uint64_t) 1) << i : 0,
+					counts[i]);
+	return g_string_free(str, FALSE);
+}
+
+/* Transfer statistics are maintained with atomic operations, so they
+   don't need a lock */
+static gchar *_xfer_statistic(struct pk_state *state, stat_handler *handle,
+			void *data)
+{
+	gchar *name;
+	gchar *ret = NULL;
+	uint64_t chunks;
+	int i;
+
+	for (i = 0; i < XFER_NR; i++) {
+		name = g_strdup_printf("xfer_%s_chunks", xfer_source_names[i]);
+		if (handle(data, name))
+			ret = g_strdup_printf("%"PRIu64"\n",
+						xfer_get(state, chunks[i]));
+		g_free(name);
+		if (ret)
+			return ret;
+
+		name = g_strdup_printf("xfer_%s_bytes", xfer_source_names[i]);
+		if (handle(data, name))
+			ret = g_strdup_printf("%"PRIu64"\n",
+						xfer_get(state, bytes[i]));
+		g_free(name);
+		if (ret)
+			return ret;
+
+		name = g_strdup_printf("xfer_%s_latency_avg_us",
+					xfer_source_names[i]);
+		if (handle(data, name)) {
+			chunks = xfer_get(state, chunks[i]);
+			if (chunks)
+				ret = g_strdup_printf("%"PRIu64"\n",
+						xfer_get(state, usec[i]) /
+						chunks);
+			else
+				ret = g_strdup("n/a\n");
+		}
+		g_free(name);
+		if (ret)
+			return ret;
+
+		name = g_strdup_printf("xfer_%s_latency_hist",
+					xfer_source_names[i]);
+		if (handle(data, name))
+			ret = format_latency_histogram(state, i);
+		g_free(name);
+		if (ret)
+			return ret;
+	}
+	if (handle(data, "xfer_retries"))
+		return g_strdup_printf("%"PRIu64"\n", xfer_get(state, retries));
+	if (handle(data, "xfer_failures"))
+		return g_strdup_printf("%"PRIu64"\n",
+					xfer_get(state, failures));
+	if (handle(data, "xfer_in_flight"))
+		return g_strdup_printf("%"PRIu64"\n",
+					xfer_get(state, in_flight));
+	return NULL;
+}
+
 static gchar *_statistic(struct pk_state *state, stat_handler *handle,
 			void *data)
 {
+	struct pk_hoard_stats hoard;
 	gchar *ret;
 
 	if (handle(data, "bytes_read"))
@@ -62,10 +154,47 @@ static gchar *_statistic(struct pk_state *state, stat_handler *handle,
 	if (handle(data, "cache_evictions_dirty"))
 		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
 					state->stats.cache_evictions_dirty);
+	if (handle(data, "cache_precleans"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.cache_precleans);
+	if (handle(data, "cache_ghost_hits_recent"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.cache_ghost_hits_recent);
+	if (handle(data, "cache_ghost_hits_frequent"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.cache_ghost_hits_frequent);
+	if (handle(data, "cache_shrink_releases"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.cache_shrink_releases);
+	if (handle(data, "parallel_misses"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.parallel_misses);
+	if (handle(data, "cache_capacity_mb"))
+		return g_strdup_printf("%u\n", image_get_cache_size(state));
+	if (handle(data, "cache_policy"))
+		return g_strdup_printf("%s\n",
+					cache_policy_name(state->conf->
+					cache_policy));
+	if (handle(data, "arena_bytes"))
+		return g_strdup_printf("%"PRIu64"\n", (uint64_t)
+					state->fuse->image.arena_size);
+	if (handle(data, "arena_used_bytes"))
+		RETURN_FORMAT(state->fuse->image.lock, "%"PRIu64"\n",
+					(uint64_t) state->parcel->chunksize *
+					(state->fuse->image.carved -
+					state->fuse->image.free_count));
+	if (handle(data, "arena_backing"))
+		return g_strdup_printf("%s\n", image_arena_backing_name(
+					state->fuse->image.arena_backing));
+	if (handle(data, "arena_locked"))
+		return g_strdup_printf("%d\n",
+					!!state->fuse->image.arena_locked);
+	if (handle(data, "arena_huge_kb"))
+		return g_strdup_printf("%"PRIu64"\n",
+					image_arena_huge_kb(state));
 	if (handle(data, "cache_dirty"))
 		RETURN_FORMAT(state->fuse->image.lock, "%u\n",
-					g_queue_get_length(state->fuse->
-					image.dirty));
+					state->fuse->image.dirty.length);
 	if (handle(data, "compression_ratio_pct")) {
 		g_mutex_lock(state->stats_lock);
 		if (state->stats.chunk_writes)
@@ -81,7 +210,60 @@ static gchar *_statistic(struct pk_state *state, stat_handler *handle,
 	if (handle(data, "whole_chunk_updates"))
 		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
 					state->stats.whole_chunk_updates);
-	return NULL;
+	if (handle(data, "zero_chunk_reads"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.zero_chunk_reads);
+	if (handle(data, "zero_chunk_writes"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.zero_chunk_writes);
+	if (handle(data, "absorbed_writes"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.absorbed_writes);
+	if (handle(data, "absorb_covered"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.absorb_covered);
+	if (handle(data, "absorb_merges"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.absorb_merges);
+	if (handle(data, "prefetch_fetched"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.prefetch_fetched);
+	if (handle(data, "prefetch_used"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.prefetch_used);
+	if (handle(data, "prefetch_accuracy_pct")) {
+		g_mutex_lock(state->stats_lock);
+		if (state->stats.prefetch_fetched)
+			ret = g_strdup_printf("%.1f\n", 100.0 *
+					state->stats.prefetch_used /
+					state->stats.prefetch_fetched);
+		else
+			ret = g_strdup("n/a\n");
+		g_mutex_unlock(state->stats_lock);
+		return ret;
+	}
+	if (handle(data, "profile_fetched"))
+		RETURN_FORMAT(state->stats_lock, "%"PRIu64"\n",
+					state->stats.profile_fetched);
+	if (handle(data, "hoard_present_pct")) {
+		if (state->hoard == NULL || hoard_get_stats(state, &hoard,
+					NULL))
+			return g_strdup("n/a\n");
+		if (hoard.referenced)
+			return g_strdup_printf("%.1f\n", 100.0 *
+						hoard.present /
+						hoard.referenced);
+		return g_strdup("100.0\n");
+	}
+	if (handle(data, "hoard_unique_bytes")) {
+		if (state->hoard == NULL || hoard_get_stats(state, &hoard,
+					NULL))
+			return g_strdup("n/a\n");
+		return g_strdup_printf("%"PRId64"\n", hoard.unique_bytes);
+	}
+	if (handle(data, "prefetch_radius"))
+		return g_strdup_printf("%u\n", prefetch_get_radius(state));
+	return _xfer_statistic(state, handle, data);
 }
 
 #undef RETURN_FORMAT
@@ -112,14 +294,10 @@ gchar *stat_get(struct pk_state *state, const char *name)
 	return _statistic(state, _stat_compare, (char *) name);
 }
 
-int stat_open(struct pk_state *state, const char *name)
+static int add_buffer(struct pk_state *state, gchar *buf)
 {
-	gchar *buf;
 	int fh;
 
-	buf = stat_get(state, name);
-	if (buf == NULL)
-		return -ENOENT;
 	g_mutex_lock(state->fuse->stat_buffer_lock);
 	/* Find the next available file handle */
 	for (fh = 1; g_hash_table_lookup(state->fuse->stat_buffers,
@@ -130,6 +308,16 @@ int stat_open(struct pk_state *state, const char *name)
 	return fh;
 }
 
+int stat_open(struct pk_state *state, const char *name)
+{
+	gchar *buf;
+
+	buf = stat_get(state, name);
+	if (buf == NULL)
+		return -ENOENT;
+	return add_buffer(state, buf);
+}
+
 int stat_read(struct pk_state *state, int fh, char *buf, off_t start,
 			size_t count)
 {
@@ -155,13 +343,111 @@ void stat_release(struct pk_state *state, int fh)
 {
 	g_mutex_lock(state->fuse->stat_buffer_lock);
 	g_hash_table_remove(state->fuse->stat_buffers, GINT_TO_POINTER(fh));
+	g_hash_table_remove(state->fuse->control_names, GINT_TO_POINTER(fh));
+	g_mutex_unlock(state->fuse->stat_buffer_lock);
+}
+
+/* Control files.  Each can be read for its current value and written
+   with a new one, which takes effect immediately. */
+
+static gchar *_control(struct pk_state *state, stat_handler *handle,
+			void *data)
+{
+	if (handle(data, "chunk_cache"))
+		return g_strdup_printf("%u\n", image_get_cache_size(state));
+	if (handle(data, "chunk_cache_auto"))
+		return g_strdup_printf("%d\n", !!tune_get_enabled(state));
+	return NULL;
+}
+
+static int control_set(struct pk_state *state, const char *name,
+			unsigned value)
+{
+	if (g_str_equal(name, "chunk_cache")) {
+		if (image_set_cache_size(state, value))
+			return -EINVAL;
+		return 0;
+	}
+	if (g_str_equal(name, "chunk_cache_auto")) {
+		if (value > 1)
+			return -EINVAL;
+		if (tune_set_enabled(state, value))
+			return -EOPNOTSUPP;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+gchar **control_list(struct pk_state *state)
+{
+	GPtrArray *arr;
+
+	arr = g_ptr_array_new();
+	_control(state, _stat_enumerate, arr);
+	g_ptr_array_add(arr, NULL);
+	return (gchar **) g_ptr_array_free(arr, FALSE);
+}
+
+gchar *control_get(struct pk_state *state, const char *name)
+{
+	return _control(state, _stat_compare, (char *) name);
+}
+
+int control_open(struct pk_state *state, const char *name)
+{
+	gchar *buf;
+	int fh;
+
+	buf = control_get(state, name);
+	if (buf == NULL)
+		return -ENOENT;
+	fh = add_buffer(state, buf);
+	g_mutex_lock(state->fuse->stat_buffer_lock);
+	g_hash_table_insert(state->fuse->control_names, GINT_TO_POINTER(fh),
+				g_strdup(name));
+	g_mutex_unlock(state->fuse->stat_buffer_lock);
+	return fh;
+}
+
+/* The whole value must arrive in a single write, as it does from
+   "echo 512 > chunk_cache". */
+int control_write(struct pk_state *state, int fh, const char *buf,
+			off_t start, size_t count)
+{
+	gchar *name;
+	gchar *str;
+	gchar *end;
+	unsigned long value;
+	int ret;
+
+	g_mutex_lock(state->fuse->stat_buffer_lock);
+	name = g_strdup(g_hash_table_lookup(state->fuse->control_names,
+				GINT_TO_POINTER(fh)));
 	g_mutex_unlock(state->fuse->stat_buffer_lock);
+	if (name == NULL)
+		return -EBADF;
+	if (start != 0 || count > 32) {
+		g_free(name);
+		return -EINVAL;
+	}
+	str = g_strstrip(g_strndup(buf, count));
+	errno = 0;
+	value = strtoul(str, &end, 10);
+	if (*str == 0 || *end != 0 || errno || value > G_MAXUINT)
+		ret = -EINVAL;
+	else
+		ret = control_set(state, name, value);
+	g_free(str);
+	g_free(name);
+	return ret ? ret : (int) count;
 }
 
 void stat_init(struct pk_state *state)
 {
 	state->fuse->stat_buffers = g_hash_table_new_full(g_direct_hash,
 				g_direct_equal, NULL, g_free);
+	state->fuse->control_names = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, g_free);
 	state->fuse->stat_buffer_lock = g_mutex_new();
 }
 
@@ -181,6 +467,7 @@ void stat_shutdown(struct pk_state *state, gboolean normal)
 		}
 		g_strfreev(stats);
 	}
+	g_hash_table_destroy(state->fuse->control_names);
 	g_hash_table_destroy(state->fuse->stat_buffers);
 	g_mutex_free(state->fuse->stat_buffer_lock);
 }
@@ -0,0 +1,255 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Automatic chunk cache sizing.  We register a trigger with the kernel's
+   pressure stall information (PSI) interface and shrink the cache sharply
+   whenever tasks stall on memory.  Once the system has been free of
+   pressure for a while, and the cache has been evicting chunks, we grow it
+   again in small steps up to the size reserved at startup.  The asymmetry
+   keeps us from oscillating around the point where pressure begins. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "defs.h"
+#include "fuse_defs.h"
+
+#define PSI_PATH "/proc/pressure/memory"
+/* Notify when tasks stall for 300 ms of any 2 s window.  Unprivileged
+   processes may only create triggers whose window is a multiple of 2 s,
+   and only on Linux 6.5 and later. */
+#define PSI_TRIGGER "some 300000 2000000"
+#define TUNE_POLL_MS 1000
+#define SHRINK_PCT 25		/* of current size, per pressure event */
+#define GROW_PCT 12		/* of current size, per growth step */
+#define GROW_QUIET 60		/* seconds of no pressure before growing */
+#define GROW_INTERVAL 10	/* seconds between growth steps */
+#define FLOOR_DIV 4		/* never shrink below 1/4 of --chunk-cache */
+
+struct pk_tune {
+	GThread *thread;
+	GMutex *lock;
+	gboolean enabled;
+	gboolean stopping;
+	gboolean failed;	/* tuning thread has exited */
+	int psi_fd;
+	unsigned floor;		/* MB */
+	time_t last_pressure;
+	time_t last_grow;
+	uint64_t last_evictions;
+};
+
+static void tune_pressure(struct pk_state *state, time_t now)
+{
+	struct pk_tune *tune = state->fuse->tune;
+	unsigned size;
+	unsigned target;
+
+	tune->last_pressure = now;
+	size = image_get_cache_size(state);
+	target = MAX(tune->floor, size - size * SHRINK_PCT / 100);
+	if (target < size) {
+		pk_log(LOG_INFO, "Memory pressure: shrinking chunk cache "
+					"to %u MB", target);
+		image_set_cache_size(state, target);
+	}
+}
+
+static void tune_idle(struct pk_state *state, time_t now)
+{
+	struct pk_tune *tune = state->fuse->tune;
+	uint64_t evictions;
+	unsigned size;
+	unsigned max;
+	unsigned target;
+
+	if (now - tune->last_pressure < GROW_QUIET ||
+				now - tune->last_grow < GROW_INTERVAL)
+		return;
+	tune->last_grow = now;
+	g_mutex_lock(state->stats_lock);
+	evictions = state->stats.cache_evictions;
+	g_mutex_unlock(state->stats_lock);
+	/* Only grow if the cache is too small for the working set */
+	if (evictions == tune->last_evictions)
+		return;
+	tune->last_evictions = evictions;
+	size = image_get_cache_size(state);
+	max = image_get_max_cache_size(state);
+	target = MIN(max, size + MAX(1, size * GROW_PCT / 100));
+	if (target > size) {
+		pk_log(LOG_INFO, "Growing chunk cache to %u MB", target);
+		image_set_cache_size(state, target);
+	}
+}
+
+static gpointer tuner(gpointer data)
+{
+	struct pk_state *state = data;
+	struct pk_tune *tune = state->fuse->tune;
+	struct pollfd pfd = {
+		.fd = tune->psi_fd,
+		.events = POLLPRI,
+	};
+	time_t now;
+	int ret;
+
+	while (1) {
+		ret = poll(&pfd, 1, TUNE_POLL_MS);
+		if (ret < 0 && errno != EINTR) {
+			pk_log(LOG_ERROR, "Couldn't poll %s: %s", PSI_PATH,
+						strerror(errno));
+			break;
+		}
+		if (ret > 0 && (pfd.revents & POLLERR)) {
+			pk_log(LOG_ERROR, "Memory pressure trigger failed");
+			break;
+		}
+		/* The image lock is never held while taking ours, so we
+		   can resize the cache without dropping it */
+		g_mutex_lock(tune->lock);
+		if (tune->stopping) {
+			g_mutex_unlock(tune->lock);
+			break;
+		}
+		if (tune->enabled) {
+			now = time(NULL);
+			if (ret > 0 && (pfd.revents & POLLPRI))
+				tune_pressure(state, now);
+			else
+				tune_idle(state, now);
+		}
+		g_mutex_unlock(tune->lock);
+	}
+	g_mutex_lock(tune->lock);
+	if (!tune->stopping && tune->enabled)
+		pk_log(LOG_WARNING, "Disabling automatic chunk cache sizing");
+	tune->enabled = FALSE;
+	tune->failed = TRUE;
+	g_mutex_unlock(tune->lock);
+	return NULL;
+}
+
+/* Returns the trigger fd, or -1 with errno set */
+static int psi_open(void)
+{
+	int fd;
+	int err;
+
+	fd = open(PSI_PATH, O_RDWR | O_NONBLOCK);
+	if (fd == -1)
+		return -1;
+	if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) == -1) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+pk_err_t tune_init(struct pk_state *state)
+{
+	struct pk_tune *tune;
+	GError *err = NULL;
+
+	tune = g_slice_new0(struct pk_tune);
+	tune->lock = g_mutex_new();
+	tune->floor = MAX(1, state->conf->chunk_cache / FLOOR_DIV);
+	tune->last_pressure = tune->last_grow = time(NULL);
+	state->fuse->tune = tune;
+	tune->psi_fd = psi_open();
+	if (tune->psi_fd == -1) {
+		if (state->conf->flags & WANT_AUTO_CACHE)
+			pk_log(LOG_WARNING, "Couldn't register memory "
+						"pressure trigger on %s: %s; "
+						"not resizing chunk cache",
+						PSI_PATH, strerror(errno));
+		else
+			pk_log(LOG_INFO, "Memory pressure notification "
+						"unavailable: %s",
+						strerror(errno));
+		return PK_SUCCESS;
+	}
+	tune->enabled = !!(state->conf->flags & WANT_AUTO_CACHE);
+	tune->thread = g_thread_create(tuner, state, TRUE, &err);
+	if (tune->thread == NULL) {
+		pk_log(LOG_ERROR, "Couldn't create cache tuning thread: %s",
+					err->message);
+		g_clear_error(&err);
+		close(tune->psi_fd);
+		state->fuse->tune = NULL;
+		g_mutex_free(tune->lock);
+		g_slice_free(struct pk_tune, tune);
+		return PK_CALLFAIL;
+	}
+	return PK_SUCCESS;
+}
+
+void tune_shutdown(struct pk_state *state)
+{
+	struct pk_tune *tune = state->fuse->tune;
+
+	if (tune == NULL)
+		return;
+	if (tune->thread != NULL) {
+		g_mutex_lock(tune->lock);
+		tune->stopping = TRUE;
+		g_mutex_unlock(tune->lock);
+		g_thread_join(tune->thread);
+		close(tune->psi_fd);
+	}
+	state->fuse->tune = NULL;
+	g_mutex_free(tune->lock);
+	g_slice_free(struct pk_tune, tune);
+}
+
+pk_err_t tune_set_enabled(struct pk_state *state, gboolean enabled)
+{
+	struct pk_tune *tune = state->fuse->tune;
+	pk_err_t ret = PK_SUCCESS;
+
+	g_mutex_lock(tune->lock);
+	if (tune->thread == NULL || tune->failed) {
+		ret = PK_CALLFAIL;
+	} else if (enabled && !tune->enabled) {
+		/* Don't grow until we've watched for pressure for a while */
+		tune->enabled = TRUE;
+		tune->last_pressure = tune->last_grow = time(NULL);
+		pk_log(LOG_INFO, "Enabled automatic chunk cache sizing");
+	} else if (!enabled && tune->enabled) {
+		tune->enabled = FALSE;
+		pk_log(LOG_INFO, "Disabled automatic chunk cache sizing");
+	}
+	g_mutex_unlock(tune->lock);
+	return ret;
+}
+
+gboolean tune_get_enabled(struct pk_state *state)
+{
+	struct pk_tune *tune = state->fuse->tune;
+	gboolean ret;
+
+	g_mutex_lock(tune->lock);
+	ret = tune->enabled;
+	g_mutex_unlock(tune->lock);
+	return ret;
+}
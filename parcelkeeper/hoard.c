@@ -17,14 +17,25 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
 #include "defs.h"
 
-#define HOARD_INDEX_VERSION 9
-#define EXPAND_CHUNKS 256
+#define HOARD_INDEX_VERSION 16
+/* Number of chunks in the slot cache before we record them in the chunks
+   table */
+#define SLOT_CACHE_CHUNKS 256
+/* Number of chunks, and bytes of chunk data, we buffer before writing them
+   to the hoard file */
+#define WRITE_BATCH_CHUNKS 64
+#define WRITE_BATCH_BYTES (1 << 20)
+/* Size of the runs of free space we reserve for appending new chunks */
+#define SEGMENT_SIZE (32 << 20)
 
 /* Generator for an transaction wrapper around a function which expects to be
    called within a state->hoard transaction.  The wrapper discards errors
@@ -39,14 +50,249 @@ again:							\
 	if (TRANSACTION_CALL) {				\
 		retry = query_busy(state->hoard);	\
 		rollback(state->hoard);			\
+		hoard_map_rollback(state);		\
 		if (retry) {				\
 			query_backoff(state->hoard);	\
 			goto again;			\
 		}					\
 		return;					\
 	}						\
-	if (!commit(state->hoard))			\
+	if (commit(state->hoard)) {			\
+		hoard_map_commit(state);		\
+	} else {					\
 		rollback(state->hoard);			\
+		hoard_map_rollback(state);		\
+	}						\
+}
+
+/* Chunks modified in a parcel's keyring since its refs were last synced,
+   so that the next sync can drop their old tags */
+static pk_err_t create_pending_refs(struct pk_state *state)
+{
+	if (!query(NULL, state->hoard, "CREATE TABLE pending_refs ("
+				"parcel INTEGER NOT NULL, "
+				"chunk INTEGER NOT NULL, "
+				"old_tag BLOB NOT NULL, "
+				"new_tag BLOB NOT NULL)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create pending "
+					"reference table");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->hoard, "CREATE UNIQUE INDEX "
+				"pending_refs_constraint ON pending_refs "
+				"(parcel, chunk)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create pending "
+					"reference index");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* Per-parcel record of the order in which the guest reads chunks, so
+   that we can hoard them in that order */
+static pk_err_t create_access_profile(struct pk_state *state)
+{
+	if (!query(NULL, state->hoard, "CREATE TABLE access_profile ("
+				"parcel INTEGER NOT NULL, "
+				"chunk INTEGER NOT NULL, "
+				"first_touch INTEGER NOT NULL, "
+				"reads INTEGER NOT NULL DEFAULT 0)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create access profile "
+					"table");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->hoard, "CREATE UNIQUE INDEX "
+				"access_profile_constraint ON access_profile "
+				"(parcel, chunk)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create access profile "
+					"index");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* Triggers which keep the hoard statistics up to date as refs and chunks
+   change.  For each parcel we count its refs, the referenced chunks which
+   are present in the hoard cache, and the present chunks which no other
+   parcel references.  A ref for a tag which isn't present doesn't count
+   toward any parcel's uniq, so the refs triggers only adjust the parcels
+   with refs to a tag that has a present chunk. */
+static const char *stats_triggers[] = {
+	"CREATE TRIGGER refs_insert AFTER INSERT ON refs BEGIN "
+		"UPDATE parcels SET referenced = referenced + 1 "
+			"WHERE parcel == NEW.parcel; "
+		"UPDATE parcels SET present = present + 1, "
+			"present_bytes = present_bytes + "
+			"(SELECT length FROM chunks WHERE tag == NEW.tag) "
+			"WHERE parcel == NEW.parcel AND "
+			"NEW.tag IN (SELECT tag FROM chunks); "
+		/* The chunk is now unique to this parcel */
+		"UPDATE parcels SET uniq = uniq + 1, "
+			"unique_bytes = unique_bytes + "
+			"(SELECT length FROM chunks WHERE tag == NEW.tag) "
+			"WHERE parcel == NEW.parcel AND "
+			"NEW.tag IN (SELECT tag FROM chunks) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == NEW.tag) == 1; "
+		/* ...or was unique to another parcel and is now shared */
+		"UPDATE parcels SET uniq = uniq - 1, "
+			"unique_bytes = unique_bytes - "
+			"(SELECT length FROM chunks WHERE tag == NEW.tag) "
+			"WHERE parcel IN (SELECT parcel FROM refs WHERE "
+			"tag == NEW.tag AND parcel != NEW.parcel) AND "
+			"NEW.tag IN (SELECT tag FROM chunks) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == NEW.tag) == 2; "
+	"END",
+	"CREATE TRIGGER refs_delete AFTER DELETE ON refs BEGIN "
+		"UPDATE parcels SET referenced = referenced - 1 "
+			"WHERE parcel == OLD.parcel; "
+		"UPDATE parcels SET present = present - 1, "
+			"present_bytes = present_bytes - "
+			"(SELECT length FROM chunks WHERE tag == OLD.tag) "
+			"WHERE parcel == OLD.parcel AND "
+			"OLD.tag IN (SELECT tag FROM chunks); "
+		"UPDATE parcels SET uniq = uniq - 1, "
+			"unique_bytes = unique_bytes - "
+			"(SELECT length FROM chunks WHERE tag == OLD.tag) "
+			"WHERE parcel == OLD.parcel AND "
+			"OLD.tag IN (SELECT tag FROM chunks) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == OLD.tag) == 0; "
+		"UPDATE parcels SET uniq = uniq + 1, "
+			"unique_bytes = unique_bytes + "
+			"(SELECT length FROM chunks WHERE tag == OLD.tag) "
+			"WHERE parcel IN (SELECT parcel FROM refs WHERE "
+			"tag == OLD.tag) AND "
+			"OLD.tag IN (SELECT tag FROM chunks) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == OLD.tag) == 1; "
+	"END",
+	"CREATE TRIGGER chunks_insert AFTER INSERT ON chunks "
+				"WHEN NEW.tag NOTNULL BEGIN "
+		"UPDATE totals SET chunks = chunks + 1, "
+			"bytes = bytes + NEW.length; "
+		"UPDATE parcels SET present = present + 1, "
+			"present_bytes = present_bytes + NEW.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == NEW.tag); "
+		"UPDATE parcels SET uniq = uniq + 1, "
+			"unique_bytes = unique_bytes + NEW.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == NEW.tag) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == NEW.tag) == 1; "
+	"END",
+	"CREATE TRIGGER chunks_delete AFTER DELETE ON chunks "
+				"WHEN OLD.tag NOTNULL BEGIN "
+		"UPDATE totals SET chunks = chunks - 1, "
+			"bytes = bytes - OLD.length; "
+		"UPDATE parcels SET present = present - 1, "
+			"present_bytes = present_bytes - OLD.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == OLD.tag); "
+		"UPDATE parcels SET uniq = uniq - 1, "
+			"unique_bytes = unique_bytes - OLD.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == OLD.tag) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == OLD.tag) == 1; "
+	"END",
+	/* Remove the old chunk and add the new one.  A NULL tag matches no
+	   refs, so only the totals need to check for it. */
+	"CREATE TRIGGER chunks_update AFTER UPDATE OF tag, length ON chunks "
+				"BEGIN "
+		"UPDATE totals SET "
+			"chunks = chunks - (OLD.tag NOTNULL) + "
+			"(NEW.tag NOTNULL), "
+			"bytes = bytes - (OLD.tag NOTNULL) * OLD.length + "
+			"(NEW.tag NOTNULL) * NEW.length; "
+		"UPDATE parcels SET present = present - 1, "
+			"present_bytes = present_bytes - OLD.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == OLD.tag); "
+		"UPDATE parcels SET uniq = uniq - 1, "
+			"unique_bytes = unique_bytes - OLD.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == OLD.tag) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == OLD.tag) == 1; "
+		"UPDATE parcels SET present = present + 1, "
+			"present_bytes = present_bytes + NEW.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == NEW.tag); "
+		"UPDATE parcels SET uniq = uniq + 1, "
+			"unique_bytes = unique_bytes + NEW.length "
+			"WHERE parcel IN (SELECT parcel FROM refs "
+			"WHERE tag == NEW.tag) AND "
+			"(SELECT count(*) FROM refs "
+			"WHERE tag == NEW.tag) == 1; "
+	"END",
+};
+
+/* Recompute the hoard statistics from scratch.  Must be within
+   transaction. */
+static pk_err_t _recount_stats(struct pk_state *state)
+{
+	if (!query(NULL, state->hoard, "UPDATE parcels SET "
+				"referenced = (SELECT count(*) FROM refs "
+				"WHERE refs.parcel == parcels.parcel), "
+				"present = (SELECT count(*) FROM refs "
+				"JOIN chunks ON chunks.tag == refs.tag "
+				"WHERE refs.parcel == parcels.parcel), "
+				"present_bytes = (SELECT "
+				"ifnull(sum(chunks.length), 0) FROM refs "
+				"JOIN chunks ON chunks.tag == refs.tag "
+				"WHERE refs.parcel == parcels.parcel), "
+				"uniq = (SELECT count(*) FROM refs "
+				"JOIN chunks ON chunks.tag == refs.tag "
+				"WHERE refs.parcel == parcels.parcel AND "
+				"(SELECT count(*) FROM refs AS other "
+				"WHERE other.tag == refs.tag) == 1), "
+				"unique_bytes = (SELECT "
+				"ifnull(sum(chunks.length), 0) FROM refs "
+				"JOIN chunks ON chunks.tag == refs.tag "
+				"WHERE refs.parcel == parcels.parcel AND "
+				"(SELECT count(*) FROM refs AS other "
+				"WHERE other.tag == refs.tag) == 1)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't count parcel statistics");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->hoard, "UPDATE totals SET "
+				"chunks = (SELECT count(*) FROM chunks "
+				"WHERE tag NOTNULL), "
+				"bytes = (SELECT ifnull(sum(length), 0) "
+				"FROM chunks WHERE tag NOTNULL)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't count hoard totals");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* The parcels table must already have the statistics columns */
+static pk_err_t create_stats(struct pk_state *state)
+{
+	unsigned i;
+
+	if (!query(NULL, state->hoard, "CREATE TABLE totals ("
+				"chunks INTEGER NOT NULL DEFAULT 0, "
+				"bytes INTEGER NOT NULL DEFAULT 0)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create totals table");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->hoard, "INSERT INTO totals (chunks, bytes) "
+				"VALUES (0, 0)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't initialize totals table");
+		return PK_IOERR;
+	}
+	for (i = 0; i < G_N_ELEMENTS(stats_triggers); i++) {
+		if (!query(NULL, state->hoard, stats_triggers[i], NULL)) {
+			sql_log_err(state->hoard, "Couldn't create statistics "
+						"trigger");
+			return PK_IOERR;
+		}
+	}
+	return _recount_stats(state);
 }
 
 static pk_err_t create_hoard_index(struct pk_state *state)
@@ -62,7 +308,16 @@ static pk_err_t create_hoard_index(struct pk_state *state)
 				"uuid TEXT UNIQUE NOT NULL, "
 				"server TEXT NOT NULL, "
 				"user TEXT NOT NULL, "
-				"name TEXT NOT NULL)", NULL)) {
+				"name TEXT NOT NULL, "
+				/* maintained by the statistics triggers */
+				"referenced INTEGER NOT NULL DEFAULT 0, "
+				"present INTEGER NOT NULL DEFAULT 0, "
+				"present_bytes INTEGER NOT NULL DEFAULT 0, "
+				"uniq INTEGER NOT NULL DEFAULT 0, "
+				"unique_bytes INTEGER NOT NULL DEFAULT 0, "
+				/* generation of the last uploaded keyring */
+				"keyring_generation INTEGER)",
+				NULL)) {
 		sql_log_err(state->hoard, "Couldn't create parcel table");
 		return PK_IOERR;
 	}
@@ -73,7 +328,9 @@ static pk_err_t create_hoard_index(struct pk_state *state)
 				"offset INTEGER UNIQUE NOT NULL, "
 				"length INTEGER NOT NULL DEFAULT 0, "
 				"crypto INTEGER NOT NULL DEFAULT 0, "
-				"allocated INTEGER NOT NULL DEFAULT 0)",
+				"allocated INTEGER NOT NULL DEFAULT 0, "
+				/* number of rows in refs with this tag */
+				"refcount INTEGER NOT NULL DEFAULT 0)",
 				NULL)) {
 		sql_log_err(state->hoard, "Couldn't create chunk table");
 		return PK_IOERR;
@@ -84,6 +341,12 @@ static pk_err_t create_hoard_index(struct pk_state *state)
 					"index");
 		return PK_IOERR;
 	}
+	if (!query(NULL, state->hoard, "CREATE INDEX chunks_refcount ON "
+				"chunks (refcount)", NULL)) {
+		sql_log_err(state->hoard, "Couldn't create chunk refcount "
+					"index");
+		return PK_IOERR;
+	}
 
 	if (!query(NULL, state->hoard, "CREATE TABLE refs ("
 				"parcel INTEGER NOT NULL, "
@@ -102,11 +365,29 @@ static pk_err_t create_hoard_index(struct pk_state *state)
 					"index");
 		return PK_IOERR;
 	}
-	return PK_SUCCESS;
+	if (create_pending_refs(state))
+		return PK_IOERR;
+	if (create_access_profile(state))
+		return PK_IOERR;
+	return create_stats(state);
 }
 
 static pk_err_t upgrade_hoard_index(struct pk_state *state, int ver)
 {
+	static const char *stats_columns[] = {
+		"ALTER TABLE parcels ADD COLUMN referenced INTEGER NOT NULL "
+					"DEFAULT 0",
+		"ALTER TABLE parcels ADD COLUMN present INTEGER NOT NULL "
+					"DEFAULT 0",
+		"ALTER TABLE parcels ADD COLUMN present_bytes INTEGER NOT NULL "
+					"DEFAULT 0",
+		"ALTER TABLE parcels ADD COLUMN uniq INTEGER NOT NULL "
+					"DEFAULT 0",
+		"ALTER TABLE parcels ADD COLUMN unique_bytes INTEGER NOT NULL "
+					"DEFAULT 0",
+	};
+	unsigned i;
+
 	pk_log(LOG_INFO, "Upgrading hoard cache version %d to version %d",
 				ver, HOARD_INDEX_VERSION);
 	switch (ver) {
@@ -197,6 +478,80 @@ static pk_err_t upgrade_hoard_index(struct pk_state *state, int ver)
 						"allocated chunk index");
 			return PK_IOERR;
 		}
+		/* Fall through */
+	case 9:
+		/* Chunks are now packed, so the free space is tracked by
+		   the hoard map rather than by placeholder rows */
+		if (!query(NULL, state->hoard, "DELETE FROM chunks "
+					"WHERE tag ISNULL", NULL)) {
+			sql_log_err(state->hoard, "Couldn't remove free "
+						"chunk slots");
+			return PK_IOERR;
+		}
+		/* Fall through */
+	case 10:
+		if (!query(NULL, state->hoard, "ALTER TABLE chunks ADD COLUMN "
+					"refcount INTEGER NOT NULL DEFAULT 0",
+					NULL)) {
+			sql_log_err(state->hoard, "Couldn't add refcount "
+						"column");
+			return PK_IOERR;
+		}
+		if (!query(NULL, state->hoard, "UPDATE chunks SET refcount = "
+					"(SELECT count(*) FROM refs WHERE "
+					"refs.tag == chunks.tag) "
+					"WHERE tag NOTNULL", NULL)) {
+			sql_log_err(state->hoard, "Couldn't compute chunk "
+						"refcounts");
+			return PK_IOERR;
+		}
+		if (!query(NULL, state->hoard, "CREATE INDEX chunks_refcount "
+					"ON chunks (refcount)", NULL)) {
+			sql_log_err(state->hoard, "Couldn't create chunk "
+						"refcount index");
+			return PK_IOERR;
+		}
+		/* Fall through */
+	case 11:
+		if (create_pending_refs(state))
+			return PK_IOERR;
+		/* Fall through */
+	case 12:
+		if (create_access_profile(state))
+			return PK_IOERR;
+		/* Fall through */
+	case 13:
+		for (i = 0; i < G_N_ELEMENTS(stats_columns); i++) {
+			if (!query(NULL, state->hoard, stats_columns[i],
+						NULL)) {
+				sql_log_err(state->hoard, "Couldn't add "
+							"parcel statistics "
+							"column");
+				return PK_IOERR;
+			}
+		}
+		if (create_stats(state))
+			return PK_IOERR;
+		/* Fall through */
+	case 14:
+		/* Space is now allocated from the hoard map rather than from
+		   the chunks table.  A map left over from before the upgrade
+		   may not cover chunks allocated through the old path, so
+		   discard it and let hoard_map_init() rebuild it. */
+		if (truncate(state->conf->hoard_map, 0) && errno != ENOENT) {
+			pk_log(LOG_ERROR, "Couldn't reset %s: %s",
+						state->conf->hoard_map,
+						strerror(errno));
+			return PK_IOERR;
+		}
+		/* Fall through */
+	case 15:
+		if (!query(NULL, state->hoard, "ALTER TABLE parcels ADD COLUMN "
+					"keyring_generation INTEGER", NULL)) {
+			sql_log_err(state->hoard, "Couldn't add keyring "
+						"generation column");
+			return PK_IOERR;
+		}
 	}
 	if (!query(NULL, state->hoard, "PRAGMA user_version = "
 				G_STRINGIFY(HOARD_INDEX_VERSION), NULL)) {
@@ -206,185 +561,355 @@ static pk_err_t upgrade_hoard_index(struct pk_state *state, int ver)
 	return PK_SUCCESS;
 }
 
-static pk_err_t create_slot_cache(struct pk_state *state)
+/* The slot cache holds chunks which we've written into slots reserved from
+   the hoard map but not yet recorded in the chunks table.  Recording them
+   in batches keeps hoard_put_chunk() from having to write to the shared
+   index for every chunk.  Must only be accessed within a hoard
+   transaction. */
+struct pk_slot_cache {
+	GHashTable *chunks;	/* tag -> struct cached_slot */
+	/* Unused part of the segment we're currently appending to */
+	int next;
+	unsigned remaining;	/* bytes */
+	/* Chunks which have been allocated a slot but not yet written to
+	   it.  Modified only within a hoard transaction, but also read by
+	   hoard_get_chunk() outside of one, so protected by pending_lock. */
+	GMutex *pending_lock;
+	GHashTable *pending;	/* tag -> struct pending_chunk */
+	GPtrArray *pending_order;
+	unsigned pending_bytes;
+};
+
+struct cached_slot {
+	int offset;
+	int length;
+	unsigned char tag[];
+};
+
+struct pending_chunk {
+	int offset;
+	unsigned length;
+	unsigned char *data;
+	unsigned char tag[];
+};
+
+static void slot_cache_init(struct pk_state *state)
 {
-	if (!query(NULL, state->hoard, "CREATE TEMP TABLE slots ("
-				"tag BLOB UNIQUE, "
-				"offset INTEGER UNIQUE NOT NULL, "
-				"length INTEGER NOT NULL DEFAULT 0, "
-				"crypto INTEGER NOT NULL DEFAULT 0)",
-				NULL)) {
-		sql_log_err(state->hoard, "Couldn't create slot cache");
-		return PK_IOERR;
-	}
-	return PK_SUCCESS;
+	struct pk_slot_cache *cache;
+
+	cache = g_slice_new0(struct pk_slot_cache);
+	cache->chunks = g_hash_table_new_full(hoard_tag_hash, hoard_tag_equal,
+				NULL, g_free);
+	cache->pending_lock = g_mutex_new();
+	cache->pending = g_hash_table_new(hoard_tag_hash, hoard_tag_equal);
+	cache->pending_order = g_ptr_array_new();
+	state->slot_cache = cache;
 }
 
-/* XXX cache chunks of different sizes */
-/* must be within transaction */
-static pk_err_t expand_slot_cache(struct pk_state *state)
+/* Must be called with pending_lock held */
+static void pending_clear(struct pk_slot_cache *cache)
 {
-	struct query *qry;
-	int count;
-	int start;
-	int i;
-	int step = state->parcel->chunksize >> 9;
-	int needed=EXPAND_CHUNKS;
-	gchar *type;
-
-	/* First, try to use existing unallocated slots */
-	if (!query(&qry, state->hoard, "INSERT OR IGNORE INTO temp.slots "
-				"(offset) SELECT offset FROM chunks "
-				"WHERE allocated == 0 LIMIT ?", "d", needed)) {
-		sql_log_err(state->hoard, "Error reclaiming hoard cache slots");
-		return PK_IOERR;
-	}
-	query_row(qry, "d", &count);
-	query_free(qry);
-	needed -= count;
-	if (!query(NULL, state->hoard, "UPDATE chunks SET allocated = 1 "
-				"WHERE offset IN "
-				"(SELECT offset FROM temp.slots)", NULL)) {
-		sql_log_err(state->hoard, "Couldn't allocate chunk slots");
-		return PK_IOERR;
-	}
-	if (needed == 0)
-		return PK_SUCCESS;
+	unsigned i;
 
-	/* Now expand the hoard cache as necessary to meet our quota */
-	query(&qry, state->hoard, "SELECT max(offset) FROM chunks", NULL);
-	if (!query_has_row(state->hoard)) {
-		sql_log_err(state->hoard, "Couldn't find max hoard cache "
-					"offset");
-		return PK_IOERR;
-	}
-	/* Distinguish between a max offset of 0 and a NULL value (indicating
-	   that the table is empty) */
-	type = query_column_types(qry);
-	query_row(qry, "d", &start);
-	query_free(qry);
-	if (strcmp(type, "0"))
-		start += step;
-	g_free(type);
-	for (i=0; i<needed; i++) {
-		if (!query(NULL, state->hoard, "INSERT INTO temp.slots "
-					"(offset) VALUES (?)", "d",
-					start + i * step)) {
-			sql_log_err(state->hoard, "Couldn't add new offset %d "
-						"to slot cache",
-						start + i * step);
-			return PK_IOERR;
+	for (i = 0; i < cache->pending_order->len; i++)
+		g_free(g_ptr_array_index(cache->pending_order, i));
+	g_ptr_array_set_size(cache->pending_order, 0);
+	g_hash_table_remove_all(cache->pending);
+	cache->pending_bytes = 0;
+}
+
+static void slot_cache_free(struct pk_state *state)
+{
+	struct pk_slot_cache *cache = state->slot_cache;
+	struct pending_chunk *chunk;
+	unsigned i;
+
+	/* Chunks we couldn't write were never visible to anyone else */
+	for (i = 0; i < cache->pending_order->len; i++) {
+		chunk = g_ptr_array_index(cache->pending_order, i);
+		hoard_map_release(state, chunk->offset, chunk->length);
+	}
+	pending_clear(cache);
+	g_ptr_array_free(cache->pending_order, TRUE);
+	g_hash_table_destroy(cache->pending);
+	g_mutex_free(cache->pending_lock);
+	/* Anything not yet flushed stays allocated in the hoard map until
+	   the next cleanup */
+	hoard_map_release(state, cache->next, cache->remaining);
+	g_hash_table_destroy(cache->chunks);
+	g_slice_free(struct pk_slot_cache, cache);
+	state->slot_cache = NULL;
+}
+
+static struct cached_slot *slot_cache_lookup(struct pk_state *state,
+			const void *tag)
+{
+	return g_hash_table_lookup(state->slot_cache->chunks, tag);
+}
+
+static void slot_cache_add(struct pk_state *state, const void *tag,
+			int offset, int length)
+{
+	struct cached_slot *slot;
+
+	slot = g_malloc(sizeof(*slot) + state->parcel->hashlen);
+	slot->offset = offset;
+	slot->length = length;
+	memcpy(slot->tag, tag, state->parcel->hashlen);
+	g_hash_table_replace(state->slot_cache->chunks, slot->tag, slot);
+}
+
+/* Must be within transaction */
+void hoard_slot_cache_foreach(struct pk_state *state,
+			void (*func)(const void *tag, int offset, int length,
+			void *data), void *data)
+{
+	GHashTableIter iter;
+	struct cached_slot *slot;
+
+	if (state->slot_cache == NULL)
+		return;
+	g_hash_table_iter_init(&iter, state->slot_cache->chunks);
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &slot))
+		func(slot->tag, slot->offset, slot->length, data);
+}
+
+/* Copy the data for @tag from the write buffer into @buf.  Safe to call
+   outside a transaction. */
+static pk_err_t pending_get(struct pk_state *state, const void *tag,
+			void *buf, unsigned *len)
+{
+	struct pk_slot_cache *cache = state->slot_cache;
+	struct pending_chunk *chunk;
+	pk_err_t ret = PK_NOTFOUND;
+
+	g_mutex_lock(cache->pending_lock);
+	chunk = g_hash_table_lookup(cache->pending, tag);
+	if (chunk != NULL && chunk->length <= state->parcel->chunksize) {
+		memcpy(buf, chunk->data, chunk->length);
+		*len = chunk->length;
+		ret = PK_SUCCESS;
+	}
+	g_mutex_unlock(cache->pending_lock);
+	return ret;
+}
+
+static gboolean pending_has(struct pk_state *state, const void *tag)
+{
+	struct pk_slot_cache *cache = state->slot_cache;
+	gboolean ret;
+
+	g_mutex_lock(cache->pending_lock);
+	ret = g_hash_table_lookup(cache->pending, tag) != NULL;
+	g_mutex_unlock(cache->pending_lock);
+	return ret;
+}
+
+/* Must be within transaction.  Takes a copy of @buf. */
+static void pending_add(struct pk_state *state, const void *tag, int offset,
+			const void *buf, unsigned len)
+{
+	struct pk_slot_cache *cache = state->slot_cache;
+	struct pending_chunk *chunk;
+
+	chunk = g_malloc(sizeof(*chunk) + state->parcel->hashlen + len);
+	chunk->offset = offset;
+	chunk->length = len;
+	chunk->data = chunk->tag + state->parcel->hashlen;
+	memcpy(chunk->tag, tag, state->parcel->hashlen);
+	memcpy(chunk->data, buf, len);
+	g_mutex_lock(cache->pending_lock);
+	g_hash_table_replace(cache->pending, chunk->tag, chunk);
+	g_ptr_array_add(cache->pending_order, chunk);
+	cache->pending_bytes += len;
+	g_mutex_unlock(cache->pending_lock);
+}
+
+/* Write @count buffered chunks, which must occupy consecutive slots, with
+   a single system call.  Each chunk is padded to the end of its last
+   block, as in _hoard_write_chunk(). */
+static pk_err_t write_pending_run(struct pk_state *state,
+			struct pending_chunk **chunks, unsigned count)
+{
+	static const char zero[HOARD_BLOCK_SIZE];
+	struct iovec iov[2 * count];
+	unsigned niov = 0;
+	size_t total = 0;
+	unsigned padded;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		padded = hoard_block_round(chunks[i]->length);
+		iov[niov].iov_base = chunks[i]->data;
+		iov[niov++].iov_len = chunks[i]->length;
+		if (padded > chunks[i]->length) {
+			iov[niov].iov_base = (void *) zero;
+			iov[niov++].iov_len = padded - chunks[i]->length;
 		}
+		total += padded;
 	}
-	if (!query(NULL, state->hoard, "INSERT OR IGNORE INTO chunks "
-				"(offset, allocated) "
-				"SELECT offset, 1 FROM temp.slots",
-				NULL)) {
-		sql_log_err(state->hoard, "Couldn't expand hoard cache");
+	if (pwritev(state->hoard_fd, iov, niov,
+				((off_t)chunks[0]->offset) << 9) !=
+				(ssize_t) total)
 		return PK_IOERR;
-	}
 	return PK_SUCCESS;
 }
 
-/* Must be within transaction.  Does not add chunk references. */
-static pk_err_t _flush_slot_cache(struct pk_state *state)
+/* Must be within transaction.  Writes out the write buffer, coalescing
+   chunks in adjacent slots, and moves the chunks into the slot cache.
+   A chunk only becomes visible through the slot cache and tag index once
+   its data is on disk, and only reaches the chunks table after that, so a
+   crash can at worst leak the space of buffered chunks until the next
+   map rebuild.  Chunks we fail to write are simply not hoarded. */
+static void _write_pending(struct pk_state *state)
 {
-	struct query *qry;
-	pk_err_t ret;
-	void *tag;
-	int taglen;
-	int offset;
-	int len;
-	int crypto;
+	struct pk_slot_cache *cache = state->slot_cache;
+	struct pending_chunk **chunks;
+	struct pending_chunk *chunk;
+	unsigned count = cache->pending_order->len;
+	unsigned start;
+	unsigned end;
+	unsigned i;
+
+	if (count == 0)
+		return;
+	chunks = (struct pending_chunk **) cache->pending_order->pdata;
+	for (start = 0; start < count; start = end) {
+		for (end = start + 1; end < count; end++) {
+			chunk = chunks[end - 1];
+			if (chunks[end]->offset != chunk->offset + (int)
+						(hoard_block_round(
+						chunk->length) >> 9))
+				break;
+		}
+		if (!write_pending_run(state, chunks + start, end - start)) {
+			for (i = start; i < end; i++) {
+				slot_cache_add(state, chunks[i]->tag,
+							chunks[i]->offset,
+							chunks[i]->length);
+				hoard_tags_add(state, chunks[i]->tag,
+							chunks[i]->offset,
+							chunks[i]->length);
+			}
+			continue;
+		}
+		/* Find out which chunks were affected */
+		for (i = start; i < end; i++) {
+			chunk = chunks[i];
+			if (_hoard_write_chunk(state, chunk->offset,
+						chunk->length, chunk->data)) {
+				hoard_map_release(state, chunk->offset,
+							chunk->length);
+				continue;
+			}
+			slot_cache_add(state, chunk->tag, chunk->offset,
+						chunk->length);
+			hoard_tags_add(state, chunk->tag, chunk->offset,
+						chunk->length);
+		}
+	}
+	g_mutex_lock(cache->pending_lock);
+	pending_clear(cache);
+	g_mutex_unlock(cache->pending_lock);
+}
 
-	for (query(&qry, state->hoard, "SELECT tag, offset, length, crypto "
-				"FROM temp.slots WHERE tag NOTNULL", NULL);
-				query_has_row(state->hoard); query_next(qry)) {
-		query_row(qry, "bddd", &tag, &taglen, &offset, &len, &crypto);
+/* Must be within transaction.  Does not add chunk references.  The caller
+   must empty the slot cache after the transaction commits. */
+static pk_err_t _flush_slot_cache(struct pk_state *state)
+{
+	GHashTableIter iter;
+	struct cached_slot *slot;
+	gboolean conflict = FALSE;
+
+	g_hash_table_iter_init(&iter, state->slot_cache->chunks);
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &slot)) {
+		/* Slots past the end of the table don't have rows yet */
+		if (!query(NULL, state->hoard, "INSERT OR IGNORE INTO chunks "
+					"(offset) VALUES (?)", "d",
+					slot->offset)) {
+			sql_log_err(state->hoard, "Couldn't add offset %d to "
+						"chunks table", slot->offset);
+			return PK_IOERR;
+		}
 		query(NULL, state->hoard, "UPDATE chunks SET tag = ?, "
 					"length = ?, crypto = ?, "
-					"allocated = 1 WHERE offset = ?",
-					"bddd", tag, taglen, len, crypto,
-					offset);
-
+					"allocated = 1, refcount = "
+					"(SELECT count(*) FROM refs "
+					"WHERE tag == ?) WHERE offset = ?",
+					"bddbd", slot->tag,
+					state->parcel->hashlen, slot->length,
+					state->parcel->crypto, slot->tag,
+					state->parcel->hashlen, slot->offset);
 		if (query_constrained(state->hoard)) {
-			if (!query(NULL, state->hoard, "UPDATE chunks "
-						"SET allocated = 0 WHERE "
-						"offset == ?", "d", offset)) {
-				sql_log_err(state->hoard, "Couldn't release "
-							"allocation on offset "
-							"%d", offset);
-				ret=PK_IOERR;
-				goto bad;
-			}
+			/* Someone else hoarded the same chunk elsewhere */
+			hoard_map_release_deferred(state, slot->offset,
+						slot->length);
+			conflict = TRUE;
 		} else if (!query_has_row(state->hoard)) {
 			sql_log_err(state->hoard, "Couldn't update chunks "
-						"table for offset %d", offset);
-			ret=PK_IOERR;
-			goto bad;
+						"table for offset %d",
+						slot->offset);
+			return PK_IOERR;
 		}
 	}
-	query_free(qry);
-	if (!query_ok(state->hoard)) {
-		sql_log_err(state->hoard, "Couldn't query slot cache");
-		return PK_IOERR;
-	}
-
-	if (!query(NULL, state->hoard, "UPDATE chunks SET allocated = 0 WHERE "
-				"offset IN (SELECT offset FROM temp.slots "
-				"WHERE tag ISNULL)", NULL)) {
-		sql_log_err(state->hoard, "Couldn't free unused cache slots");
-		return PK_IOERR;
-	}
-	if (!query(NULL, state->hoard, "DELETE FROM temp.slots", NULL)) {
-		sql_log_err(state->hoard, "Couldn't clear slot cache");
-		return PK_IOERR;
-	}
+	/* Flushed chunks keep their offsets, so our tag index is still
+	   correct unless we lost a race for one of them */
+	if (conflict)
+		hoard_tags_changed(state);
+	else if (g_hash_table_size(state->slot_cache->chunks))
+		hoard_tags_bump(state);
 	return PK_SUCCESS;
+}
+
+static void flush_slot_cache(struct pk_state *state)
+{
+	gboolean retry;
+
+again:
+	if (!begin(state->hoard))
+		return;
+	/* The chunks table must never point to data we haven't written */
+	_write_pending(state);
+	if (_flush_slot_cache(state))
+		goto bad;
+	if (!commit(state->hoard))
+		goto bad;
+	hoard_map_commit(state);
+	g_hash_table_remove_all(state->slot_cache->chunks);
+	return;
 
 bad:
-	query_free(qry);
-	return ret;
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	hoard_map_rollback(state);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
 }
 
-#define TRANSACTION_DECL	static void flush_slot_cache( \
-						struct pk_state *state)
-#define TRANSACTION_CALL	_flush_slot_cache(state)
-TRANSACTION_WRAPPER
-#undef TRANSACTION_DECL
-#undef TRANSACTION_CALL
-
-/* must be within transaction */
-static pk_err_t allocate_slot(struct pk_state *state, int *offset)
+/* Allocate space for a chunk of @length bytes by appending it to our
+   current segment.  If the chunk doesn't fit, the rest of the segment is
+   returned to the map and a new one is reserved.  Must be within
+   transaction. */
+static pk_err_t allocate_slot(struct pk_state *state, unsigned length,
+			int *offset)
 {
-	struct query *qry;
+	struct pk_slot_cache *cache = state->slot_cache;
+	unsigned needed = hoard_block_round(length);
 	pk_err_t ret;
 
-	while (1) {
-		/* First, try to find an unused slot in the slot cache */
-		query(&qry, state->hoard, "SELECT offset FROM temp.slots "
-					"WHERE tag ISNULL LIMIT 1", NULL);
-		if (query_has_row(state->hoard)) {
-			query_row(qry, "d", offset);
-			query_free(qry);
-			break;
-		} else if (!query_ok(state->hoard)) {
-			sql_log_err(state->hoard, "Error finding unused "
-						"hoard cache slot");
-			return PK_IOERR;
-		}
-
-		/* There aren't any, so we have some work to do.  First,
-		   flush the existing slot cache back to the chunks table. */
-		ret=_flush_slot_cache(state);
-		if (ret)
-			return ret;
-
-		/* Now populate the slot cache and try again. */
-		ret=expand_slot_cache(state);
+	if (cache->remaining < needed) {
+		hoard_map_release(state, cache->next, cache->remaining);
+		cache->remaining = 0;
+		ret = hoard_map_reserve(state, needed, SEGMENT_SIZE,
+					&cache->next, &cache->remaining);
 		if (ret)
 			return ret;
 	}
+	*offset = cache->next;
+	cache->next += needed >> 9;
+	cache->remaining -= needed;
 	return PK_SUCCESS;
 }
 
@@ -398,8 +923,9 @@ static pk_err_t _hoard_invalidate_chunk(struct pk_state *state, int offset,
 			const void *tag, unsigned taglen)
 {
 	struct query *qry;
+	int length;
 
-	query(&qry, state->hoard, "SELECT offset FROM chunks WHERE "
+	query(&qry, state->hoard, "SELECT length FROM chunks WHERE "
 				"offset == ? AND tag == ?", "db",
 				offset, tag, taglen);
 	if (query_ok(state->hoard)) {
@@ -409,31 +935,37 @@ static pk_err_t _hoard_invalidate_chunk(struct pk_state *state, int offset,
 		sql_log_err(state->hoard, "Could not query chunk list");
 		return PK_IOERR;
 	}
+	query_row(qry, "d", &length);
 	query_free(qry);
 
-	if (!query(NULL, state->hoard, "UPDATE chunks SET tag = NULL, "
-				"length = 0, crypto = 0, allocated = 0 "
-				"WHERE offset = ?", "d", offset)) {
+	/* Free space is tracked by the hoard map, so we don't need to keep
+	   the row */
+	if (!query(NULL, state->hoard, "DELETE FROM chunks WHERE offset = ?",
+				"d", offset)) {
 		sql_log_err(state->hoard, "Couldn't deallocate hoard chunk "
 					"at offset %d", offset);
 		return PK_IOERR;
 	}
+	hoard_map_release_deferred(state, offset, length);
+	hoard_tags_remove(state, tag);
+	hoard_tags_bump(state);
 	return PK_SUCCESS;
 }
 
-/* Same as _hoard_invalidate_chunk(), but for the slot cache.  We don't
-   need to check that the row being deleted is still valid, since there's no
-   contention for the slot cache. */
+/* Same as _hoard_invalidate_chunk(), but for the slot cache.  The slot
+   isn't recorded in the chunks table, so it can go straight back to the
+   hoard map. */
 static pk_err_t _hoard_invalidate_slot_chunk(struct pk_state *state,
-			int offset)
+			int offset, const void *tag)
 {
-	if (!query(NULL, state->hoard, "UPDATE temp.slots SET tag = NULL, "
-				"length = 0, crypto = 0 WHERE offset = ?",
-				"d", offset)) {
-		sql_log_err(state->hoard, "Couldn't deallocate hoard slot "
-					"at offset %d", offset);
-		return PK_IOERR;
-	}
+	struct cached_slot *slot;
+
+	slot = slot_cache_lookup(state, tag);
+	if (slot == NULL || slot->offset != offset)
+		return PK_SUCCESS;
+	hoard_map_release(state, offset, slot->length);
+	g_hash_table_remove(state->slot_cache->chunks, tag);
+	hoard_tags_remove(state, tag);
 	return PK_SUCCESS;
 }
 
@@ -447,14 +979,19 @@ TRANSACTION_WRAPPER
 #undef TRANSACTION_CALL
 
 #define TRANSACTION_DECL	static void hoard_invalidate_slot_chunk( \
-					struct pk_state *state, int offset)
-#define TRANSACTION_CALL	_hoard_invalidate_slot_chunk(state, offset)
+					struct pk_state *state, int offset, \
+					const void *tag)
+#define TRANSACTION_CALL	_hoard_invalidate_slot_chunk(state, offset, \
+					tag)
 TRANSACTION_WRAPPER
 #undef TRANSACTION_DECL
 #undef TRANSACTION_CALL
 
+/* If @quiet, a tag mismatch is only logged at LOG_CHUNK, since it usually
+   means that compaction or GC moved the chunk while we were reading it */
 pk_err_t _hoard_read_chunk(struct pk_state *state, int offset, int length,
-			int crypto, const void *tag, int taglen, void *buf)
+			int crypto, const void *tag, int taglen, void *buf,
+			gboolean quiet)
 {
 	unsigned hashlen = iu_chunk_crypto_hashlen(crypto);
 	char calctag[hashlen];
@@ -466,9 +1003,11 @@ pk_err_t _hoard_read_chunk(struct pk_state *state, int offset, int length,
 		return PK_BADFORMAT;
 	}
 
-	/* Check chunk offset and length */
-	if (offset < 0 || length <= 0 || (state->parcel != NULL &&
-				(unsigned)length > state->parcel->chunksize)) {
+	/* Check chunk offset and length.  The hoard cache can hold chunks
+	   from parcels with different chunk sizes, so we can only check
+	   against the largest one we support. */
+	if (offset < 0 || length <= 0 ||
+				(unsigned)length > HOARD_MAX_CHUNK_SIZE) {
 		pk_log(LOG_WARNING, "Hoard chunk has unreasonable "
 					"offset/length %d/%d", offset, length);
 		return PK_BADFORMAT;
@@ -486,20 +1025,42 @@ pk_err_t _hoard_read_chunk(struct pk_state *state, int offset, int length,
 	if (!iu_chunk_crypto_digest(crypto, calctag, buf, length))
 		return PK_CALLFAIL;
 	if (memcmp(tag, calctag, hashlen)) {
-		pk_log(LOG_WARNING, "Tag mismatch reading hoard cache at "
-					"offset %d", offset);
-		log_tag_mismatch(tag, calctag, hashlen);
+		if (quiet) {
+			pk_log(LOG_CHUNK, "Tag mismatch reading hoard cache "
+						"at offset %d", offset);
+		} else {
+			pk_log(LOG_WARNING, "Tag mismatch reading hoard cache "
+						"at offset %d", offset);
+			log_tag_mismatch(tag, calctag, hashlen);
+		}
 		return PK_TAGFAIL;
 	}
 	return PK_SUCCESS;
 }
 
+/* Read a chunk for the current parcel into @buf, which is only as large as
+   the parcel's chunk size */
+static pk_err_t read_parcel_chunk(struct pk_state *state, int offset,
+			int length, const void *tag, void *buf, gboolean quiet)
+{
+	if ((unsigned)length > state->parcel->chunksize) {
+		pk_log(LOG_WARNING, "Hoard chunk at offset %d is larger than "
+					"the parcel chunk size", offset);
+		return PK_BADFORMAT;
+	}
+	return _hoard_read_chunk(state, offset, length,
+				state->parcel->crypto, tag,
+				state->parcel->hashlen, buf, quiet);
+}
+
 pk_err_t hoard_get_chunk(struct pk_state *state, const void *tag, void *buf,
 			unsigned *len)
 {
 	struct query *qry;
+	struct cached_slot *slot;
 	int offset;
 	int clen;
+	int bad_offset = -1;	/* where our last read failed */
 	pk_err_t ret;
 	gboolean slot_cache;
 	gboolean retry;
@@ -507,21 +1068,31 @@ pk_err_t hoard_get_chunk(struct pk_state *state, const void *tag, void *buf,
 	if (state->conf->hoard_dir == NULL)
 		return PK_NOTFOUND;
 
+	/* Chunks in the write buffer aren't in the tag index yet */
+	if (!pending_get(state, tag, buf, len))
+		return PK_SUCCESS;
+
+	/* Try the tag index first.  If the indexed copy turns out to be bad,
+	   the SQL path below will find and invalidate it. */
+	hoard_tags_refresh(state);
+	ret = hoard_tags_lookup(state, tag, &offset, &clen);
+	if (ret == PK_NOTFOUND)
+		return PK_NOTFOUND;
+	if (ret == PK_SUCCESS && !read_parcel_chunk(state, offset, clen, tag,
+				buf, TRUE)) {
+		*len=clen;
+		return PK_SUCCESS;
+	}
+
 again:
 	if (!begin(state->hoard))
 		return PK_IOERR;
 
-	/* First query the slot cache */
-	if (!query(&qry, state->hoard, "SELECT offset, length FROM temp.slots "
-				"WHERE tag == ?", "b", tag,
-				state->parcel->hashlen)) {
-		sql_log_err(state->hoard, "Couldn't query slot cache");
-		ret=PK_IOERR;
-		goto bad;
-	}
-	if (query_has_row(state->hoard)) {
-		query_row(qry, "dd", &offset, &clen);
-		query_free(qry);
+	/* First check the slot cache */
+	slot = slot_cache_lookup(state, tag);
+	if (slot != NULL) {
+		offset = slot->offset;
+		clen = slot->length;
 		slot_cache = TRUE;
 	} else {
 		/* Now query the hoard cache */
@@ -550,22 +1121,29 @@ again:
 		goto bad;
 	}
 
-	if (_hoard_read_chunk(state, offset, clen, state->parcel->crypto,
-				tag, state->parcel->hashlen, buf)) {
-		/* Read failures can occur if the chunk has been moved due
-		   to GC compaction, so we don't want to blindly invalidate
-		   the slot in case some other data has been stored there
-		   in the interim.  Therefore, _hoard_invalidate_chunk()
+	if (read_parcel_chunk(state, offset, clen, tag, buf,
+				!slot_cache && offset != bad_offset)) {
+		/* Read failures are expected if compaction moved the chunk
+		   or GC deleted it while we were reading, so we don't want
+		   to blindly invalidate the slot in case some other data
+		   has been stored there in the interim.  Look the chunk up
+		   again first, and only treat it as bad if it fails twice
+		   at the same offset.  Even then, _hoard_invalidate_chunk()
 		   checks that the tag/index pair is still present in the
 		   chunks table before invalidating the slot.  If we're
 		   working from the slot cache, this race does not apply. */
+		if (!slot_cache && offset != bad_offset) {
+			pk_log(LOG_CHUNK, "Hoard chunk at offset %d may have "
+						"moved; retrying", offset);
+			bad_offset = offset;
+			goto again;
+		}
 		pk_log(LOG_ERROR, "Invalidating chunk and retrying");
 		if (slot_cache)
-			hoard_invalidate_slot_chunk(state, offset);
+			hoard_invalidate_slot_chunk(state, offset, tag);
 		else
 			hoard_invalidate_chunk(state, offset, tag,
 						state->parcel->hashlen);
-		/* GC could have moved the chunk, try again */
 		goto again;
 	}
 	*len=clen;
@@ -581,59 +1159,88 @@ bad:
 	return ret;
 }
 
-/* Writing out only the data bytes in @buf causes a read-modify-write
-   in the kernel's page cache if the length is not a multiple of 512
-   (or 4096?), reducing throughput.  We could pad out to the next 4096-byte
-   boundary, but instead we pad to the entire length of the slot, based on
-   two assumptions: the extra I/O is cheap, and keeping the hoard cache
-   from becoming sparse is useful to avoid filesystem fragmentation when
-   chunks are overwritten by larger chunks. */
+/* Returns the space occupied by a chunk of @length bytes */
+unsigned hoard_block_round(unsigned length)
+{
+	if (length == 0)
+		return HOARD_BLOCK_SIZE;
+	return (length + HOARD_BLOCK_SIZE - 1) & ~(HOARD_BLOCK_SIZE - 1);
+}
+
+/* Chunks are packed into the hoard file at block alignment, so a chunk
+   only takes up as much space as its compressed data.  Writing out only
+   the data bytes in @buf causes a read-modify-write in the kernel's page
+   cache if the length is not a multiple of the page size, reducing
+   throughput, so we pad to the end of the last block. */
 pk_err_t _hoard_write_chunk(struct pk_state *state, unsigned offset,
 			unsigned length, const void *buf)
 {
-	unsigned chunksize = 131072;  /* XXX */
-	char data[chunksize];
+	pk_err_t ret;
 
-	if (length > chunksize)
+	if (length > HOARD_MAX_CHUNK_SIZE)
 		return PK_INVALID;
-	memcpy(data, buf, length);
-	memset(data + length, 0, chunksize - length);
-	if (pwrite(state->hoard_fd, data, chunksize, ((off_t)offset) << 9) !=
-				(int) chunksize) {
+	ret = pwrite_padded(state->hoard_fd, buf, length,
+				hoard_block_round(length),
+				((off_t)offset) << 9);
+	if (ret)
 		pk_log(LOG_ERROR, "Couldn't write hoard cache at offset %d",
 					offset);
-		return PK_IOERR;
-	}
-	return PK_SUCCESS;
+	return ret;
 }
 
+/* New chunks are collected in a write buffer and written to consecutive
+   slots in batches, so that fetching many chunks doesn't cost a system call
+   and a transaction commit per chunk.  Their slots are later recorded in
+   the chunks table in larger batches by flush_slot_cache(). */
 pk_err_t hoard_put_chunk(struct pk_state *state, const void *tag,
 			const void *buf, unsigned len)
 {
+	struct pk_slot_cache *cache;
 	pk_err_t ret;
 	int offset;
+	gboolean flush;
 	gboolean retry;
 
 	if (state->conf->hoard_dir == NULL)
 		return PK_SUCCESS;
+	if (len > state->parcel->chunksize)
+		return PK_INVALID;
+	cache = state->slot_cache;
 
+	hoard_tags_refresh(state);
 again:
 	if (!begin(state->hoard))
 		return PK_IOERR;
 
+	/* See if the tag is already waiting to be written */
+	if (g_hash_table_lookup(cache->pending, tag) != NULL) {
+		if (!commit(state->hoard)) {
+			ret=PK_IOERR;
+			goto bad;
+		}
+		return PK_SUCCESS;
+	}
+
+	/* Our transaction is deferred, so another process can change the
+	   chunks table after the index has answered.  Trust the index only
+	   for hits, where the worst case is that we don't hoard a chunk
+	   which was deleted in the meantime.  Misses are confirmed in SQL
+	   below, which is cheap next to writing out the chunk. */
+	if (hoard_tags_lookup(state, tag, NULL, NULL) == PK_SUCCESS) {
+		if (!commit(state->hoard)) {
+			ret=PK_IOERR;
+			goto bad;
+		}
+		return PK_SUCCESS;
+	}
+
 	/* See if the tag is already in the slot cache */
-	query(NULL, state->hoard, "SELECT tag FROM temp.slots WHERE tag == ?",
-				"b", tag, state->parcel->hashlen);
-	if (query_has_row(state->hoard)) {
+	if (slot_cache_lookup(state, tag) != NULL) {
 		if (!commit(state->hoard)) {
 			ret=PK_IOERR;
 			goto bad;
 		}
 		return PK_SUCCESS;
-	} else if (!query_ok(state->hoard)) {
-		sql_log_err(state->hoard, "Couldn't look up tag in slot cache");
-		ret=PK_SQLERR;
-		goto bad;
 	}
 
 	/* See if the tag is already in the hoard cache */
@@ -652,30 +1259,27 @@ again:
 		goto bad;
 	}
 
-	ret=allocate_slot(state, &offset);
+	ret=allocate_slot(state, len, &offset);
 	if (ret)
 		goto bad;
-	if (!query(NULL, state->hoard, "UPDATE temp.slots SET tag = ?, "
-				"length = ?, crypto = ? WHERE offset = ?",
-				"bddd", tag, state->parcel->hashlen, len,
-				state->parcel->crypto, offset)) {
-		sql_log_err(state->hoard, "Couldn't add metadata for hoard "
-					"cache chunk");
-		ret=PK_IOERR;
-		goto bad;
-	}
-	if (_hoard_write_chunk(state, offset, len, buf)) {
-		ret=PK_IOERR;
-		goto bad;
-	}
+	pending_add(state, tag, offset, buf, len);
+	if (cache->pending_order->len >= WRITE_BATCH_CHUNKS ||
+				cache->pending_bytes >= WRITE_BATCH_BYTES)
+		_write_pending(state);
+	/* Record the slot cache in the chunks table in batches */
+	flush = g_hash_table_size(cache->chunks) >= SLOT_CACHE_CHUNKS;
 	if (!commit(state->hoard)) {
 		pk_log(LOG_ERROR, "Couldn't commit hoard cache chunk");
 		ret=PK_IOERR;
 		goto bad;
 	}
+	if (flush)
+		flush_slot_cache(state);
 	return PK_SUCCESS;
 
 bad:
+	/* If the chunk made it into the write buffer, it stays there; the
+	   buffer and slot cache aren't affected by the rollback */
 	retry = query_busy(state->hoard);
 	rollback(state->hoard);
 	if (retry) {
@@ -685,53 +1289,386 @@ bad:
 	return ret;
 }
 
-/* We use state->db rather than state->hoard in this function, since we need to
-   compare to the previous or current keyring */
-pk_err_t hoard_sync_refs(struct pk_state *state, gboolean new_chunks)
+/* Check whether the chunk with the given @tag is present in the hoard cache,
+   including our slot cache.  Uses the hoard DB connection so that state->db
+   doesn't acquire the hoard DB lock.  Errors are reported as "not present",
+   since the caller will then just do some unnecessary work. */
+gboolean hoard_has_chunk(struct pk_state *state, const void *tag)
 {
+	gboolean ret = FALSE;
 	gboolean retry;
 
 	if (state->conf->hoard_dir == NULL)
-		return PK_SUCCESS;
+		return FALSE;
+
+	if (pending_has(state, tag))
+		return TRUE;
+	hoard_tags_refresh(state);
+	switch (hoard_tags_lookup(state, tag, NULL, NULL)) {
+	case PK_SUCCESS:
+		return TRUE;
+	case PK_NOTFOUND:
+		return FALSE;
+	default:
+		break;
+	}
 
 again:
-	if (!begin_immediate(state->db))
+	if (!begin(state->hoard))
+		return FALSE;
+	if (slot_cache_lookup(state, tag) != NULL) {
+		rollback(state->hoard);
+		return TRUE;
+	}
+	query(NULL, state->hoard, "SELECT tag FROM chunks WHERE tag == ?",
+				"b", tag, state->parcel->hashlen);
+	if (query_has_row(state->hoard)) {
+		ret = TRUE;
+	} else if (!query_ok(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't query hoard cache index");
+		retry = query_busy(state->hoard);
+		rollback(state->hoard);
+		if (retry) {
+			query_backoff(state->hoard);
+			goto again;
+		}
+		return FALSE;
+	}
+	rollback(state->hoard);
+	return ret;
+}
+
+/* Must be within transaction.  Adds refs for the new tags recorded in
+   pending_refs.  Per-row lookups keep this proportional to the number of
+   changed chunks. */
+static pk_err_t _add_pending_refs(struct pk_state *state)
+{
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET refcount = "
+				"refcount + 1 WHERE tag IN (SELECT new_tag "
+				"FROM hoard.pending_refs AS pending WHERE "
+				"pending.parcel == ? AND NOT EXISTS "
+				"(SELECT 1 FROM hoard.refs AS refs WHERE "
+				"refs.parcel == ? AND "
+				"refs.tag == pending.new_tag))", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't add hoard chunk references");
 		return PK_IOERR;
-	if (new_chunks)
-		query(NULL, state->db, "CREATE TEMP TABLE newrefs AS "
-					"SELECT DISTINCT tag FROM keys", NULL);
-	else
-		query(NULL, state->db, "CREATE TEMP TABLE newrefs AS "
-					"SELECT DISTINCT tag FROM prev.keys",
-					NULL);
-	if (!query_ok(state->db)) {
+	}
+	if (!query(NULL, state->db, "INSERT OR IGNORE INTO hoard.refs "
+				"(parcel, tag) SELECT ?, new_tag FROM "
+				"hoard.pending_refs WHERE parcel == ?", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't insert new hoard refs");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* Must be within transaction.  Tag the current keyring with a new random
+   generation, and record it as the parcel's last uploaded keyring, so that
+   the next refresh can tell whether its previous keyring is the one we
+   uploaded without comparing every chunk. */
+static pk_err_t _set_keyring_generation(struct pk_state *state)
+{
+	int generation = g_random_int_range(1, G_MAXINT);
+
+	if (!query(NULL, state->db, "CREATE TABLE IF NOT EXISTS "
+				"main.hoard_generation "
+				"(generation INTEGER NOT NULL)", NULL) ||
+				!query(NULL, state->db, "DELETE FROM "
+				"main.hoard_generation", NULL) ||
+				!query(NULL, state->db, "INSERT INTO "
+				"main.hoard_generation (generation) "
+				"VALUES (?)", "d", generation)) {
+		sql_log_err(state->db, "Couldn't set keyring generation");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "UPDATE hoard.parcels SET "
+				"keyring_generation = ? WHERE parcel == ?",
+				"dd", generation, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't record keyring generation");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* Must be within transaction.  Set *@match if the previous keyring is the
+   last one we uploaded for this parcel. */
+static pk_err_t _check_keyring_generation(struct pk_state *state,
+			gboolean *match)
+{
+	struct query *qry;
+
+	*match = FALSE;
+	/* Keyrings we haven't uploaded don't have the table */
+	query(&qry, state->db, "SELECT 1 FROM prev.sqlite_master WHERE "
+				"type == 'table' AND "
+				"name == 'hoard_generation'", NULL);
+	if (!query_has_row(state->db)) {
+		if (!query_ok(state->db)) {
+			sql_log_err(state->db, "Couldn't query keyring "
+						"schema");
+			return PK_IOERR;
+		}
+		return PK_SUCCESS;
+	}
+	query_free(qry);
+	query(&qry, state->db, "SELECT 1 FROM prev.hoard_generation AS "
+				"keyring JOIN hoard.parcels AS parcels ON "
+				"keyring.generation == "
+				"parcels.keyring_generation "
+				"WHERE parcels.parcel == ?", "d",
+				state->hoard_ident);
+	if (query_has_row(state->db)) {
+		query_free(qry);
+		*match = TRUE;
+	} else if (!query_ok(state->db)) {
+		sql_log_err(state->db, "Couldn't check keyring generation");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* Must be within transaction.  At upload time, the parcel's refs already
+   cover the previous keyring, so we only need to reference the new tags
+   of the chunks which have been modified.  We remember the modified
+   chunks so that the refresh following the commit can drop their old
+   tags without rescanning the keyring.  If we've uploaded before without
+   a refresh in between, pending_refs already holds the chunks from that
+   upload, and the tags it referenced which are no longer in either
+   keyring must be dropped now, since no refresh will see them. */
+static pk_err_t _sync_refs_upload(struct pk_state *state)
+{
+	pk_err_t ret;
+
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET refcount = "
+				"refcount - 1 WHERE tag IN (SELECT new_tag "
+				"FROM hoard.pending_refs AS pending WHERE "
+				"pending.parcel == ? AND NOT EXISTS "
+				"(SELECT 1 FROM main.keys AS keys WHERE "
+				"keys.tag == pending.new_tag) AND NOT EXISTS "
+				"(SELECT 1 FROM prev.keys AS keys WHERE "
+				"keys.tag == pending.new_tag) AND EXISTS "
+				"(SELECT 1 FROM hoard.refs AS refs WHERE "
+				"refs.parcel == ? AND "
+				"refs.tag == pending.new_tag))", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't release superseded hoard "
+					"chunk references");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "DELETE FROM hoard.refs WHERE "
+				"parcel == ? AND tag IN (SELECT new_tag FROM "
+				"hoard.pending_refs AS pending WHERE "
+				"pending.parcel == ? AND NOT EXISTS "
+				"(SELECT 1 FROM main.keys AS keys WHERE "
+				"keys.tag == pending.new_tag) AND NOT EXISTS "
+				"(SELECT 1 FROM prev.keys AS keys WHERE "
+				"keys.tag == pending.new_tag))", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't drop superseded hoard refs");
+		return PK_IOERR;
+	}
+	ret = _cache_find_modified(state);
+	if (ret)
+		return ret;
+	/* Chunks which have been changed back since the last upload are
+	   no longer pending */
+	if (!query(NULL, state->db, "DELETE FROM hoard.pending_refs "
+				"WHERE parcel == ? AND chunk NOT IN "
+				"(SELECT chunk FROM temp.modified_chunks)", "d",
+				state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't clear pending hoard refs");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "INSERT OR REPLACE INTO "
+				"hoard.pending_refs "
+				"(parcel, chunk, old_tag, new_tag) "
+				"SELECT ?, chunk, old_tag, new_tag "
+				"FROM temp.modified_chunks", "d",
+				state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't record modified chunks");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "DROP TABLE temp.modified_chunks",
+				NULL)) {
+		sql_log_err(state->db, "Couldn't drop temporary table");
+		return PK_IOERR;
+	}
+	ret = _set_keyring_generation(state);
+	if (ret)
+		return ret;
+	return _add_pending_refs(state);
+}
+
+/* Must be within transaction.  If prev.keys is the keyring we recorded at
+   upload time, apply the recorded changes and set *@applied.  Otherwise
+   the caller must fall back to a full sync.  Only the recorded chunks are
+   looked up in the keyring. */
+static pk_err_t _sync_refs_pending(struct pk_state *state,
+			gboolean *applied)
+{
+	struct query *qry;
+	int pending;
+	int matched;
+	gboolean match;
+	pk_err_t ret;
+
+	*applied = FALSE;
+	query(&qry, state->db, "SELECT count(*) FROM hoard.pending_refs "
+				"WHERE parcel == ?", "d", state->hoard_ident);
+	if (!query_has_row(state->db)) {
+		sql_log_err(state->db, "Couldn't count pending hoard refs");
+		return PK_IOERR;
+	}
+	query_row(qry, "d", &pending);
+	query_free(qry);
+	if (pending == 0)
+		return PK_SUCCESS;
+	query(&qry, state->db, "SELECT count(*) FROM hoard.pending_refs "
+				"AS pending JOIN prev.keys AS keys ON "
+				"keys.chunk == pending.chunk WHERE "
+				"pending.parcel == ? AND "
+				"keys.tag == pending.new_tag", "d",
+				state->hoard_ident);
+	if (!query_has_row(state->db)) {
+		sql_log_err(state->db, "Couldn't compare pending hoard refs");
+		return PK_IOERR;
+	}
+	query_row(qry, "d", &matched);
+	query_free(qry);
+	if (matched != pending) {
+		pk_log(LOG_INFO, "Keyring doesn't match last upload; "
+					"resyncing hoard refs");
+		return PK_SUCCESS;
+	}
+	/* Chunks we didn't record must not have changed either, which
+	   holds if this is the keyring we uploaded */
+	ret = _check_keyring_generation(state, &match);
+	if (ret)
+		return ret;
+	if (!match) {
+		pk_log(LOG_INFO, "Keyring doesn't match last upload; "
+					"resyncing hoard refs");
+		return PK_SUCCESS;
+	}
+
+	ret = _add_pending_refs(state);
+	if (ret)
+		return ret;
+	/* Old tags may still be in use by other chunks */
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET refcount = "
+				"refcount - 1 WHERE tag IN (SELECT old_tag "
+				"FROM hoard.pending_refs AS pending WHERE "
+				"pending.parcel == ? AND NOT EXISTS "
+				"(SELECT 1 FROM prev.keys AS keys WHERE "
+				"keys.tag == pending.old_tag) AND EXISTS "
+				"(SELECT 1 FROM hoard.refs AS refs WHERE "
+				"refs.parcel == ? AND "
+				"refs.tag == pending.old_tag))", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't release hoard chunk "
+					"references");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "DELETE FROM hoard.refs WHERE "
+				"parcel == ? AND tag IN (SELECT old_tag FROM "
+				"hoard.pending_refs AS pending WHERE "
+				"pending.parcel == ? AND NOT EXISTS "
+				"(SELECT 1 FROM prev.keys AS keys WHERE "
+				"keys.tag == pending.old_tag))", "dd",
+				state->hoard_ident, state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't garbage-collect hoard refs");
+		return PK_IOERR;
+	}
+	*applied = TRUE;
+	return PK_SUCCESS;
+}
+
+/* Must be within transaction.  Makes the parcel's refs match prev.keys
+   by diffing the entire keyring against them. */
+static pk_err_t _sync_refs_full(struct pk_state *state)
+{
+	if (!query(NULL, state->db, "CREATE TEMP TABLE newrefs AS "
+				"SELECT DISTINCT tag FROM prev.keys", NULL)) {
 		sql_log_err(state->db, "Couldn't generate tag list");
-		goto bad;
+		return PK_IOERR;
 	}
 	if (!query(NULL, state->db, "CREATE INDEX temp.newrefs_tags ON "
 				"newrefs (tag)", NULL)) {
 		sql_log_err(state->db, "Couldn't create tag index");
-		goto bad;
+		return PK_IOERR;
 	}
-	if (!new_chunks) {
-		if (!query(NULL, state->db, "DELETE FROM hoard.refs WHERE "
-					"parcel == ? AND tag NOT IN "
-					"(SELECT tag FROM temp.newrefs)",
-					"d", state->hoard_ident)) {
-			sql_log_err(state->db, "Couldn't garbage-collect "
-						"hoard refs");
-			goto bad;
-		}
+	/* Keep the chunk refcounts in step with the refs we add and
+	   remove */
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET "
+				"refcount = refcount - 1 WHERE tag IN "
+				"(SELECT tag FROM hoard.refs WHERE "
+				"parcel == ? AND tag NOT IN "
+				"(SELECT tag FROM temp.newrefs))",
+				"d", state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't release hoard chunk "
+					"references");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "DELETE FROM hoard.refs WHERE "
+				"parcel == ? AND tag NOT IN "
+				"(SELECT tag FROM temp.newrefs)",
+				"d", state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't garbage-collect hoard refs");
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET refcount = "
+				"refcount + 1 WHERE tag IN (SELECT tag FROM "
+				"temp.newrefs WHERE tag NOT IN (SELECT tag "
+				"FROM hoard.refs WHERE parcel == ?))",
+				"d", state->hoard_ident)) {
+		sql_log_err(state->db, "Couldn't add hoard chunk references");
+		return PK_IOERR;
 	}
 	if (!query(NULL, state->db, "INSERT OR IGNORE INTO hoard.refs "
 				"(parcel, tag) SELECT ?, tag FROM temp.newrefs",
 				"d", state->hoard_ident)) {
 		sql_log_err(state->db, "Couldn't insert new hoard refs");
-		goto bad;
+		return PK_IOERR;
 	}
 	if (!query(NULL, state->db, "DROP TABLE temp.newrefs", NULL)) {
 		sql_log_err(state->db, "Couldn't drop temporary table");
-		goto bad;
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+/* We use state->db rather than state->hoard in this function, since we need to
+   compare to the previous or current keyring.  If @new_chunks is true, we
+   add refs for the chunks modified in the current keyring; otherwise we
+   make the refs match the previous keyring. */
+pk_err_t hoard_sync_refs(struct pk_state *state, gboolean new_chunks)
+{
+	gboolean applied;
+	gboolean retry;
+
+	if (state->conf->hoard_dir == NULL)
+		return PK_SUCCESS;
+
+again:
+	if (!begin_immediate(state->db))
+		return PK_IOERR;
+	if (new_chunks) {
+		if (_sync_refs_upload(state))
+			goto bad;
+	} else {
+		if (_sync_refs_pending(state, &applied))
+			goto bad;
+		if (!applied && _sync_refs_full(state))
+			goto bad;
+		if (!query(NULL, state->db, "DELETE FROM hoard.pending_refs "
+					"WHERE parcel == ?", "d",
+					state->hoard_ident)) {
+			sql_log_err(state->db, "Couldn't clear pending "
+						"hoard refs");
+			goto bad;
+		}
 	}
 	if (!commit(state->db))
 		goto bad;
@@ -834,9 +1771,6 @@ again:
 					"%d)", ver, HOARD_INDEX_VERSION);
 		ret=PK_BADFORMAT;
 	}
-	if (ret)
-		goto bad_rollback;
-	ret=create_slot_cache(state);
 	if (ret)
 		goto bad_rollback;
 	if (!commit(state->hoard)) {
@@ -865,14 +1799,59 @@ bad:
 	return ret;
 }
 
-/* Must be in hoard transaction */
+struct gc_chunk {
+	int offset;
+	int length;
+};
+
+/* Must be in hoard transaction.  Chunks carry a count of their refs, so
+   finding the unreferenced ones is an index lookup whose cost is
+   proportional to the amount of garbage rather than to the size of the
+   hoard cache.  We need the extents of the collected chunks in order to
+   release them in the hoard map, so we find them first and then
+   deallocate them one at a time. */
 static pk_err_t _hoard_gc(struct pk_state *state)
 {
-	return cleanup_action(state->hoard, "UPDATE chunks SET tag = NULL, "
-				"length = 0, crypto = 0, allocated = 0 "
-				"WHERE tag NOTNULL AND tag NOT IN "
-				"(SELECT tag FROM refs)",
-				LOG_INFO, "unreferenced chunks");
+	struct query *qry;
+	GArray *offsets;
+	struct gc_chunk chunk;
+	unsigned i;
+	pk_err_t ret = PK_SUCCESS;
+
+	offsets = g_array_new(FALSE, FALSE, sizeof(struct gc_chunk));
+	for (query(&qry, state->hoard, "SELECT offset, length FROM chunks "
+				"WHERE refcount <= 0 AND tag NOTNULL", NULL);
+				query_has_row(state->hoard); query_next(qry)) {
+		query_row(qry, "dd", &chunk.offset, &chunk.length);
+		g_array_append_val(offsets, chunk);
+	}
+	query_free(qry);
+	if (!query_ok(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't find unreferenced chunks");
+		ret = PK_IOERR;
+		goto out;
+	}
+	for (i = 0; i < offsets->len; i++) {
+		chunk = g_array_index(offsets, struct gc_chunk, i);
+		if (!query(NULL, state->hoard, "DELETE FROM chunks "
+					"WHERE offset = ?", "d",
+					chunk.offset)) {
+			sql_log_err(state->hoard, "Couldn't deallocate hoard "
+						"chunk at offset %d",
+						chunk.offset);
+			ret = PK_IOERR;
+			goto out;
+		}
+		hoard_map_release_deferred(state, chunk.offset, chunk.length);
+	}
+	if (offsets->len) {
+		hoard_tags_changed(state);
+		pk_log(LOG_INFO, "Cleaned %u unreferenced chunks",
+					offsets->len);
+	}
+out:
+	g_array_free(offsets, TRUE);
+	return ret;
 }
 
 pk_err_t hoard_gc(struct pk_state *state)
@@ -886,11 +1865,13 @@ again:
 		goto bad;
 	if (!commit(state->hoard))
 		goto bad;
+	hoard_map_commit(state);
 	return PK_SUCCESS;
 
 bad:
 	retry = query_busy(state->hoard);
 	rollback(state->hoard);
+	hoard_map_rollback(state);
 	if (retry) {
 		query_backoff(state->hoard);
 		goto again;
@@ -963,28 +1944,37 @@ again:
 		pk_log(LOG_INFO, "Cleaned %d dangling parcel records",
 					changes);
 
-	ret=cleanup_action(state->hoard, "UPDATE chunks SET allocated = 0 "
-				"WHERE allocated == 1 AND tag ISNULL",
-				LOG_INFO, "orphaned cache slots");
+	/* Chunks without refs are only garbage if no one else is using the
+	   hoard cache: another process may have recorded chunks whose refs
+	   it hasn't added yet */
+	ret = _hoard_gc(state);
 	if (ret)
 		goto bad;
 
-	/* This query is slow when there are many refs, so perform it only
-	   at refresh time and with 1/8 probability */
-	if ((state->conf->flags & WANT_GC) && !g_random_int_range(0, 7)) {
-		pk_log(LOG_INFO, "Garbage-collecting hoard cache");
-		ret = _hoard_gc(state);
-		if (ret)
-			goto bad;
-	}
+	/* Free space is tracked by the hoard map, so rows without a chunk
+	   shouldn't exist; remove any left by older versions */
+	ret=cleanup_action(state->hoard, "DELETE FROM chunks WHERE "
+				"tag ISNULL", LOG_INFO, "empty cache slots");
+	if (ret)
+		goto bad;
+
+	/* No one else is using the hoard cache, so we can reclaim slots
+	   reserved by processes which exited without recording them.  The
+	   slower cleanup modes rebuild the map regardless. */
+	ret = _hoard_map_rebuild(state, !!(state->conf->flags & WANT_GC));
+	if (ret)
+		goto bad;
 
 	if (!commit(state->hoard)) {
 		ret=PK_IOERR;
 		goto bad;
 	}
+	/* If the map wasn't rebuilt, it still needs the deallocations
+	   made by _hoard_gc() */
+	hoard_map_commit(state);
 
-	/* Vacuum the hoard cache only during refresh and with 1/8
-	   probability */
+	/* Vacuum the hoard cache only during refresh and checkhoard, and
+	   with 1/8 probability */
 	if ((state->conf->flags & WANT_GC) && !g_random_int_range(0, 7)) {
 		pk_log(LOG_INFO, "Vacuuming hoard cache");
 		if (!vacuum(state->hoard)) {
@@ -1000,6 +1990,7 @@ out:
 bad:
 	retry = query_busy(state->hoard);
 	rollback(state->hoard);
+	hoard_map_rollback(state);
 	if (retry) {
 		query_backoff(state->hoard);
 		goto again;
@@ -1007,15 +1998,73 @@ bad:
 	goto out;
 }
 
+/* Return the current parcel's hoard statistics.  If @totals is non-NULL,
+   also return the counts for the whole hoard cache. */
+pk_err_t hoard_get_stats(struct pk_state *state,
+			struct pk_hoard_stats *parcel,
+			struct pk_hoard_stats *totals)
+{
+	struct query *qry;
+	gboolean retry;
+
+again:
+	if (!begin(state->hoard))
+		return PK_IOERR;
+	query(&qry, state->hoard, "SELECT referenced, present, "
+				"present_bytes, uniq, unique_bytes "
+				"FROM parcels WHERE parcel == ?", "d",
+				state->hoard_ident);
+	if (!query_has_row(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't query parcel statistics");
+		goto bad;
+	}
+	query_row(qry, "ddDdD", &parcel->referenced, &parcel->present,
+				&parcel->present_bytes, &parcel->unique,
+				&parcel->unique_bytes);
+	query_free(qry);
+	if (totals != NULL) {
+		memset(totals, 0, sizeof(*totals));
+		query(&qry, state->hoard, "SELECT chunks, bytes FROM totals",
+					NULL);
+		if (!query_has_row(state->hoard)) {
+			sql_log_err(state->hoard, "Couldn't query hoard "
+						"totals");
+			goto bad;
+		}
+		query_row(qry, "dD", &totals->present,
+					&totals->present_bytes);
+		query_free(qry);
+	}
+	rollback(state->hoard);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
+	return PK_IOERR;
+}
+
+#define TRANSACTION_DECL	void hoard_recount_stats(struct pk_state *state)
+#define TRANSACTION_CALL	_recount_stats(state)
+TRANSACTION_WRAPPER
+#undef TRANSACTION_DECL
+#undef TRANSACTION_CALL
+
 pk_err_t hoard_init(struct pk_state *state)
 {
 	pk_err_t ret;
 
 	if (state->conf->hoard_dir == NULL)
 		return PK_INVALID;
-	if (state->parcel != NULL && state->parcel->chunksize != 131072) {
-		pk_log(LOG_ERROR, "Hoard cache non-functional for chunk "
-					"sizes != 128 KB");
+	if (state->parcel != NULL && state->parcel->chunksize >
+				HOARD_MAX_CHUNK_SIZE) {
+		pk_log(LOG_ERROR, "Hoard cache does not support chunk "
+					"sizes > %d KB",
+					HOARD_MAX_CHUNK_SIZE >> 10);
 		return PK_INVALID;
 	}
 	if (!g_file_test(state->conf->hoard_dir, G_FILE_TEST_IS_DIR) &&
@@ -1041,13 +2090,27 @@ pk_err_t hoard_init(struct pk_state *state)
 	if (ret)
 		goto bad;
 
+	ret=hoard_tags_init(state);
+	if (ret)
+		goto bad_close;
+
+	ret=hoard_map_init(state);
+	if (ret)
+		goto bad_tags;
+	slot_cache_init(state);
+
 	if (state->conf->parcel_dir != NULL) {
 		ret=get_parcel_ident(state);
 		if (ret)
-			goto bad_close;
+			goto bad_map;
 	}
 	return PK_SUCCESS;
 
+bad_map:
+	slot_cache_free(state);
+	hoard_map_shutdown(state);
+bad_tags:
+	hoard_tags_shutdown(state);
 bad_close:
 	sql_conn_close(state->hoard);
 bad:
@@ -1057,8 +2120,13 @@ bad:
 
 void hoard_shutdown(struct pk_state *state)
 {
+	/* The tag index rebuild thread reads the slot cache */
+	hoard_tags_stop(state);
 	flush_slot_cache(state);
+	slot_cache_free(state);
 	hoard_try_cleanup(state);
+	hoard_map_shutdown(state);
+	hoard_tags_shutdown(state);
 	sql_conn_close(state->hoard);
 	close(state->hoard_fd);
 }
@@ -0,0 +1,443 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Hoard cache compaction.  Chunks are moved from the end of the hoard file
+   into the lowest free space, and the file is then truncated after the
+   last block in use.  This is done offline by checkhoard --compact, and
+   online by a background thread in run and hoard modes.
+
+   A batch of chunks is copied outside of any transaction: we reserve the
+   destinations in the hoard map, read ahead the sources, and copy them.
+   We then swap the chunks table entries in one short transaction,
+   skipping any chunk which was deallocated or moved in the meantime.
+   Readers which looked up a chunk before the swap may read its old
+   location after the space has been reused; they will see a tag mismatch
+   and retry, just as for a chunk deallocated by GC. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "defs.h"
+
+#define COMPACT_BATCH 64
+/* Seconds between checks for wasted space */
+#define COMPACT_INTERVAL 60
+/* Online compaction starts when at least this many bytes, and at least
+   1/COMPACT_WASTE_RATIO of the hoard file, are free */
+#define COMPACT_MIN_WASTE (64 << 20)
+#define COMPACT_WASTE_RATIO 4
+
+/* From linux/ioprio.h, which is not exported to userspace */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+struct pk_hoard_compactor {
+	GThread *thread;
+	GMutex *lock;
+	GCond *cond;
+	gboolean stopping;
+};
+
+struct compact_move {
+	void *tag;
+	int taglen;
+	int from;
+	int to;
+	int length;
+	int crypto;
+	unsigned reserved;
+	gboolean copied;
+	gboolean swapped;
+};
+
+/* Find the last COMPACT_BATCH chunks in the hoard file */
+static pk_err_t get_candidates(struct pk_state *state, GArray *moves)
+{
+	struct query *qry;
+	struct compact_move mv = {0};
+	void *tag;
+	unsigned i;
+	gboolean retry;
+
+again:
+	if (!begin(state->hoard))
+		return PK_IOERR;
+	for (query(&qry, state->hoard, "SELECT tag, offset, length, crypto "
+				"FROM chunks WHERE tag NOTNULL ORDER BY "
+				"offset DESC LIMIT " G_STRINGIFY(COMPACT_BATCH),
+				NULL); query_has_row(state->hoard);
+				query_next(qry)) {
+		query_row(qry, "bddd", &tag, &mv.taglen, &mv.from,
+					&mv.length, &mv.crypto);
+		mv.tag = g_memdup(tag, mv.taglen);
+		g_array_append_val(moves, mv);
+	}
+	query_free(qry);
+	if (!query_ok(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't query chunks table");
+		goto bad;
+	}
+	rollback(state->hoard);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	for (i = 0; i < moves->len; i++)
+		g_free(g_array_index(moves, struct compact_move, i).tag);
+	g_array_set_size(moves, 0);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
+	return PK_IOERR;
+}
+
+/* Must be within hoard transaction */
+static pk_err_t swap_chunk(struct pk_state *state, struct compact_move *mv)
+{
+	struct query *qry;
+	int changes;
+
+	/* Make sure the chunk is still where we found it */
+	if (!query(&qry, state->hoard, "DELETE FROM chunks WHERE "
+				"offset == ? AND tag == ?", "db", mv->from,
+				mv->tag, mv->taglen)) {
+		sql_log_err(state->hoard, "Couldn't deallocate hoard chunk "
+					"at offset %d", mv->from);
+		return PK_IOERR;
+	}
+	query_row(qry, "d", &changes);
+	query_free(qry);
+	if (changes == 0)
+		return PK_SUCCESS;
+	hoard_map_release_deferred(state, mv->from, mv->length);
+	/* The destination may have an empty row left over from an older
+	   chunk */
+	if (!query(NULL, state->hoard, "INSERT OR IGNORE INTO chunks "
+				"(offset) VALUES (?)", "d", mv->to)) {
+		sql_log_err(state->hoard, "Couldn't add offset %d to chunks "
+					"table", mv->to);
+		return PK_IOERR;
+	}
+	if (!query(NULL, state->hoard, "UPDATE chunks SET tag = ?, "
+				"length = ?, crypto = ?, allocated = 1, "
+				"refcount = (SELECT count(*) FROM refs "
+				"WHERE tag == ?) WHERE offset = ?", "bddbd",
+				mv->tag, mv->taglen, mv->length, mv->crypto,
+				mv->tag, mv->taglen, mv->to)) {
+		sql_log_err(state->hoard, "Couldn't allocate new hoard slot "
+					"at offset %d", mv->to);
+		return PK_IOERR;
+	}
+	mv->swapped = TRUE;
+	return PK_SUCCESS;
+}
+
+/* Atomically point the chunks table at the new copies */
+static pk_err_t swap_chunks(struct pk_state *state, GArray *moves,
+			unsigned *moved)
+{
+	struct compact_move *mv;
+	unsigned i;
+	gboolean retry;
+
+again:
+	*moved = 0;
+	if (!begin_immediate(state->hoard))
+		return PK_IOERR;
+	for (i = 0; i < moves->len; i++) {
+		mv = &g_array_index(moves, struct compact_move, i);
+		mv->swapped = FALSE;
+		if (!mv->copied)
+			continue;
+		if (swap_chunk(state, mv))
+			goto bad;
+		if (mv->swapped)
+			++*moved;
+	}
+	if (*moved)
+		hoard_tags_changed(state);
+	if (!commit(state->hoard))
+		goto bad;
+	hoard_map_commit(state);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	hoard_map_rollback(state);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
+	for (i = 0; i < moves->len; i++)
+		g_array_index(moves, struct compact_move, i).swapped = FALSE;
+	*moved = 0;
+	return PK_IOERR;
+}
+
+/* Move up to COMPACT_BATCH chunks from the end of the hoard file into free
+   space nearer the beginning.  @buf must be HOARD_MAX_CHUNK_SIZE bytes.
+   Sets *@done if no further progress is possible. */
+pk_err_t hoard_compact_batch(struct pk_state *state, void *buf,
+			unsigned *moved, gboolean *done)
+{
+	GArray *moves;
+	struct compact_move *mv;
+	unsigned i;
+	unsigned count = 0;
+	pk_err_t ret;
+
+	*moved = 0;
+	*done = FALSE;
+	moves = g_array_new(FALSE, FALSE, sizeof(struct compact_move));
+	ret = get_candidates(state, moves);
+	if (ret)
+		goto out;
+	if (moves->len == 0)
+		*done = TRUE;
+
+	/* Reserve destinations, highest chunk first */
+	for (i = 0; i < moves->len; i++, count++) {
+		mv = &g_array_index(moves, struct compact_move, i);
+		ret = hoard_map_reserve(state, mv->length, mv->length,
+					&mv->to, &mv->reserved);
+		if (ret)
+			goto release;
+		if (mv->to >= mv->from) {
+			/* Extent is not lower than where the chunk is now;
+			   we're done */
+			hoard_map_release(state, mv->to, mv->reserved);
+			mv->reserved = 0;
+			*done = TRUE;
+			break;
+		}
+	}
+
+	/* Start reading all of the sources, then copy them in order */
+	for (i = 0; i < count; i++) {
+		mv = &g_array_index(moves, struct compact_move, i);
+		posix_fadvise(state->hoard_fd, ((off_t) mv->from) << 9,
+					mv->length, POSIX_FADV_WILLNEED);
+	}
+	for (i = 0; i < count; i++) {
+		mv = &g_array_index(moves, struct compact_move, i);
+		/* A failed read means that the chunk has been deallocated
+		   or moved, or is bad.  Either way, leave it for someone
+		   else to deal with; readers will report it if it's bad. */
+		if (_hoard_read_chunk(state, mv->from, mv->length, mv->crypto,
+					mv->tag, mv->taglen, buf, TRUE))
+			continue;
+		if (_hoard_write_chunk(state, mv->to, mv->length, buf))
+			continue;
+		mv->copied = TRUE;
+	}
+
+	ret = swap_chunks(state, moves, moved);
+	/* If none of the chunks could be moved, trying again won't help */
+	if (!ret && *moved == 0)
+		*done = TRUE;
+
+release:
+	/* Give back the destinations we didn't use, and free the disk
+	   blocks behind the sources we vacated */
+	for (i = 0; i < count; i++) {
+		mv = &g_array_index(moves, struct compact_move, i);
+		if (mv->swapped)
+			hoard_map_punch(state, mv->from, mv->length);
+		else
+			hoard_map_release(state, mv->to, mv->reserved);
+	}
+out:
+	for (i = 0; i < moves->len; i++)
+		g_free(g_array_index(moves, struct compact_move, i).tag);
+	g_array_free(moves, TRUE);
+	return ret;
+}
+
+/* Truncate the hoard file after the last block in use */
+pk_err_t hoard_compact_truncate(struct pk_state *state)
+{
+	struct stat st;
+	off_t old_size;
+	int offset;
+	gboolean retry;
+
+again:
+	if (fstat(state->hoard_fd, &st)) {
+		pk_log(LOG_ERROR, "Couldn't stat hoard cache");
+		return PK_IOERR;
+	}
+	old_size = st.st_size;
+	if (!begin(state->hoard))
+		return PK_IOERR;
+	/* We move chunks with tag NOTNULL but only truncate space which is
+	   free in the hoard map, since we don't want to drop segments still
+	   in use by someone's slot cache.  Every chunk allocated in the
+	   chunks table is in use in the map, so no allocated rows lie past
+	   the new end. */
+	if (hoard_map_truncate(state, &offset))
+		goto bad;
+	if (!query(NULL, state->hoard, "DELETE FROM chunks WHERE offset >= ?",
+				"d", offset)) {
+		sql_log_err(state->hoard, "Couldn't delete empty cache slots");
+		goto bad;
+	}
+	if (!commit(state->hoard))
+		goto bad;
+	if (!fstat(state->hoard_fd, &st) && st.st_size != old_size)
+		pk_log(LOG_STATS, "Compacted hoard cache from %llu to "
+					"%llu MB",
+					(unsigned long long) old_size >> 20,
+					(unsigned long long) st.st_size >> 20);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
+	return PK_IOERR;
+}
+
+/***** Online compaction *****/
+
+/* Keep the compactor's I/O from competing with the guest's */
+static void set_idle_io_priority(void)
+{
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+		pk_log(LOG_INFO, "Couldn't set I/O priority of hoard "
+					"compactor");
+#endif
+}
+
+static gboolean compaction_worthwhile(struct pk_state *state)
+{
+	off64_t used;
+	off64_t end;
+
+	if (hoard_map_get_usage(state, &used, &end))
+		return FALSE;
+	return end - used >= COMPACT_MIN_WASTE &&
+				(end - used) * COMPACT_WASTE_RATIO >= end;
+}
+
+static gboolean compactor_stopping(struct pk_state *state)
+{
+	struct pk_hoard_compactor *hc = state->hoard_compactor;
+	gboolean ret;
+
+	g_mutex_lock(hc->lock);
+	ret = hc->stopping;
+	g_mutex_unlock(hc->lock);
+	return ret;
+}
+
+static void compact_online(struct pk_state *state, void *buf)
+{
+	unsigned moved;
+	unsigned total = 0;
+	gboolean done = FALSE;
+
+	pk_log(LOG_INFO, "Compacting hoard cache in the background");
+	while (!done && !compactor_stopping(state)) {
+		if (hoard_compact_batch(state, buf, &moved, &done))
+			return;
+		total += moved;
+		/* Release space as we go */
+		if (hoard_compact_truncate(state))
+			return;
+	}
+	pk_log(LOG_STATS, "Moved %u chunks while compacting hoard cache",
+				total);
+}
+
+static void *compactor(void *data)
+{
+	struct pk_state *state = data;
+	struct pk_hoard_compactor *hc = state->hoard_compactor;
+	GTimeVal timeout;
+	void *buf;
+
+	set_idle_io_priority();
+	buf = g_malloc(HOARD_MAX_CHUNK_SIZE);
+	g_mutex_lock(hc->lock);
+	while (!hc->stopping) {
+		g_get_current_time(&timeout);
+		timeout.tv_sec += COMPACT_INTERVAL;
+		g_cond_timed_wait(hc->cond, hc->lock, &timeout);
+		if (hc->stopping)
+			break;
+		g_mutex_unlock(hc->lock);
+		if (compaction_worthwhile(state))
+			compact_online(state, buf);
+		g_mutex_lock(hc->lock);
+	}
+	g_mutex_unlock(hc->lock);
+	g_free(buf);
+	return NULL;
+}
+
+pk_err_t hoard_compactor_init(struct pk_state *state)
+{
+	struct pk_hoard_compactor *hc;
+	GError *err = NULL;
+
+	hc = g_slice_new0(struct pk_hoard_compactor);
+	hc->lock = g_mutex_new();
+	hc->cond = g_cond_new();
+	state->hoard_compactor = hc;
+	hc->thread = g_thread_create(compactor, state, TRUE, &err);
+	if (hc->thread == NULL) {
+		pk_log(LOG_ERROR, "Couldn't create hoard compactor thread: %s",
+					err->message);
+		g_clear_error(&err);
+		state->hoard_compactor = NULL;
+		g_cond_free(hc->cond);
+		g_mutex_free(hc->lock);
+		g_slice_free(struct pk_hoard_compactor, hc);
+		return PK_CALLFAIL;
+	}
+	return PK_SUCCESS;
+}
+
+void hoard_compactor_shutdown(struct pk_state *state)
+{
+	struct pk_hoard_compactor *hc = state->hoard_compactor;
+
+	if (hc == NULL)
+		return;
+	/* A batch in progress is allowed to finish */
+	g_mutex_lock(hc->lock);
+	hc->stopping = TRUE;
+	g_cond_broadcast(hc->cond);
+	g_mutex_unlock(hc->lock);
+	g_thread_join(hc->thread);
+	state->hoard_compactor = NULL;
+	g_cond_free(hc->cond);
+	g_mutex_free(hc->lock);
+	g_slice_free(struct pk_hoard_compactor, hc);
+}
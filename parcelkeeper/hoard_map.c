@@ -0,0 +1,576 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Allocation map for the hoard file.  The hoard file is divided into 4 KB
+   blocks, and each chunk occupies just enough contiguous blocks to hold
+   its compressed and encrypted data.  The map is a bitmap, one bit per
+   block, kept in a file in the hoard directory and shared between
+   processes via mmap.  A set bit means the block is in use: either the
+   chunks table says a chunk is allocated there, or some process has
+   reserved it for chunks it hasn't yet recorded there.  Every block
+   covered by a chunk with allocated = 1 in the chunks table has its bit
+   set; the converse need not hold, since a process can die holding
+   reservations.  Those are reclaimed when the map is rebuilt from the
+   chunks table, which is done only while holding the exclusive lock on
+   the hoard file, i.e. when no other process is using the hoard cache.
+   The map header counts the processes which have reserved space and not
+   yet shut down, so that the rebuild can be skipped if none have died
+   holding reservations.
+
+   Each process reserves a segment of contiguous free blocks and appends
+   the chunks it hoards to it, so that chunks hoarded together stay
+   together on disk.  Space freed by deleted chunks is reused for later
+   segments, and compaction moves chunks from the end of the file into
+   free space nearer the beginning.
+
+   Changes to the map are serialized by an fcntl lock on the map file
+   (plus a mutex, since fcntl locks don't exclude threads of the same
+   process).  Space which is deallocated in the chunks table must not be
+   released in the map until the transaction has committed, so such
+   releases are queued with hoard_map_release_deferred() and applied by
+   hoard_map_commit().  Several threads can have hoard transactions in
+   progress, so each thread's queue is kept separately. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "defs.h"
+
+#define MAP_MAGIC 0x50484d50  /* "PMHP" */
+#define MAP_VERSION 3
+#define BLOCK_SECTORS (HOARD_BLOCK_SIZE >> 9)
+/* Chunk offsets are stored in the hoard index as int sector numbers, so
+   the map covers just under 1 TB of 4 KB blocks, rounded down to a whole
+   number of bitmap words.  The map file is sparse. */
+#define MAP_BLOCKS ((INT_MAX / BLOCK_SECTORS) & ~63)
+#define MAP_HEADER_SIZE 4096
+#define MAP_SIZE (MAP_HEADER_SIZE + MAP_BLOCKS / 8)
+
+struct map_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t valid;
+	/* Processes which may hold reservations */
+	uint32_t reservers;
+	/* All blocks below this one are in use */
+	uint64_t hint;
+	/* No block at or above this one is in use */
+	uint64_t high_water;
+};
+
+struct pk_hoard_map {
+	int fd;
+	struct map_header *hdr;
+	uint64_t *bits;
+	GMutex *lock;
+	GArray *deferred;	/* extents to release after commit */
+	gboolean reserver;	/* we're counted in hdr->reservers */
+};
+
+struct extent {
+	int offset;
+	unsigned length;
+	GThread *owner;
+};
+
+static pk_err_t map_lock(struct pk_hoard_map *map)
+{
+	pk_err_t ret;
+
+	g_mutex_lock(map->lock);
+	ret = get_file_lock(map->fd, FILE_LOCK_WRITE|FILE_LOCK_WAIT);
+	if (ret) {
+		pk_log(LOG_ERROR, "Couldn't lock hoard map: %s",
+					pk_strerror(ret));
+		g_mutex_unlock(map->lock);
+	}
+	return ret;
+}
+
+static void map_unlock(struct pk_hoard_map *map)
+{
+	put_file_lock(map->fd);
+	g_mutex_unlock(map->lock);
+}
+
+/* Map lock must be held.  Stop counting this process as a holder of
+   reservations; it must have released or recorded all of them. */
+static void drop_reserver(struct pk_hoard_map *map)
+{
+	if (!map->reserver)
+		return;
+	map->reserver = FALSE;
+	if (map->hdr->reservers > 0)
+		map->hdr->reservers--;
+}
+
+static uint64_t offset_to_block(int offset)
+{
+	return offset / BLOCK_SECTORS;
+}
+
+/* Every chunk occupies at least one block, so that no two chunks share
+   an offset */
+static unsigned length_to_blocks(unsigned length)
+{
+	return hoard_block_round(length) / HOARD_BLOCK_SIZE;
+}
+
+static gboolean block_in_use(struct pk_hoard_map *map, uint64_t block)
+{
+	return !!(map->bits[block / 64] & (1ULL << (block % 64)));
+}
+
+static void set_block(struct pk_hoard_map *map, uint64_t block)
+{
+	map->bits[block / 64] |= 1ULL << (block % 64);
+}
+
+static void clear_block(struct pk_hoard_map *map, uint64_t block)
+{
+	map->bits[block / 64] &= ~(1ULL << (block % 64));
+}
+
+/* Map lock must be held.  Returns MAP_BLOCKS if there are no free
+   blocks. */
+static uint64_t find_free_block(struct pk_hoard_map *map, uint64_t start)
+{
+	uint64_t word;
+	uint64_t i;
+
+	for (i = start / 64; i < MAP_BLOCKS / 64; i++) {
+		word = map->bits[i];
+		/* Pretend the blocks below @start are in use */
+		if (i == start / 64)
+			word |= (1ULL << (start % 64)) - 1;
+		if (~word)
+			return i * 64 + __builtin_ctzll(~word);
+	}
+	return MAP_BLOCKS;
+}
+
+/* Map lock must be held and the blocks above high_water must be clear */
+static void recompute_high_water(struct pk_hoard_map *map)
+{
+	uint64_t i;
+
+	for (i = (map->hdr->high_water + 63) / 64; i > 0; i--)
+		if (map->bits[i - 1])
+			break;
+	if (i == 0) {
+		map->hdr->high_water = 0;
+		return;
+	}
+	map->hdr->high_water = i * 64 - __builtin_clzll(map->bits[i - 1]);
+}
+
+/* Reserve the lowest run of at least @min and at most @max bytes of
+   contiguous free space.  Returns the offset of the run in *@offset and
+   its length in *@length, which is a multiple of the block size. */
+pk_err_t hoard_map_reserve(struct pk_state *state, unsigned min,
+			unsigned max, int *offset, unsigned *length)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	uint64_t start;
+	unsigned min_blocks = length_to_blocks(min);
+	unsigned max_blocks = length_to_blocks(max);
+	unsigned n;
+	pk_err_t ret;
+
+	ret = map_lock(map);
+	if (ret)
+		return ret;
+	if (!map->reserver) {
+		map->reserver = TRUE;
+		map->hdr->reservers++;
+	}
+	start = find_free_block(map, map->hdr->hint);
+	/* Everything below the first free block is in use */
+	map->hdr->hint = start;
+	while (1) {
+		if (start >= MAP_BLOCKS) {
+			map_unlock(map);
+			pk_log(LOG_ERROR, "Hoard cache is full");
+			return PK_NOMEM;
+		}
+		for (n = 0; n < max_blocks && start + n < MAP_BLOCKS &&
+					!block_in_use(map, start + n); n++);
+		if (n >= min_blocks)
+			break;
+		/* Hole too small; skip it */
+		start = find_free_block(map, start + n);
+	}
+	for (n = 0; n < max_blocks && start + n < MAP_BLOCKS &&
+				!block_in_use(map, start + n); n++)
+		set_block(map, start + n);
+	if (map->hdr->hint == start)
+		map->hdr->hint = start + n;
+	if (map->hdr->high_water < start + n)
+		map->hdr->high_water = start + n;
+	map_unlock(map);
+	*offset = start * BLOCK_SECTORS;
+	*length = n * HOARD_BLOCK_SIZE;
+	return PK_SUCCESS;
+}
+
+static void release(struct pk_hoard_map *map, int offset, unsigned length)
+{
+	uint64_t block = offset_to_block(offset);
+	unsigned count = length_to_blocks(length);
+	unsigned n;
+
+	for (n = 0; n < count; n++)
+		clear_block(map, block + n);
+	if (count && map->hdr->hint > block)
+		map->hdr->hint = block;
+}
+
+/* Release @length bytes at @offset which are not recorded as allocated in
+   the chunks table */
+void hoard_map_release(struct pk_state *state, int offset, unsigned length)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+
+	if (length == 0 || map_lock(map))
+		return;
+	release(map, offset, length);
+	map_unlock(map);
+}
+
+/* Release a chunk after the current transaction, which deallocates it in
+   the chunks table, has committed */
+void hoard_map_release_deferred(struct pk_state *state, int offset,
+			unsigned length)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	struct extent ext = {offset, length, g_thread_self()};
+
+	g_mutex_lock(map->lock);
+	g_array_append_val(map->deferred, ext);
+	g_mutex_unlock(map->lock);
+}
+
+/* Must be called after committing a transaction which may have called
+   hoard_map_release_deferred() */
+void hoard_map_commit(struct pk_state *state)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	struct extent *ext;
+	GThread *self = g_thread_self();
+	unsigned i;
+
+	if (map == NULL)
+		return;
+	if (map_lock(map)) {
+		/* The space stays in use until the next rebuild */
+		hoard_map_rollback(state);
+		return;
+	}
+	for (i = 0; i < map->deferred->len; ) {
+		ext = &g_array_index(map->deferred, struct extent, i);
+		if (ext->owner == self) {
+			release(map, ext->offset, ext->length);
+			g_array_remove_index_fast(map->deferred, i);
+		} else {
+			i++;
+		}
+	}
+	map_unlock(map);
+}
+
+/* Must be called after rolling back a transaction which may have called
+   hoard_map_release_deferred() */
+void hoard_map_rollback(struct pk_state *state)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	GThread *self = g_thread_self();
+	unsigned i;
+
+	if (map == NULL)
+		return;
+	g_mutex_lock(map->lock);
+	for (i = 0; i < map->deferred->len; ) {
+		if (g_array_index(map->deferred, struct extent, i).owner ==
+					self)
+			g_array_remove_index_fast(map->deferred, i);
+		else
+			i++;
+	}
+	g_mutex_unlock(map->lock);
+}
+
+/* Report the number of bytes in use and the offset of the end of the last
+   block in use */
+pk_err_t hoard_map_get_usage(struct pk_state *state, off64_t *used,
+			off64_t *end)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	uint64_t blocks = 0;
+	uint64_t i;
+	pk_err_t ret;
+
+	ret = map_lock(map);
+	if (ret)
+		return ret;
+	for (i = 0; i < (map->hdr->high_water + 63) / 64; i++)
+		blocks += __builtin_popcountll(map->bits[i]);
+	*used = (off64_t) blocks * HOARD_BLOCK_SIZE;
+	*end = (off64_t) map->hdr->high_water * HOARD_BLOCK_SIZE;
+	map_unlock(map);
+	return PK_SUCCESS;
+}
+
+/* Deallocate the disk blocks behind a free extent of the hoard file.  The
+   map lock keeps anyone from reserving the extent and writing to it while
+   we do this; if part of it has already been reserved, we leave it
+   alone. */
+void hoard_map_punch(struct pk_state *state, int offset, unsigned length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	struct pk_hoard_map *map = state->hoard_map;
+	uint64_t block = offset_to_block(offset);
+	unsigned count = length_to_blocks(length);
+	unsigned n;
+
+	if (map_lock(map))
+		return;
+	for (n = 0; n < count; n++)
+		if (block_in_use(map, block + n))
+			break;
+	/* Not all filesystems support this, and it's only an
+	   optimization */
+	if (n == count)
+		fallocate(state->hoard_fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE,
+					((off_t) offset) << 9,
+					(off_t) count * HOARD_BLOCK_SIZE);
+	map_unlock(map);
+#endif
+}
+
+/* Truncate the hoard file after the last block in use.  The map lock is
+   held across the truncation so that no one can reserve and write a block
+   beyond the new end of file while we're doing it.  Returns the new
+   length of the file, in sectors, in *@offset. */
+pk_err_t hoard_map_truncate(struct pk_state *state, int *offset)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	pk_err_t ret;
+
+	ret = map_lock(map);
+	if (ret)
+		return ret;
+	recompute_high_water(map);
+	*offset = map->hdr->high_water * BLOCK_SECTORS;
+	if (ftruncate(state->hoard_fd, ((off_t) *offset) << 9)) {
+		pk_log(LOG_ERROR, "Couldn't truncate hoard file");
+		ret = PK_IOERR;
+	}
+	map_unlock(map);
+	return ret;
+}
+
+/* Must be within hoard transaction.  Map lock must be held.  Set the map
+   from the chunks table, discarding all reservations. */
+static pk_err_t load_map(struct pk_state *state)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	struct query *qry;
+	uint64_t block;
+	uint64_t high_water = 0;
+	int offset;
+	int length;
+	unsigned n;
+
+	memset(map->bits, 0, (map->hdr->high_water + 63) / 64 * 8);
+	for (query(&qry, state->hoard, "SELECT offset, length FROM chunks "
+				"WHERE allocated == 1", NULL);
+				query_has_row(state->hoard); query_next(qry)) {
+		query_row(qry, "dd", &offset, &length);
+		block = offset_to_block(offset);
+		if (offset < 0 || offset % BLOCK_SECTORS || length < 0 ||
+					block + length_to_blocks(length) >
+					MAP_BLOCKS) {
+			pk_log(LOG_WARNING, "Ignoring hoard chunk with "
+						"unreasonable offset/length "
+						"%d/%d", offset, length);
+			continue;
+		}
+		for (n = 0; n < length_to_blocks(length); n++)
+			set_block(map, block + n);
+		if (high_water < block + n)
+			high_water = block + n;
+	}
+	query_free(qry);
+	if (!query_ok(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't read hoard allocation "
+					"map");
+		return PK_IOERR;
+	}
+	map->hdr->hint = 0;
+	map->hdr->high_water = high_water;
+	map->hdr->reservers = 0;
+	map->hdr->valid = 1;
+	return PK_SUCCESS;
+}
+
+/* Must be within hoard transaction.  The caller must hold the exclusive
+   lock on the hoard file, and this process must not hold any
+   reservations.  Unless @force is TRUE, the map is only rebuilt if some
+   process may have exited without releasing its reservations. */
+pk_err_t _hoard_map_rebuild(struct pk_state *state, gboolean force)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	pk_err_t ret;
+
+	ret = map_lock(map);
+	if (ret)
+		return ret;
+	drop_reserver(map);
+	if (!force && map->hdr->reservers == 0) {
+		map_unlock(map);
+		return PK_SUCCESS;
+	}
+	/* Deallocations by the current transaction are covered by the
+	   rebuild */
+	g_array_set_size(map->deferred, 0);
+	ret = load_map(state);
+	map_unlock(map);
+	return ret;
+}
+
+/* Populate a new or outdated map from the chunks table.  We don't
+   necessarily have the exclusive lock on the hoard file, but no one can
+   be reserving space from an invalid map. */
+static pk_err_t create_map(struct pk_state *state)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+	unsigned i;
+	pk_err_t ret;
+	gboolean retry;
+
+again:
+	if (!begin(state->hoard))
+		return PK_IOERR;
+	ret = map_lock(map);
+	if (ret) {
+		rollback(state->hoard);
+		return ret;
+	}
+	if (map->hdr->magic != MAP_MAGIC || map->hdr->version != MAP_VERSION
+				|| !map->hdr->valid) {
+		pk_log(LOG_INFO, "Creating hoard allocation map");
+		/* The map might be arbitrarily bad, so clear all of it.
+		   Don't write to words which are already clear, since that
+		   would allocate disk blocks for the entire sparse file. */
+		for (i = 0; i < MAP_BLOCKS / 64; i++)
+			if (map->bits[i])
+				map->bits[i] = 0;
+		map->hdr->magic = MAP_MAGIC;
+		map->hdr->version = MAP_VERSION;
+		map->hdr->valid = 0;
+		map->hdr->high_water = 0;
+		ret = load_map(state);
+	}
+	map_unlock(map);
+	if (ret) {
+		retry = query_busy(state->hoard);
+		rollback(state->hoard);
+		if (retry) {
+			query_backoff(state->hoard);
+			goto again;
+		}
+		return ret;
+	}
+	rollback(state->hoard);
+	return PK_SUCCESS;
+}
+
+pk_err_t hoard_map_init(struct pk_state *state)
+{
+	struct pk_hoard_map *map;
+	struct stat st;
+	char *addr;
+	pk_err_t ret;
+
+	map = g_slice_new0(struct pk_hoard_map);
+	map->fd = open(state->conf->hoard_map, O_RDWR|O_CREAT, 0666);
+	if (map->fd == -1) {
+		pk_log(LOG_ERROR, "Couldn't open %s: %s",
+					state->conf->hoard_map,
+					strerror(errno));
+		g_slice_free(struct pk_hoard_map, map);
+		return PK_IOERR;
+	}
+	/* Extending the file is idempotent, and the new space reads as
+	   zeroes, i.e. an invalid header and an empty map */
+	if (fstat(map->fd, &st) || (st.st_size < MAP_SIZE &&
+				ftruncate(map->fd, MAP_SIZE))) {
+		pk_log(LOG_ERROR, "Couldn't initialize %s",
+					state->conf->hoard_map);
+		ret = PK_IOERR;
+		goto bad_close;
+	}
+	addr = mmap(NULL, MAP_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, map->fd,
+				0);
+	if (addr == MAP_FAILED) {
+		pk_log(LOG_ERROR, "Couldn't map %s", state->conf->hoard_map);
+		ret = PK_IOERR;
+		goto bad_close;
+	}
+	map->hdr = (void *) addr;
+	map->bits = (void *) (addr + MAP_HEADER_SIZE);
+	map->lock = g_mutex_new();
+	map->deferred = g_array_new(FALSE, FALSE, sizeof(struct extent));
+	state->hoard_map = map;
+
+	ret = create_map(state);
+	if (ret) {
+		hoard_map_shutdown(state);
+		return ret;
+	}
+	return PK_SUCCESS;
+
+bad_close:
+	close(map->fd);
+	g_slice_free(struct pk_hoard_map, map);
+	return ret;
+}
+
+void hoard_map_shutdown(struct pk_state *state)
+{
+	struct pk_hoard_map *map = state->hoard_map;
+
+	if (map == NULL)
+		return;
+	/* All our reservations have been released or recorded by now */
+	if (map->reserver && !map_lock(map)) {
+		drop_reserver(map);
+		map_unlock(map);
+	}
+	state->hoard_map = NULL;
+	g_array_free(map->deferred, TRUE);
+	g_mutex_free(map->lock);
+	munmap(map->hdr, MAP_SIZE);
+	close(map->fd);
+	g_slice_free(struct pk_hoard_map, map);
+}
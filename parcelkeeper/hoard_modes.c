@@ -36,14 +36,28 @@ again:
 		return PK_IOERR;
 	if (!query(NULL, state->db, "CREATE TEMP TABLE to_hoard "
 				"(chunk INTEGER NOT NULL, "
-				"tag BLOB UNIQUE NOT NULL)", NULL)) {
+				"tag BLOB UNIQUE NOT NULL, "
+				"first_touch INTEGER, "
+				"reads INTEGER)", NULL)) {
 		sql_log_err(state->db, "Couldn't create temporary table");
 		goto bad;
 	}
+	/* Carry over the parcel's access profile, so that we can fetch
+	   the chunks the guest reads first before the others.  When a tag
+	   appears more than once, keep the chunk that is needed first. */
 	if (!query(NULL, state->db, "INSERT OR IGNORE INTO temp.to_hoard "
-				"(chunk, tag) SELECT chunk, tag "
-				"FROM prev.keys WHERE tag NOT IN "
-				"(SELECT tag FROM hoard.chunks)", NULL)) {
+				"(chunk, tag, first_touch, reads) "
+				"SELECT keys.chunk, keys.tag, "
+				"profile.first_touch, profile.reads "
+				"FROM prev.keys AS keys LEFT JOIN "
+				"hoard.access_profile AS profile ON "
+				"profile.parcel == ? AND "
+				"profile.chunk == keys.chunk "
+				"WHERE keys.tag NOT IN "
+				"(SELECT tag FROM hoard.chunks) "
+				"ORDER BY profile.first_touch ISNULL, "
+				"profile.first_touch, profile.reads DESC, "
+				"keys.chunk", "d", state->hoard_ident)) {
 		sql_log_err(state->db, "Couldn't build list of chunks "
 					"to hoard");
 		goto bad;
@@ -69,35 +83,6 @@ bad:
 	return PK_IOERR;
 }
 
-/* Make sure the chunk hasn't already been put in the hoard cache (because
-   someone else already downloaded it) before we download.  Use the hoard DB
-   connection so that state->db doesn't acquire the hoard DB lock. */
-static gboolean need_fetch(struct pk_state *state, void *tag, unsigned taglen)
-{
-	gboolean ret = TRUE;
-	gboolean retry;
-
-again:
-	if (!begin(state->hoard))
-		return TRUE;
-	query(NULL, state->hoard, "SELECT tag FROM chunks WHERE tag == ?", "b",
-				tag, taglen);
-	if (query_has_row(state->hoard)) {
-		ret = FALSE;
-	} else if (!query_ok(state->hoard)) {
-		sql_log_err(state->hoard, "Couldn't query hoard cache index");
-		retry = query_busy(state->hoard);
-		rollback(state->hoard);
-		if (retry) {
-			query_backoff(state->hoard);
-			goto again;
-		}
-		return ret;
-	}
-	rollback(state->hoard);
-	return ret;
-}
-
 int hoard(struct pk_state *state)
 {
 	struct query *qry;
@@ -134,8 +119,10 @@ int hoard(struct pk_state *state)
 again:
 	if (!begin(state->db))
 		goto out_early;
-	for (query(&qry, state->db, "SELECT chunk, tag FROM temp.to_hoard",
-				NULL); query_has_row(state->db);
+	for (query(&qry, state->db, "SELECT chunk, tag FROM temp.to_hoard "
+				"ORDER BY first_touch ISNULL, first_touch, "
+				"reads DESC, chunk", NULL);
+				query_has_row(state->db);
 				query_next(qry)) {
 		query_row(qry, "db", &chunk, &tag, &taglen);
 		if (taglen != state->parcel->hashlen) {
@@ -144,7 +131,10 @@ again:
 			goto out;
 		}
 
-		if (need_fetch(state, tag, taglen)) {
+		/* Make sure the chunk hasn't already been put in the hoard
+		   cache (because someone else already downloaded it) before
+		   we download */
+		if (!hoard_has_chunk(state, tag)) {
 			if (transport_fetch_chunk(state->cpool, buf, chunk,
 						tag, &chunklen))
 				goto out;
@@ -182,57 +172,23 @@ out_early:
 
 int examine_hoard(struct pk_state *state)
 {
-	struct query *qry;
-	unsigned validchunks;
-	unsigned maxchunks;
+	struct pk_hoard_stats stats;
 	unsigned valid_mb;
 	unsigned max_mb;
 	unsigned valid_pct;
-	gboolean retry;
 
-again:
-	if (!begin(state->db))
+	if (hoard_get_stats(state, &stats, NULL))
 		return 1;
-	query(&qry, state->db, "SELECT count(*) FROM hoard.refs AS refs "
-				"WHERE refs.parcel == ?", "d",
-				state->hoard_ident);
-	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't query reference list");
-		goto bad;
-	}
-	query_row(qry, "d", &maxchunks);
-	query_free(qry);
-	query(&qry, state->db, "SELECT count(*) FROM hoard.refs AS refs "
-				"JOIN hoard.chunks AS chunks "
-				"ON chunks.tag == refs.tag WHERE "
-				"refs.parcel == ?", "d", state->hoard_ident);
-	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't query hoard cache");
-		goto bad;
-	}
-	query_row(qry, "d", &validchunks);
-	query_free(qry);
-	if (!commit(state->db))
-		goto bad;
 
-	max_mb=(((off64_t)maxchunks) * state->parcel->chunksize) >> 20;
-	valid_mb=(((off64_t)validchunks) * state->parcel->chunksize) >> 20;
-	if (maxchunks)
-		valid_pct=(100 * validchunks) / maxchunks;
+	max_mb=(((off64_t)stats.referenced) * state->parcel->chunksize) >> 20;
+	valid_mb=(((off64_t)stats.present) * state->parcel->chunksize) >> 20;
+	if (stats.referenced)
+		valid_pct=(100 * stats.present) / stats.referenced;
 	else
 		valid_pct=100;
 	printf("Hoard cache : %u%% populated (%u/%u MB)\n", valid_pct,
 				valid_mb, max_mb);
 	return 0;
-
-bad:
-	retry = query_busy(state->db);
-	rollback(state->db);
-	if (retry) {
-		query_backoff(state->db);
-		goto again;
-	}
-	return 1;
 }
 
 int list_hoard(struct pk_state *state)
@@ -247,43 +203,30 @@ int list_hoard(struct pk_state *state)
 	int p_total;
 	int p_unique;
 	int shared;
-	int unused;
+	off64_t used;
+	off64_t end;
 	gboolean retry;
 
+	/* Free space inside the hoard file is tracked by the hoard map;
+	   the chunks table only has rows for chunks which are present */
+	if (hoard_map_get_usage(state, &used, &end))
+		return 1;
+
 again:
 	if (!begin(state->db))
 		return 1;
-	query(&qry, state->db, "SELECT count(*) FROM hoard.chunks WHERE "
-				"tag NOTNULL", NULL);
+	query(&qry, state->db, "SELECT chunks FROM hoard.totals", NULL);
 	if (!query_has_row(state->db)) {
 		sql_log_err(state->db, "Couldn't count valid chunks");
 		goto out;
 	}
 	query_row(qry, "d", &shared);
 	query_free(qry);
-	query(&qry, state->db, "SELECT count(*) FROM hoard.chunks WHERE "
-				"allocated == 0", NULL);
-	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't count unused chunk slots");
-		goto out;
-	}
-	query_row(qry, "d", &unused);
-	query_free(qry);
-	for (query(&qry, state->db, "SELECT hoard.parcels.parcel, uuid, "
-				"server, user, name, total, uniq "
-				"FROM hoard.parcels LEFT JOIN "
-				"(SELECT parcel, count(*) AS total "
-				"FROM hoard.refs WHERE tag IN "
-				"(SELECT tag FROM hoard.chunks) "
-				"GROUP BY parcel) AS sub1 "
-				"ON parcels.parcel == sub1.parcel "
-				"LEFT JOIN "
-				"(SELECT parcel, count(parcel) AS uniq FROM "
-				"(SELECT parcel FROM hoard.refs WHERE tag IN "
-				"(SELECT tag FROM hoard.chunks) GROUP BY tag "
-				"HAVING count(*) == 1) GROUP BY parcel) "
-				"AS sub2 "
-				"ON parcels.parcel == sub2.parcel", NULL);
+	/* The per-parcel counts are maintained by triggers in the hoard
+	   index */
+	for (query(&qry, state->db, "SELECT parcel, uuid, server, user, "
+				"name, present, uniq FROM hoard.parcels",
+				NULL);
 				query_has_row(state->db); query_next(qry)) {
 		query_row(qry, "dssssdd", &parcel, &uuid, &server, &user,
 					&name, &p_total, &p_unique);
@@ -294,7 +237,8 @@ again:
 	query_free(qry);
 	if (query_ok(state->db)) {
 		printf("shared %d\n", shared);
-		printf("unused %d\n", unused);
+		/* In MB */
+		printf("unused %d\n", (int) ((end - used) >> 20));
 		ret=0;
 	} else {
 		sql_log_err(state->db, "Couldn't list parcels in hoard cache");
@@ -341,12 +285,31 @@ again:
 
 	pk_log(LOG_INFO, "Removing parcel %s from hoard cache...", desc);
 	g_free(desc);
+	if (!query(NULL, state->db, "UPDATE hoard.chunks SET refcount = "
+				"refcount - 1 WHERE tag IN (SELECT tag FROM "
+				"hoard.refs WHERE parcel == ?)", "d", parcel)) {
+		sql_log_err(state->db, "Couldn't release hoard chunk "
+					"references");
+		goto bad;
+	}
 	if (!query(NULL, state->db, "DELETE FROM hoard.refs WHERE parcel == ?",
 				"d", parcel)) {
 		sql_log_err(state->db, "Couldn't remove parcel from "
 					"hoard cache");
 		goto bad;
 	}
+	if (!query(NULL, state->db, "DELETE FROM hoard.pending_refs "
+				"WHERE parcel == ?", "d", parcel)) {
+		sql_log_err(state->db, "Couldn't remove parcel's pending "
+					"hoard refs");
+		goto bad;
+	}
+	if (!query(NULL, state->db, "DELETE FROM hoard.access_profile "
+				"WHERE parcel == ?", "d", parcel)) {
+		sql_log_err(state->db, "Couldn't remove parcel's access "
+					"profile");
+		goto bad;
+	}
 
 	/* We can't remove the parcel from the parcels table unless we know
 	   that no other Parcelkeeper process is running against that parcel */
@@ -377,7 +340,7 @@ int gchoard(struct pk_state *state)
 }
 
 static pk_err_t _compact_hoard_count_moves(struct pk_state *state,
-			unsigned chunksize, unsigned *moves)
+			unsigned *moves)
 {
 	struct query *qry;
 	int offset;
@@ -385,27 +348,29 @@ static pk_err_t _compact_hoard_count_moves(struct pk_state *state,
 	gboolean retry;
 
 	/* Determine the number of moves we need to make by determining the
-	   target length of the hoard cache, then counting unallocated slots
-	   within that area.  If other processes are also modifying the hoard
-	   cache, this number can change as we work. */
+	   target length of the hoard cache, then counting chunks which lie
+	   beyond it.  If other processes are also modifying the hoard cache,
+	   this number can change as we work. */
 
 again:
 	if (!begin(state->db))
 		return PK_IOERR;
-	query(&qry, state->db, "SELECT count(*) FROM hoard.chunks "
-				"WHERE tag NOTNULL", NULL);
+	query(&qry, state->db, "SELECT sum((length + "
+				G_STRINGIFY(HOARD_BLOCK_SIZE) " - 1) / "
+				G_STRINGIFY(HOARD_BLOCK_SIZE) ") FROM "
+				"hoard.chunks WHERE tag NOTNULL", NULL);
 	if (!query_has_row(state->db)) {
 		sql_log_err(state->db, "Couldn't count present hoard chunks");
 		goto bad;
 	}
 	query_row(qry, "d", &offset);
 	query_free(qry);
-	offset *= (chunksize >> 9);
+	offset *= HOARD_BLOCK_SIZE >> 9;
 	query(&qry, state->db, "SELECT count(*) FROM hoard.chunks "
-				"WHERE allocated == 0 AND offset < ?", "d",
+				"WHERE tag NOTNULL AND offset >= ?", "d",
 				offset);
 	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't count target hoard slots");
+		sql_log_err(state->db, "Couldn't count chunks to move");
 		goto bad;
 	}
 	query_row(qry, "d", &count);
@@ -425,200 +390,9 @@ bad:
 	return PK_IOERR;
 }
 
-static pk_err_t _compact_hoard_move_chunk(struct pk_state *state,
-			int from_offset, int to_offset, int length, int crypto,
-			const void *tag, int taglen, void *buf)
-{
-	pk_err_t ret;
-
-	ret = _hoard_read_chunk(state, from_offset, length, crypto, tag,
-				taglen, buf);
-	if (ret)
-		return ret;
-	ret = _hoard_write_chunk(state, to_offset, length, buf);
-	if (ret)
-		return ret;
-	if (!query(NULL, state->db, "UPDATE hoard.chunks SET tag = NULL, "
-				"length = 0, crypto = 0, allocated = 0 "
-				"WHERE offset = ?", "d", from_offset)) {
-		sql_log_err(state->db, "Couldn't deallocate hoard chunk "
-					"at offset %d", from_offset);
-		return PK_IOERR;
-	}
-	if (!query(NULL, state->db, "UPDATE hoard.chunks SET tag = ?, "
-				"length = ?, crypto = ?, allocated = 1 "
-				"WHERE offset = ?", "bddd", tag, taglen,
-				length, crypto, to_offset)) {
-		sql_log_err(state->db, "Couldn't allocate new hoard slot "
-					"at offset %d", to_offset);
-		return PK_IOERR;
-	}
-	return PK_SUCCESS;
-}
-
-static pk_err_t _compact_hoard_iteration(struct pk_state *state, void *buf,
-			unsigned *moved, gboolean *done)
-{
-	struct query *chunk_qry;
-	struct query *slot_qry;
-	int from_offset;
-	int to_offset;
-	int length;
-	int crypto;
-	void *tag;
-	int taglen;
-	gboolean retry;
-	pk_err_t ret;
-
-again:
-	*moved = 0;
-	*done = FALSE;
-	ret = PK_IOERR;
-	/* Try to avoid lock promotion on the hoard cache. */
-	if (!begin_immediate(state->db))
-		goto bad;
-	for (query(&chunk_qry, state->db, "SELECT tag, offset, length, crypto "
-				"FROM hoard.chunks WHERE tag NOTNULL "
-				"ORDER BY offset DESC LIMIT 16", NULL);
-				query_has_row(state->db);
-				query_next(chunk_qry)) {
-		query_row(chunk_qry, "bddd", &tag, &taglen, &from_offset,
-					&length, &crypto);
-		/* Get a lower slot to move the chunk to */
-		query(&slot_qry, state->db, "SELECT offset FROM "
-					"hoard.chunks WHERE allocated == 0 "
-					"ORDER BY offset ASC LIMIT 1", NULL);
-		if (!query_has_row(state->db)) {
-			if (query_ok(state->db)) {
-				/* No free offsets; we're done */
-				*done = TRUE;
-			}
-			/* Handle errors after the loop */
-			break;
-		}
-		query_row(slot_qry, "d", &to_offset);
-		query_free(slot_qry);
-		if (to_offset >= from_offset) {
-			/* Slot is not lower than where the chunk is now;
-			   we're done */
-			*done = TRUE;
-			break;
-		}
-		ret = _compact_hoard_move_chunk(state, from_offset, to_offset,
-					length, crypto, tag, taglen, buf);
-		if (ret) {
-			query_free(chunk_qry);
-			goto bad;
-		}
-		++*moved;
-	}
-	query_free(chunk_qry);
-	/* We might have exited the loop early, so query_has_row() is also
-	   okay */
-	if (!query_ok(state->db) && !query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't query chunks table");
-		goto bad;
-	}
-	if (chunk_qry == NULL) {
-		/* Since we've already tested for query errors, this means
-		   that there never was a query result, i.e. we didn't
-		   traverse the loop even once.  Tell the caller we're done. */
-		*done = TRUE;
-	}
-	if (!commit(state->db))
-		goto bad;
-	return PK_SUCCESS;
-
-bad:
-	retry = query_busy(state->db);
-	rollback(state->db);
-	if (retry) {
-		query_backoff(state->db);
-		goto again;
-	}
-	return ret;
-}
-
-static pk_err_t _compact_hoard_truncate(struct pk_state *state,
-			unsigned chunksize)
-{
-	struct query *qry;
-	int offset;
-	gchar *type;
-	int old_chunks;
-	int new_chunks;
-	off_t new_length;
-	gboolean retry;
-
-again:
-	if (!begin(state->db))
-		return PK_IOERR;
-	query(&qry, state->db, "SELECT max(offset) FROM hoard.chunks", NULL);
-	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't get max offset from "
-					"hoard index");
-		query_free(qry);
-		goto bad;
-	}
-	type = query_column_types(qry);
-	query_row(qry, "d", &offset);
-	query_free(qry);
-	old_chunks = offset / (chunksize >> 9);
-	/* Distinguish between a max offset of 0 and a NULL value (indicating
-	   that the table is empty) */
-	if (strcmp(type, "0"))
-		old_chunks += 1;
-	g_free(type);
-
-	/* We move chunks with tag NOTNULL but only truncate unallocated
-	   slots, since we don't want to drop slots still in someone's slot
-	   cache. */
-	query(&qry, state->db, "SELECT max(offset) FROM hoard.chunks WHERE "
-				"allocated == 1", NULL);
-	if (!query_has_row(state->db)) {
-		sql_log_err(state->db, "Couldn't get max allocated offset "
-					"from hoard index");
-		query_free(qry);
-		goto bad;
-	}
-	type = query_column_types(qry);
-	query_row(qry, "d", &offset);
-	query_free(qry);
-	if (strcmp(type, "0"))
-		offset += (chunksize >> 9);
-	g_free(type);
-	new_chunks = offset / (chunksize >> 9);
-	new_length = ((off_t) offset) << 9;
-	if (!query(NULL, state->db, "DELETE FROM hoard.chunks "
-				"WHERE offset >= ?", "d", offset)) {
-		sql_log_err(state->db, "Couldn't delete empty cache slots");
-		goto bad;
-	}
-	if (ftruncate(state->hoard_fd, new_length)) {
-		pk_log(LOG_ERROR, "Couldn't truncate hoard file");
-		goto bad;
-	}
-	if (!commit(state->db))
-		goto bad;
-	if (old_chunks != new_chunks)
-		pk_log(LOG_STATS, "Compacted hoard cache from %d to %d slots",
-					old_chunks, new_chunks);
-	return PK_SUCCESS;
-
-bad:
-	retry = query_busy(state->db);
-	rollback(state->db);
-	if (retry) {
-		query_backoff(state->db);
-		goto again;
-	}
-	return PK_IOERR;
-}
-
 static pk_err_t compact_hoard(struct pk_state *state)
 {
 	void *buf;
-	unsigned chunksize = 131072;  /* XXX */
 	unsigned cur;
 	unsigned moved = 0;
 	unsigned total_moves;
@@ -630,13 +404,13 @@ static pk_err_t compact_hoard(struct pk_state *state)
 	ret = hoard_gc(state);
 	if (ret)
 		return ret;
-	ret = _compact_hoard_count_moves(state, chunksize, &total_moves);
+	ret = _compact_hoard_count_moves(state, &total_moves);
 	if (ret)
 		return ret;
 	print_progress_chunks(moved, total_moves);
-	buf = g_malloc(chunksize);
+	buf = g_malloc(HOARD_MAX_CHUNK_SIZE);
 	while (!done) {
-		ret = _compact_hoard_iteration(state, buf, &cur, &done);
+		ret = hoard_compact_batch(state, buf, &cur, &done);
 		if (ret) {
 			g_free(buf);
 			return ret;
@@ -648,7 +422,7 @@ static pk_err_t compact_hoard(struct pk_state *state)
 		print_progress_chunks(moved, total_moves);
 	}
 	g_free(buf);
-	ret = _compact_hoard_truncate(state, chunksize);
+	ret = hoard_compact_truncate(state);
 	if (ret)
 		return ret;
 	/* We have to use the hoard cache connection for this */
@@ -662,7 +436,7 @@ static pk_err_t compact_hoard(struct pk_state *state)
 static pk_err_t check_hoard_data(struct pk_state *state)
 {
 	struct query *qry;
-	char buf[131072];  /* XXX assumes 128 KB */
+	void *buf;
 	const void *tag;
 	unsigned taglen;
 	unsigned offset;
@@ -675,10 +449,13 @@ static pk_err_t check_hoard_data(struct pk_state *state)
 
 	pk_log(LOG_INFO, "Validating hoard cache data");
 	printf("Validating hoard cache data...\n");
+	buf = g_malloc(HOARD_MAX_CHUNK_SIZE);
 
 again:
-	if (!begin(state->db))
+	if (!begin(state->db)) {
+		g_free(buf);
 		return PK_IOERR;
+	}
 	query(&qry, state->db, "SELECT sum(length) FROM temp.to_check", NULL);
 	if (!query_has_row(state->db)) {
 		sql_log_err(state->db, "Couldn't find the amount of data "
@@ -699,7 +476,7 @@ again:
 		/* We assume the taglen and crypto suite are good, because
 		   check_hoard() already validated these */
 		if (_hoard_read_chunk(state, offset, len, crypto, tag, taglen,
-					buf)) {
+					buf, FALSE)) {
 			hoard_invalidate_chunk(state, offset, tag, taglen);
 			count++;
 		}
@@ -717,6 +494,7 @@ again:
 		goto bad;
 	if (count)
 		pk_log(LOG_WARNING, "Removed %d invalid chunks", count);
+	g_free(buf);
 	return PK_SUCCESS;
 
 bad:
@@ -728,6 +506,7 @@ bad:
 	}
 	if (!begin(state->db)) {
 		sql_log_err(state->db, "Couldn't drop temporary table (1)");
+		g_free(buf);
 		return PK_IOERR;
 	}
 	if (!query(NULL, state->db, "DROP TABLE temp.to_check", NULL))
@@ -736,6 +515,7 @@ bad:
 		sql_log_err(state->db, "Couldn't drop temporary table (3)");
 		rollback(state->db);
 	}
+	g_free(buf);
 	return PK_IOERR;
 }
 
@@ -746,6 +526,7 @@ int check_hoard(struct pk_state *state)
 	const char *uuid;
 	int offset;
 	int next_offset;
+	int len;
 	const void *tag;
 	unsigned taglen;
 	int crypto;
@@ -789,26 +570,39 @@ again:
 	if (count)
 		pk_log(LOG_WARNING, "Removed %d invalid parcel records", count);
 
+	/* Allocated chunks must be block-aligned and must not overlap.
+	   Delete any that are not; the hoard map tracks free space, so the
+	   rows needn't be kept. */
+	count=0;
 	next_offset=0;
-	for (query(&qry, state->db, "SELECT offset FROM hoard.chunks "
-				"ORDER BY offset", NULL);
+	for (query(&qry, state->db, "SELECT offset, length FROM hoard.chunks "
+				"WHERE allocated == 1 ORDER BY offset", NULL);
 				query_has_row(state->db); query_next(qry)) {
-		query_row(qry, "d", &offset);
-		if (offset != next_offset) {
-			/* XXX how do we fix this? */
-			pk_log(LOG_WARNING, "Expected offset %d, found %d",
-						next_offset, offset);
+		query_row(qry, "dd", &offset, &len);
+		if (offset >= next_offset && offset %
+					(HOARD_BLOCK_SIZE >> 9) == 0) {
+			next_offset = offset + (hoard_block_round(len) >> 9);
+			continue;
+		}
+		pk_log(LOG_WARNING, "Chunk at offset %d overlaps its "
+					"predecessor or is misaligned", offset);
+		count++;
+		if (!query(NULL, state->db, "DELETE FROM hoard.chunks "
+					"WHERE offset = ?", "d", offset)) {
+			sql_log_err(state->db, "Couldn't deallocate "
+						"offset %d", offset);
 			query_free(qry);
 			goto bad;
 		}
-		/* XXX assumes 128 KB */
-		next_offset += 256;
 	}
 	query_free(qry);
 	if (!query_ok(state->db)) {
 		sql_log_err(state->db, "Couldn't query chunk table");
 		goto bad;
 	}
+	if (count)
+		pk_log(LOG_WARNING, "Cleaned %d chunks with invalid offset",
+					count);
 
 	count=0;
 	for (query(&qry, state->db, "SELECT offset, tag, crypto FROM "
@@ -820,11 +614,9 @@ again:
 					iu_chunk_crypto_hashlen(crypto)
 					!= taglen))) {
 			count++;
-			if (!query(NULL, state->db, "UPDATE hoard.chunks "
-						"SET tag = NULL, length = 0, "
-						"crypto = 0, allocated = 0 "
-						"WHERE offset = ?", "d",
-						offset)) {
+			if (!query(NULL, state->db, "DELETE FROM "
+						"hoard.chunks WHERE offset = ?",
+						"d", offset)) {
 				sql_log_err(state->db, "Couldn't deallocate "
 							"offset %d", offset);
 				query_free(qry);
@@ -841,31 +633,52 @@ again:
 		pk_log(LOG_WARNING, "Cleaned %d chunks with invalid "
 					"crypto suite", count);
 
-	/* XXX assumes 128 KB */
-	if (cleanup_action(state->db, "UPDATE hoard.chunks SET tag = NULL, "
-				"length = 0, crypto = 0, allocated = 0 "
-				"WHERE length < 0 OR length > 131072 OR "
+	if (cleanup_action(state->db, "DELETE FROM hoard.chunks "
+				"WHERE length < 0 OR length > "
+				G_STRINGIFY(HOARD_MAX_CHUNK_SIZE) " OR "
 				"(length == 0 AND tag NOTNULL)",
 				LOG_WARNING,
 				"chunks with invalid length"))
 		goto bad;
-	if (cleanup_action(state->db, "UPDATE hoard.chunks SET tag = NULL, "
-				"length = 0, crypto = 0, allocated = 0 "
+	if (cleanup_action(state->db, "DELETE FROM hoard.chunks "
 				"WHERE allocated != 0 AND allocated != 1",
 				LOG_WARNING,
 				"chunks with invalid allocated flag"))
 		goto bad;
-	if (cleanup_action(state->db, "UPDATE hoard.chunks SET tag = NULL, "
-				"length = 0, crypto = 0 WHERE "
+	if (cleanup_action(state->db, "DELETE FROM hoard.chunks WHERE "
 				"allocated == 0 AND tag NOTNULL",
 				LOG_WARNING,
 				"unallocated chunks with valid tag"))
 		goto bad;
+	if (cleanup_action(state->db, "DELETE FROM hoard.chunks WHERE "
+				"tag ISNULL", LOG_INFO,
+				"empty chunk slots"))
+		goto bad;
 	if (cleanup_action(state->db, "DELETE FROM hoard.refs WHERE parcel "
 				"NOT IN (SELECT parcel FROM hoard.parcels)",
 				LOG_WARNING,
 				"refs with dangling parcel ID"))
 		goto bad;
+	if (cleanup_action(state->db, "DELETE FROM hoard.pending_refs "
+				"WHERE parcel NOT IN "
+				"(SELECT parcel FROM hoard.parcels)",
+				LOG_WARNING,
+				"pending refs with dangling parcel ID"))
+		goto bad;
+	if (cleanup_action(state->db, "DELETE FROM hoard.access_profile "
+				"WHERE parcel NOT IN "
+				"(SELECT parcel FROM hoard.parcels)",
+				LOG_WARNING,
+				"profile entries with dangling parcel ID"))
+		goto bad;
+	if (cleanup_action(state->db, "UPDATE hoard.chunks SET refcount = "
+				"(SELECT count(*) FROM hoard.refs WHERE "
+				"refs.tag == chunks.tag) WHERE tag NOTNULL AND "
+				"refcount != (SELECT count(*) FROM hoard.refs "
+				"WHERE refs.tag == chunks.tag)",
+				LOG_WARNING,
+				"chunks with incorrect reference count"))
+		goto bad;
 
 	/* If we're going to do a FULL_CHECK, then get the necessary metadata
 	   *now* while we still know it's consistent. */
@@ -880,8 +693,12 @@ again:
 		}
 	}
 
+	hoard_tags_changed(state);
 	if (!commit(state->db))
 		goto bad;
+	/* The statistics are maintained by triggers, but may have drifted
+	   if the index was modified by hand */
+	hoard_recount_stats(state);
 
 	if (state->conf->flags & WANT_FULL_CHECK)
 		if (check_hoard_data(state))
@@ -0,0 +1,517 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* In-memory index of the tags in the hoard cache, so that most hoard
+   lookups can be answered without going to SQLite.  The index maps tag
+   to (offset, length) and covers both the chunks table and our own slot
+   cache.  A Bloom filter in front of it rejects most misses without
+   touching the hash table.
+
+   Other processes can change the chunks table at any time, so the hoard
+   directory contains a generation counter, shared via mmap, which is
+   incremented by every transaction that changes the tags in the chunks
+   table.  The index is only consulted when its generation matches the
+   shared counter; otherwise callers fall back to SQL until the index is
+   rebuilt.  Rebuilding reads the whole chunks table, so it's done by a
+   background thread with its own database connection rather than on the
+   lookup path.  The index is a hint: a hit is still verified by the tag
+   check in _hoard_read_chunk(), and a false miss only costs a redundant
+   fetch or a duplicate insert which _flush_slot_cache() will discard. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include "defs.h"
+
+/* Minimum interval between index rebuilds, in seconds, so that a busy
+   hoard in another process doesn't have us rebuilding constantly */
+#define TAGS_REBUILD_INTERVAL 10
+/* Bloom filter sizing: bits per entry and hash functions per tag */
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_MIN_BITS (1 << 16)
+#define BLOOM_HASHES 4
+
+/* GHashTable equality functions don't get a closure argument, and there's
+   only one parcel per process.  Set by hoard_tags_init(). */
+static unsigned index_hashlen;
+
+struct tag_entry {
+	int offset;
+	int length;
+	unsigned char tag[];
+};
+
+/* The hash table and its Bloom filter */
+struct tag_set {
+	GHashTable *entries;	/* tag -> struct tag_entry */
+	uint32_t *bloom;
+	uint32_t bloom_mask;	/* number of bits - 1 */
+};
+
+struct pk_hoard_tags {
+	int gen_fd;
+	volatile uint64_t *shared_gen;
+
+	/* Rebuild thread and its connection to the hoard index */
+	GThread *thread;
+	struct db *db;
+	GCond *cond;
+	gboolean rebuild_wanted;
+	gboolean stopping;
+
+	GMutex *lock;
+	unsigned hashlen;	/* 0 if there's no index */
+	struct tag_set set;
+	/* Generation at which the index was last known to be accurate */
+	uint64_t gen;
+	gboolean valid;
+	time_t last_rebuild;
+};
+
+/* The hash table key is the tag itself.  Tags are cryptographic hashes,
+   so any 32 bits of one are a good hash value. */
+static unsigned tag_word(const unsigned char *tag, unsigned n)
+{
+	uint32_t word;
+
+	memcpy(&word, tag + 4 * n, sizeof(word));
+	return word;
+}
+
+/* Also used for the slot cache in hoard.c */
+guint hoard_tag_hash(gconstpointer key)
+{
+	return tag_word(key, 0);
+}
+
+gboolean hoard_tag_equal(gconstpointer a, gconstpointer b)
+{
+	return !memcmp(a, b, index_hashlen);
+}
+
+static void set_init(struct tag_set *set, unsigned count)
+{
+	unsigned bits = BLOOM_MIN_BITS;
+
+	while (bits < count * BLOOM_BITS_PER_ENTRY)
+		bits <<= 1;
+	set->entries = g_hash_table_new_full(hoard_tag_hash, hoard_tag_equal,
+				NULL,
+				g_free);
+	set->bloom = g_malloc0(bits / 8);
+	set->bloom_mask = bits - 1;
+}
+
+static void set_destroy(struct tag_set *set)
+{
+	if (set->entries)
+		g_hash_table_destroy(set->entries);
+	g_free(set->bloom);
+	memset(set, 0, sizeof(*set));
+}
+
+static void set_add(struct tag_set *set, const void *tag, unsigned hashlen,
+			int offset, int length)
+{
+	struct tag_entry *ent;
+	uint32_t bit;
+	int i;
+
+	ent = g_malloc(sizeof(*ent) + hashlen);
+	ent->offset = offset;
+	ent->length = length;
+	memcpy(ent->tag, tag, hashlen);
+	g_hash_table_replace(set->entries, ent->tag, ent);
+	for (i = 1; i <= BLOOM_HASHES; i++) {
+		bit = tag_word(ent->tag, i) & set->bloom_mask;
+		set->bloom[bit / 32] |= 1U << (bit % 32);
+	}
+}
+
+static struct tag_entry *set_lookup(struct tag_set *set, const void *tag)
+{
+	uint32_t bit;
+	int i;
+
+	for (i = 1; i <= BLOOM_HASHES; i++) {
+		bit = tag_word(tag, i) & set->bloom_mask;
+		if (!(set->bloom[bit / 32] & (1U << (bit % 32))))
+			return NULL;
+	}
+	return g_hash_table_lookup(set->entries, tag);
+}
+
+static uint64_t shared_gen(struct pk_hoard_tags *tags)
+{
+	return __sync_fetch_and_add(tags->shared_gen, 0);
+}
+
+/* Lock must be held */
+static gboolean index_usable(struct pk_hoard_tags *tags)
+{
+	return tags->valid && tags->gen == shared_gen(tags);
+}
+
+static pk_err_t count_tags(struct db *db, unsigned *count)
+{
+	struct query *qry;
+
+	query(&qry, db, "SELECT count(*) FROM chunks WHERE tag NOTNULL",
+				NULL);
+	if (!query_has_row(db)) {
+		sql_log_err(db, "Couldn't count hoard chunks");
+		return PK_IOERR;
+	}
+	query_row(qry, "d", count);
+	query_free(qry);
+	return PK_SUCCESS;
+}
+
+static pk_err_t load_tags(struct pk_state *state, struct db *db,
+			struct tag_set *set)
+{
+	unsigned hashlen = state->hoard_tags->hashlen;
+	struct query *qry;
+	void *tag;
+	unsigned taglen;
+	int offset;
+	int length;
+
+	for (query(&qry, db, "SELECT tag, offset, length FROM chunks "
+				"WHERE tag NOTNULL", NULL);
+				query_has_row(db); query_next(qry)) {
+		query_row(qry, "bdd", &tag, &taglen, &offset, &length);
+		/* Chunks with other crypto suites can't match our tags */
+		if (taglen == hashlen)
+			set_add(set, tag, hashlen, offset, length);
+	}
+	query_free(qry);
+	if (!query_ok(db)) {
+		sql_log_err(db, "Couldn't read hoard chunk index");
+		return PK_IOERR;
+	}
+	return PK_SUCCESS;
+}
+
+struct load_slot_data {
+	struct tag_set *set;
+	unsigned hashlen;
+};
+
+static void load_slot(const void *tag, int offset, int length, void *data)
+{
+	struct load_slot_data *ld = data;
+
+	set_add(ld->set, tag, ld->hashlen, offset, length);
+}
+
+/* Reload the index from the database.  Runs in the rebuild thread.  We
+   read the chunks table through our own connection, so the scan doesn't
+   hold up hoard transactions in other threads.  Our slot cache can only be
+   read within a state->hoard transaction, so we add it and install the new
+   index inside one; that way none of our own updates can fall between the
+   two.  The lock order is the hoard DB, then tags->lock. */
+static void rebuild(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+	struct tag_set set = {0};
+	struct load_slot_data ld;
+	uint64_t gen;
+	unsigned count;
+	gboolean retry;
+
+again:
+	/* If anyone changes the chunks table after we sample the counter,
+	   the new index is born stale and lookups keep using SQL until the
+	   next rebuild.  Other processes increment the counter inside their
+	   transactions, so a change in progress while we read may be
+	   missed.  That's harmless, since the index is only a hint. */
+	gen = shared_gen(tags);
+	if (!begin(tags->db))
+		return;
+	if (count_tags(tags->db, &count))
+		goto bad;
+	set_init(&set, count);
+	if (load_tags(state, tags->db, &set))
+		goto bad;
+	rollback(tags->db);
+
+	if (!begin(state->hoard)) {
+		set_destroy(&set);
+		return;
+	}
+	ld.set = &set;
+	ld.hashlen = tags->hashlen;
+	hoard_slot_cache_foreach(state, load_slot, &ld);
+	g_mutex_lock(tags->lock);
+	set_destroy(&tags->set);
+	tags->set = set;
+	tags->gen = gen;
+	tags->valid = TRUE;
+	g_mutex_unlock(tags->lock);
+	rollback(state->hoard);
+	pk_log(LOG_INFO, "Loaded %u hoard tags (generation %"PRIu64")",
+				count, gen);
+	return;
+
+bad:
+	set_destroy(&set);
+	retry = query_busy(tags->db);
+	rollback(tags->db);
+	if (retry) {
+		query_backoff(tags->db);
+		goto again;
+	}
+}
+
+static gpointer rebuilder(gpointer data)
+{
+	struct pk_state *state = data;
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	g_mutex_lock(tags->lock);
+	while (1) {
+		while (!tags->rebuild_wanted && !tags->stopping)
+			g_cond_wait(tags->cond, tags->lock);
+		if (tags->stopping)
+			break;
+		tags->rebuild_wanted = FALSE;
+		g_mutex_unlock(tags->lock);
+		rebuild(state);
+		g_mutex_lock(tags->lock);
+	}
+	g_mutex_unlock(tags->lock);
+	return NULL;
+}
+
+/* Ask the rebuild thread to reload the index if it's stale and hasn't been
+   rebuilt recently.  Doesn't wait for the rebuild; until it's done,
+   lookups return PK_BUSY and callers use SQL. */
+void hoard_tags_refresh(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+	time_t now;
+
+	if (tags == NULL || tags->thread == NULL)
+		return;
+	g_mutex_lock(tags->lock);
+	if (!index_usable(tags) && !tags->rebuild_wanted) {
+		now = time(NULL);
+		if (now - tags->last_rebuild >= TAGS_REBUILD_INTERVAL) {
+			tags->last_rebuild = now;
+			tags->rebuild_wanted = TRUE;
+			g_cond_signal(tags->cond);
+		}
+	}
+	g_mutex_unlock(tags->lock);
+}
+
+/* Returns PK_SUCCESS if @tag is in the hoard cache, PK_NOTFOUND if it is
+   not, or PK_BUSY if the index is stale and the caller must ask SQL */
+pk_err_t hoard_tags_lookup(struct pk_state *state, const void *tag,
+			int *offset, int *length)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+	struct tag_entry *ent;
+	pk_err_t ret;
+
+	if (tags == NULL || !tags->hashlen)
+		return PK_BUSY;
+	g_mutex_lock(tags->lock);
+	if (!index_usable(tags)) {
+		ret = PK_BUSY;
+	} else if ((ent = set_lookup(&tags->set, tag)) != NULL) {
+		if (offset)
+			*offset = ent->offset;
+		if (length)
+			*length = ent->length;
+		ret = PK_SUCCESS;
+	} else {
+		ret = PK_NOTFOUND;
+	}
+	g_mutex_unlock(tags->lock);
+	return ret;
+}
+
+/* Record a chunk added to our slot cache, which no one else can see */
+void hoard_tags_add(struct pk_state *state, const void *tag, int offset,
+			int length)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	if (tags == NULL || !tags->hashlen)
+		return;
+	g_mutex_lock(tags->lock);
+	if (tags->valid)
+		set_add(&tags->set, tag, tags->hashlen, offset, length);
+	g_mutex_unlock(tags->lock);
+}
+
+/* Record that @tag is no longer in our slot cache or the chunks table.
+   The Bloom filter bits stay set until the next rebuild. */
+void hoard_tags_remove(struct pk_state *state, const void *tag)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	if (tags == NULL || !tags->hashlen)
+		return;
+	g_mutex_lock(tags->lock);
+	if (tags->valid)
+		g_hash_table_remove(tags->set.entries, tag);
+	g_mutex_unlock(tags->lock);
+}
+
+/* Called within a hoard transaction which changes the chunks table, after
+   the change has been reflected in our own index with hoard_tags_add()
+   and hoard_tags_remove().  Other processes' indexes become stale; ours
+   stays valid unless someone else has changed the table in the meantime. */
+void hoard_tags_bump(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+	uint64_t old;
+
+	if (tags == NULL)
+		return;
+	g_mutex_lock(tags->lock);
+	old = __sync_fetch_and_add(tags->shared_gen, 1);
+	if (tags->gen == old)
+		tags->gen = old + 1;
+	g_mutex_unlock(tags->lock);
+}
+
+/* Called within a transaction which changes tags in the chunks table in
+   ways the index can't follow.  Every index, including ours, becomes
+   stale. */
+void hoard_tags_changed(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	if (tags == NULL)
+		return;
+	__sync_fetch_and_add(tags->shared_gen, 1);
+}
+
+pk_err_t hoard_tags_init(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags;
+	struct stat st;
+	void *map;
+	GError *err = NULL;
+
+	tags = g_slice_new0(struct pk_hoard_tags);
+	tags->gen_fd = open(state->conf->hoard_gen, O_RDWR|O_CREAT, 0666);
+	if (tags->gen_fd == -1) {
+		pk_log(LOG_ERROR, "Couldn't open %s: %s",
+					state->conf->hoard_gen,
+					strerror(errno));
+		goto bad;
+	}
+	/* Extending the file is idempotent, so it's safe if someone else
+	   does it at the same time */
+	if (fstat(tags->gen_fd, &st) || (st.st_size < (off_t) sizeof(uint64_t)
+				&& ftruncate(tags->gen_fd,
+				sizeof(uint64_t)))) {
+		pk_log(LOG_ERROR, "Couldn't initialize %s",
+					state->conf->hoard_gen);
+		goto bad_close;
+	}
+	map = mmap(NULL, sizeof(uint64_t), PROT_READ|PROT_WRITE, MAP_SHARED,
+				tags->gen_fd, 0);
+	if (map == MAP_FAILED) {
+		pk_log(LOG_ERROR, "Couldn't map %s", state->conf->hoard_gen);
+		goto bad_close;
+	}
+	tags->shared_gen = map;
+	tags->lock = g_mutex_new();
+	/* We can only index tags if we know what they look like, and the
+	   Bloom filter needs a 32-bit word of tag for each hash function */
+	if (state->parcel != NULL) {
+		index_hashlen = state->parcel->hashlen;
+		if (index_hashlen >= 4 * (BLOOM_HASHES + 1))
+			tags->hashlen = index_hashlen;
+	}
+	state->hoard_tags = tags;
+	if (!tags->hashlen)
+		return PK_SUCCESS;
+
+	if (!sql_conn_open(state->conf->hoard_index, &tags->db)) {
+		pk_log(LOG_ERROR, "Couldn't open hoard index for tag index "
+					"rebuilds");
+		goto bad_shutdown;
+	}
+	tags->cond = g_cond_new();
+	tags->thread = g_thread_create(rebuilder, state, TRUE, &err);
+	if (tags->thread == NULL) {
+		pk_log(LOG_ERROR, "Couldn't create tag index thread: %s",
+					err->message);
+		g_clear_error(&err);
+		goto bad_shutdown;
+	}
+	return PK_SUCCESS;
+
+bad_shutdown:
+	hoard_tags_shutdown(state);
+	return PK_IOERR;
+bad_close:
+	close(tags->gen_fd);
+bad:
+	g_slice_free(struct pk_hoard_tags, tags);
+	return PK_IOERR;
+}
+
+/* Stop the rebuild thread, which reads our slot cache.  The index stays
+   usable until hoard_tags_shutdown() but is no longer rebuilt. */
+void hoard_tags_stop(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	if (tags == NULL || tags->thread == NULL)
+		return;
+	g_mutex_lock(tags->lock);
+	tags->stopping = TRUE;
+	g_cond_signal(tags->cond);
+	g_mutex_unlock(tags->lock);
+	/* Cut short any scan in progress */
+	query_interrupt(tags->db);
+	g_thread_join(tags->thread);
+	tags->thread = NULL;
+}
+
+void hoard_tags_shutdown(struct pk_state *state)
+{
+	struct pk_hoard_tags *tags = state->hoard_tags;
+
+	if (tags == NULL)
+		return;
+	hoard_tags_stop(state);
+	if (tags->cond != NULL)
+		g_cond_free(tags->cond);
+	if (tags->db != NULL)
+		sql_conn_close(tags->db);
+	state->hoard_tags = NULL;
+	set_destroy(&tags->set);
+	g_mutex_free(tags->lock);
+	munmap((void *) tags->shared_gen, sizeof(uint64_t));
+	close(tags->gen_fd);
+	g_slice_free(struct pk_hoard_tags, tags);
+}
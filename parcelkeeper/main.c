@@ -34,7 +34,10 @@ int main(int argc, char **argv)
 	int sig;
 	int have_cache=0;
 	int have_hoard=0;
+	int have_compactor=0;
 	int have_transport=0;
+	int have_prefetch=0;
+	int have_profile=0;
 	int have_fuse=0;
 	int have_lock=0;
 	pk_err_t err;
@@ -110,6 +113,13 @@ int main(int argc, char **argv)
 			have_hoard=1;
 	}
 
+	if ((mode == MODE_RUN || mode == MODE_HOARD) && have_hoard) {
+		if (hoard_compactor_init(&state))
+			goto shutdown;
+		else
+			have_compactor=1;
+	}
+
 	if (state.conf->flags & WANT_TRANSPORT) {
 		if (transport_init())
 			goto shutdown;
@@ -117,6 +127,23 @@ int main(int argc, char **argv)
 		if (state.cpool == NULL)
 			goto shutdown;
 		have_transport=1;
+		if (mode == MODE_RUN)
+			transport_warm(state.cpool);
+	}
+
+	if (mode == MODE_RUN && have_hoard) {
+		if (profile_init(&state))
+			goto shutdown;
+		else
+			have_profile=1;
+	}
+
+	if (mode == MODE_RUN && state.conf->hoard_dir != NULL &&
+				state.conf->prefetch > 0) {
+		if (prefetch_init(&state))
+			goto shutdown;
+		else
+			have_prefetch=1;
 	}
 
 	if (mode == MODE_RUN) {
@@ -166,8 +193,14 @@ shutdown:
 	interrupter_clear();
 	if (have_fuse)
 		fuse_shutdown(&state);
+	if (have_prefetch)
+		prefetch_shutdown(&state);
 	if (have_transport)
 		transport_pool_free(state.cpool);
+	if (have_profile)
+		profile_shutdown(&state);
+	if (have_compactor)
+		hoard_compactor_shutdown(&state);
 	if (have_hoard)
 		hoard_shutdown(&state);
 	if (have_cache)
@@ -0,0 +1,345 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Miss-driven spatial prefetch.  When a chunk has to be fetched from the
+   network, guest access is likely to touch its neighbours soon afterward,
+   so we queue background fetches of nearby chunks into the hoard cache.
+   Prefetched data goes only to the hoard cache, never to the decrypted
+   chunk cache, so a bad guess costs bandwidth and hoard space but does not
+   evict anything the guest is using.
+
+   When the pool is otherwise idle, we also work through the parcel's
+   access profile, fetching the chunks that earlier sessions read first. */
+
+#include <string.h>
+#include "defs.h"
+
+#define PREFETCH_THREADS 2
+#define PREFETCH_MAX_QUEUED 64
+/* Number of prefetched-but-unused chunks we remember for accuracy
+   accounting.  Older ones are assumed to have been useless. */
+#define PREFETCH_TRACK_MAX 4096
+/* Number of completed prefetches between radius adjustments */
+#define PREFETCH_ADAPT_INTERVAL 32
+/* Maximum number of profiled chunks we prefetch per session */
+#define PREFETCH_PROFILE_MAX 16384
+
+enum prefetch_chunk_state {
+	PF_QUEUED = 1,
+	PF_FETCHED,
+	PF_PROFILE,
+};
+
+struct pk_prefetch {
+	GThreadPool *pool;
+	GMutex *lock;
+	/* chunk -> enum prefetch_chunk_state, offset by one so that chunk 0
+	   isn't a NULL key */
+	GHashTable *chunks;
+	/* Fetched chunks that have not yet been used, oldest first */
+	GQueue *fetched;
+	/* Chunks from the access profile, and the next one to queue */
+	GArray *profile;
+	unsigned profile_next;
+	unsigned max_radius;
+	unsigned radius;
+	unsigned window_fetched;
+	unsigned window_used;
+	gboolean stopping;
+};
+
+#define CHUNK_KEY(chunk) GUINT_TO_POINTER((chunk) + 1)
+#define KEY_CHUNK(key) (GPOINTER_TO_UINT(key) - 1)
+
+/* Lock must be held */
+static void adapt_radius(struct pk_state *state)
+{
+	struct pk_prefetch *pf = state->prefetch;
+	unsigned old = pf->radius;
+
+	if (pf->window_fetched < PREFETCH_ADAPT_INTERVAL)
+		return;
+	/* Below 25% accuracy we're mostly wasting bandwidth, so back off
+	   quickly.  Above 50%, probe a wider radius. */
+	if (pf->window_used * 4 < pf->window_fetched)
+		pf->radius = MAX(1, pf->radius / 2);
+	else if (pf->window_used * 2 > pf->window_fetched)
+		pf->radius = MIN(pf->max_radius, pf->radius + 1);
+	if (pf->radius != old)
+		pk_log(LOG_TRANSPORT, "Prefetch radius %u -> %u (%u/%u used)",
+					old, pf->radius, pf->window_used,
+					pf->window_fetched);
+	pf->window_fetched = 0;
+	pf->window_used = 0;
+}
+
+/* Look up the tag for @chunk, provided that the chunk has not been modified
+   locally.  A modified chunk has a tag that the server has never seen. */
+static pk_err_t get_fetchable_tag(struct pk_state *state, unsigned chunk,
+			void *tag)
+{
+	struct query *qry;
+	void *rowtag;
+	unsigned taglen;
+	pk_err_t ret;
+	gboolean retry;
+
+again:
+	if (!begin(state->db))
+		return PK_IOERR;
+	query(&qry, state->db, "SELECT keys.tag FROM keys LEFT JOIN "
+				"cache.chunks ON keys.chunk == "
+				"cache.chunks.chunk WHERE keys.chunk == ? AND "
+				"cache.chunks.chunk ISNULL", "d", chunk);
+	if (query_ok(state->db)) {
+		ret = PK_NOTFOUND;
+	} else if (query_has_row(state->db)) {
+		query_row(qry, "b", &rowtag, &taglen);
+		if (taglen == state->parcel->hashlen) {
+			memcpy(tag, rowtag, taglen);
+			ret = PK_SUCCESS;
+		} else {
+			ret = PK_INVALID;
+		}
+		query_free(qry);
+	} else {
+		sql_log_err(state->db, "Couldn't query keyring");
+		goto bad;
+	}
+	rollback(state->db);
+	return ret;
+
+bad:
+	retry = query_busy(state->db);
+	rollback(state->db);
+	if (retry) {
+		query_backoff(state->db);
+		goto again;
+	}
+	return PK_IOERR;
+}
+
+/* Lock must be held.  Keep the pool busy with chunks from the access
+   profile, but queue no more than one per thread so that chunks near a
+   demand miss don't have to wait behind them. */
+static void queue_profile(struct pk_state *state)
+{
+	struct pk_prefetch *pf = state->prefetch;
+	unsigned chunk;
+
+	if (pf->profile == NULL || pf->stopping)
+		return;
+	while (pf->profile_next < pf->profile->len &&
+				g_thread_pool_unprocessed(pf->pool) <
+				PREFETCH_THREADS) {
+		chunk = g_array_index(pf->profile, unsigned,
+					pf->profile_next++);
+		if (g_hash_table_lookup(pf->chunks, CHUNK_KEY(chunk)))
+			continue;
+		g_hash_table_insert(pf->chunks, CHUNK_KEY(chunk),
+					GINT_TO_POINTER(PF_PROFILE));
+		g_thread_pool_push(pf->pool, CHUNK_KEY(chunk), NULL);
+	}
+}
+
+static void prefetch_worker(void *data, void *user_data)
+{
+	struct pk_state *state = user_data;
+	struct pk_prefetch *pf = state->prefetch;
+	unsigned chunk = KEY_CHUNK(data);
+	char tag[state->parcel->hashlen];
+	void *buf;
+	unsigned len;
+	gboolean fetched = FALSE;
+	gboolean profiled;
+
+	g_mutex_lock(pf->lock);
+	if (pf->stopping) {
+		g_hash_table_remove(pf->chunks, data);
+		g_mutex_unlock(pf->lock);
+		return;
+	}
+	profiled = GPOINTER_TO_INT(g_hash_table_lookup(pf->chunks, data)) ==
+				PF_PROFILE;
+	g_mutex_unlock(pf->lock);
+
+	if (!get_fetchable_tag(state, chunk, tag) &&
+				!cache_zero_data(state, tag, NULL) &&
+				!hoard_has_chunk(state, tag)) {
+		pk_log(LOG_TRANSPORT, "Prefetching chunk %u", chunk);
+		buf = chunk_buf_alloc(state->parcel);
+		/* transport_fetch_chunk() hoards the chunk but doesn't
+		   report whether that succeeded, and a prefetched chunk
+		   that wasn't hoarded has been fetched for nothing */
+		if (!transport_fetch_chunk(state->cpool, buf, chunk, tag,
+					&len)) {
+			fetched = hoard_has_chunk(state, tag);
+			if (!fetched)
+				pk_log(LOG_ERROR, "Couldn't hoard prefetched "
+							"chunk %u", chunk);
+		}
+		chunk_buf_free(buf);
+	}
+
+	g_mutex_lock(pf->lock);
+	if (fetched && profiled) {
+		/* Not a guess, so not counted toward the radius */
+		g_hash_table_remove(pf->chunks, data);
+	} else if (fetched) {
+		g_hash_table_replace(pf->chunks, data,
+					GINT_TO_POINTER(PF_FETCHED));
+		g_queue_push_tail(pf->fetched, data);
+		if (g_queue_get_length(pf->fetched) > PREFETCH_TRACK_MAX)
+			g_hash_table_remove(pf->chunks,
+						g_queue_pop_head(pf->fetched));
+		pf->window_fetched++;
+		adapt_radius(state);
+	} else {
+		g_hash_table_remove(pf->chunks, data);
+	}
+	queue_profile(state);
+	g_mutex_unlock(pf->lock);
+	if (fetched && profiled)
+		stats_increment(state, profile_fetched, 1);
+	else if (fetched)
+		stats_increment(state, prefetch_fetched, 1);
+}
+
+/* Lock must be held */
+static void queue_chunk(struct pk_state *state, unsigned chunk)
+{
+	struct pk_prefetch *pf = state->prefetch;
+
+	if (g_hash_table_lookup(pf->chunks, CHUNK_KEY(chunk)))
+		return;
+	if (g_thread_pool_unprocessed(pf->pool) >= PREFETCH_MAX_QUEUED)
+		return;
+	g_hash_table_insert(pf->chunks, CHUNK_KEY(chunk),
+				GINT_TO_POINTER(PF_QUEUED));
+	g_thread_pool_push(pf->pool, CHUNK_KEY(chunk), NULL);
+}
+
+/* Called after a demand fetch of @chunk from the network */
+void prefetch_miss(struct pk_state *state, unsigned chunk)
+{
+	struct pk_prefetch *pf = state->prefetch;
+	unsigned i;
+
+	if (pf == NULL)
+		return;
+	g_mutex_lock(pf->lock);
+	if (!pf->stopping) {
+		/* Favor the forward direction */
+		for (i = 1; i <= pf->radius; i++)
+			if (chunk + i < state->parcel->chunks)
+				queue_chunk(state, chunk + i);
+		for (i = 1; i <= pf->radius && i <= chunk; i++)
+			queue_chunk(state, chunk - i);
+	}
+	g_mutex_unlock(pf->lock);
+}
+
+/* Called when @chunk was found in the hoard cache on a demand read */
+void prefetch_hit(struct pk_state *state, unsigned chunk)
+{
+	struct pk_prefetch *pf = state->prefetch;
+	gboolean used = FALSE;
+
+	if (pf == NULL)
+		return;
+	g_mutex_lock(pf->lock);
+	if (GPOINTER_TO_INT(g_hash_table_lookup(pf->chunks,
+				CHUNK_KEY(chunk))) == PF_FETCHED) {
+		g_hash_table_remove(pf->chunks, CHUNK_KEY(chunk));
+		g_queue_remove(pf->fetched, CHUNK_KEY(chunk));
+		pf->window_used++;
+		used = TRUE;
+	}
+	g_mutex_unlock(pf->lock);
+	if (used)
+		stats_increment(state, prefetch_used, 1);
+}
+
+unsigned prefetch_get_radius(struct pk_state *state)
+{
+	struct pk_prefetch *pf = state->prefetch;
+	unsigned ret;
+
+	if (pf == NULL)
+		return 0;
+	g_mutex_lock(pf->lock);
+	ret = pf->radius;
+	g_mutex_unlock(pf->lock);
+	return ret;
+}
+
+pk_err_t prefetch_init(struct pk_state *state)
+{
+	struct pk_prefetch *pf;
+	GError *err = NULL;
+
+	pf = g_slice_new0(struct pk_prefetch);
+	pf->lock = g_mutex_new();
+	pf->chunks = g_hash_table_new(g_direct_hash, g_direct_equal);
+	pf->fetched = g_queue_new();
+	pf->max_radius = state->conf->prefetch;
+	pf->radius = pf->max_radius;
+	pf->pool = g_thread_pool_new(prefetch_worker, state, PREFETCH_THREADS,
+				FALSE, &err);
+	if (pf->pool == NULL) {
+		pk_log(LOG_ERROR, "Couldn't create prefetch thread pool: %s",
+					err->message);
+		g_clear_error(&err);
+		g_queue_free(pf->fetched);
+		g_hash_table_destroy(pf->chunks);
+		g_mutex_free(pf->lock);
+		g_slice_free(struct pk_prefetch, pf);
+		return PK_CALLFAIL;
+	}
+	state->prefetch = pf;
+	pk_log(LOG_INFO, "Prefetch radius: %u chunks", pf->max_radius);
+	if (state->conf->parcel_dir != NULL &&
+				!profile_get_order(state, PREFETCH_PROFILE_MAX,
+				&pf->profile)) {
+		pk_log(LOG_INFO, "Prefetching %u profiled chunks",
+					pf->profile->len);
+		g_mutex_lock(pf->lock);
+		queue_profile(state);
+		g_mutex_unlock(pf->lock);
+	}
+	return PK_SUCCESS;
+}
+
+void prefetch_shutdown(struct pk_state *state)
+{
+	struct pk_prefetch *pf = state->prefetch;
+
+	if (pf == NULL)
+		return;
+	g_mutex_lock(pf->lock);
+	pf->stopping = TRUE;
+	g_mutex_unlock(pf->lock);
+	/* Drop queued work and wait for in-progress fetches */
+	g_thread_pool_free(pf->pool, TRUE, TRUE);
+	state->prefetch = NULL;
+	if (pf->profile != NULL)
+		g_array_free(pf->profile, TRUE);
+	g_queue_free(pf->fetched);
+	g_hash_table_destroy(pf->chunks);
+	g_mutex_free(pf->lock);
+	g_slice_free(struct pk_prefetch, pf);
+}
@@ -0,0 +1,180 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Chunk access profile.  During a run, we record the order in which the
+   guest first touches each chunk and how often it reads it.  At shutdown
+   this is merged into the parcel's profile in the hoard index, which
+   persists across checkouts, so that hoarding and background prefetch can
+   fetch the chunks the guest needs first (typically those read at boot)
+   before the rest of the parcel. */
+
+#include <string.h>
+#include "defs.h"
+
+struct pk_profile {
+	GMutex *lock;
+	guint32 *reads;		/* per chunk, this session */
+	GArray *order;		/* chunks in order of first touch */
+};
+
+pk_err_t profile_init(struct pk_state *state)
+{
+	struct pk_profile *prof;
+
+	prof = g_slice_new0(struct pk_profile);
+	prof->lock = g_mutex_new();
+	prof->reads = g_new0(guint32, state->parcel->chunks);
+	prof->order = g_array_new(FALSE, FALSE, sizeof(unsigned));
+	state->profile = prof;
+	return PK_SUCCESS;
+}
+
+/* Called for every chunk read by the guest */
+void profile_touch(struct pk_state *state, unsigned chunk)
+{
+	struct pk_profile *prof = state->profile;
+
+	if (prof == NULL || chunk >= state->parcel->chunks)
+		return;
+	g_mutex_lock(prof->lock);
+	if (prof->reads[chunk]++ == 0)
+		g_array_append_val(prof->order, chunk);
+	g_mutex_unlock(prof->lock);
+}
+
+/* Must be within transaction.  Each chunk's first-touch position is the
+   average of its position in this session and its previous value, so that
+   one unusual session doesn't reorder the whole profile.  Read counts
+   decay by half each session. */
+static pk_err_t _profile_save(struct pk_state *state)
+{
+	struct pk_profile *prof = state->profile;
+	unsigned chunk;
+	unsigned i;
+
+	if (!query(NULL, state->hoard, "UPDATE access_profile SET "
+				"reads = reads / 2 WHERE parcel == ?", "d",
+				state->hoard_ident)) {
+		sql_log_err(state->hoard, "Couldn't age access profile");
+		return PK_IOERR;
+	}
+	for (i = 0; i < prof->order->len; i++) {
+		chunk = g_array_index(prof->order, unsigned, i);
+		if (!query(NULL, state->hoard, "INSERT OR IGNORE INTO "
+					"access_profile (parcel, chunk, "
+					"first_touch, reads) VALUES "
+					"(?, ?, ?, 0)", "ddd",
+					state->hoard_ident, chunk, i)) {
+			sql_log_err(state->hoard, "Couldn't add chunk %u to "
+						"access profile", chunk);
+			return PK_IOERR;
+		}
+		if (!query(NULL, state->hoard, "UPDATE access_profile SET "
+					"first_touch = (first_touch + ?) / 2, "
+					"reads = reads + ? WHERE parcel == ? "
+					"AND chunk == ?", "dddd", i,
+					prof->reads[chunk], state->hoard_ident,
+					chunk)) {
+			sql_log_err(state->hoard, "Couldn't update access "
+						"profile for chunk %u", chunk);
+			return PK_IOERR;
+		}
+	}
+	return PK_SUCCESS;
+}
+
+static void profile_save(struct pk_state *state)
+{
+	gboolean retry;
+
+again:
+	if (!begin(state->hoard))
+		return;
+	if (_profile_save(state))
+		goto bad;
+	if (!commit(state->hoard))
+		goto bad;
+	pk_log(LOG_INFO, "Recorded access profile for %u chunks",
+				state->profile->order->len);
+	return;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	if (retry) {
+		query_backoff(state->hoard);
+		goto again;
+	}
+	pk_log(LOG_ERROR, "Couldn't save access profile");
+}
+
+void profile_shutdown(struct pk_state *state)
+{
+	struct pk_profile *prof = state->profile;
+
+	if (prof->order->len)
+		profile_save(state);
+	state->profile = NULL;
+	g_array_free(prof->order, TRUE);
+	g_free(prof->reads);
+	g_mutex_free(prof->lock);
+	g_slice_free(struct pk_profile, prof);
+}
+
+/* Return up to @max chunks from the parcel's stored profile, most urgent
+   first.  The caller must free the array. */
+pk_err_t profile_get_order(struct pk_state *state, unsigned max,
+			GArray **chunks)
+{
+	struct query *qry;
+	unsigned chunk;
+	gboolean retry;
+
+	*chunks = g_array_new(FALSE, FALSE, sizeof(unsigned));
+again:
+	if (!begin(state->hoard))
+		goto bad_free;
+	for (query(&qry, state->hoard, "SELECT chunk FROM access_profile "
+				"WHERE parcel == ? ORDER BY first_touch, "
+				"reads DESC, chunk LIMIT ?", "dd",
+				state->hoard_ident, max);
+				query_has_row(state->hoard); query_next(qry)) {
+		query_row(qry, "d", &chunk);
+		if (chunk < state->parcel->chunks)
+			g_array_append_val(*chunks, chunk);
+	}
+	query_free(qry);
+	if (!query_ok(state->hoard)) {
+		sql_log_err(state->hoard, "Couldn't read access profile");
+		goto bad;
+	}
+	rollback(state->hoard);
+	return PK_SUCCESS;
+
+bad:
+	retry = query_busy(state->hoard);
+	rollback(state->hoard);
+	if (retry) {
+		query_backoff(state->hoard);
+		g_array_set_size(*chunks, 0);
+		goto again;
+	}
+bad_free:
+	g_array_free(*chunks, TRUE);
+	*chunks = NULL;
+	return PK_IOERR;
+}
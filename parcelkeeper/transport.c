@@ -16,44 +16,52 @@
  */
 
 #include <string.h>
-#include <stdlib.h>
 #include <unistd.h>
-#include <curl/curl.h>
+#include <time.h>
 #include "defs.h"
+#include "transport_defs.h"
 
 #define TRANSPORT_TRIES 5
 #define TRANSPORT_RETRY_DELAY 5
+/* Number of connections to open in advance of the first miss */
+#define TRANSPORT_WARM_CONNS 4
 
-struct pk_connection_pool {
-	struct pk_state *state;
-	GList *conns;
-	GMutex *lock;
+static const struct pk_transport_backend *backends[] = {
+	&transport_file,
+	&transport_unix,
+	&transport_http,  /* must be last */
+	NULL
 };
 
-struct pk_connection {
-	struct pk_connection_pool *pool;
-	CURL *curl;
-	char errbuf[CURL_ERROR_SIZE];
-	char *buf;
-	size_t offset;
-};
-
-static size_t curl_callback(void *data, size_t size, size_t nmemb,
-			void *private)
+/* Copy @len bytes of @data into the transfer buffer.  Returns the number
+   of bytes accepted, which will be less than @len if the chunk would
+   exceed the chunk size. */
+size_t transport_sink_copy(struct pk_connection *conn, const void *data,
+			size_t len)
 {
-	struct pk_connection *conn=private;
-	size_t count = MIN(size * nmemb, conn->pool->state->parcel->chunksize -
+	size_t count = MIN(len, conn->pool->state->parcel->chunksize -
 				conn->offset);
 
 	memcpy(conn->buf + conn->offset, data, count);
-	conn->offset += count;
+	transport_sink_commit(conn, count);
 	return count;
 }
 
+/* The backend has placed @len bytes directly into the transfer buffer at
+   the current offset.  Hash the data while it is still in the CPU cache,
+   rather than making a second pass over the chunk after the transfer
+   completes. */
+void transport_sink_commit(struct pk_connection *conn, size_t len)
+{
+	iu_chunk_digest_update(conn->digest, conn->buf + conn->offset, len);
+	conn->offset += len;
+}
+
 static void transport_conn_free(struct pk_connection *conn)
 {
-	if (conn->curl)
-		curl_easy_cleanup(conn->curl);
+	if (conn->pool->backend->conn_free)
+		conn->pool->backend->conn_free(conn);
+	iu_chunk_digest_free(conn->digest);
 	g_slice_free(struct pk_connection, conn);
 }
 
@@ -64,41 +72,13 @@ static struct pk_connection *transport_conn_alloc(
 
 	conn=g_slice_new0(struct pk_connection);
 	conn->pool=pool;
-	conn->curl=curl_easy_init();
-	if (conn->curl == NULL) {
-		pk_log(LOG_ERROR, "Couldn't initialize CURL handle");
-		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_NOPROGRESS, 1)) {
-		pk_log(LOG_ERROR, "Couldn't disable curl progress meter");
-		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1)) {
-		pk_log(LOG_ERROR, "Couldn't disable signals");
-		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION,
-				curl_callback)) {
-		pk_log(LOG_ERROR, "Couldn't set write callback");
-		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, conn)) {
-		pk_log(LOG_ERROR, "Couldn't set write callback data");
-		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, conn->errbuf)) {
-		pk_log(LOG_ERROR, "Couldn't set error buffer");
+	conn->digest = iu_chunk_digest_new(pool->state->parcel->crypto);
+	if (conn->digest == NULL) {
+		pk_log(LOG_ERROR, "Couldn't allocate digest context");
 		goto bad;
 	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_FAILONERROR, 1)) {
-		pk_log(LOG_ERROR, "Couldn't set fail-on-error flag");
+	if (pool->backend->conn_init && pool->backend->conn_init(conn))
 		goto bad;
-	}
-	if (curl_easy_setopt(conn->curl, CURLOPT_MAXFILESIZE,
-				pool->state->parcel->chunksize)) {
-		pk_log(LOG_ERROR, "Couldn't set maximum transfer size");
-		goto bad;
-	}
 	return conn;
 
 bad:
@@ -110,9 +90,31 @@ static struct pk_connection *transport_conn_get(
 			struct pk_connection_pool *cpool)
 {
 	struct pk_connection *conn;
+	GList *idle = NULL;
 	GList *el;
+	time_t now = time(NULL);
 
 	g_mutex_lock(cpool->lock);
+	/* The list is in MRU order, so idle connections are at the end.
+	   Backends which share network connections between handles must
+	   also expire the shared connections themselves, since freeing a
+	   handle doesn't close them. */
+	while ((el = g_list_last(cpool->conns)) != NULL) {
+		conn = el->data;
+		if (now - conn->idle_since < TRANSPORT_IDLE_TIMEOUT)
+			break;
+		cpool->conns = g_list_delete_link(cpool->conns, el);
+		idle = g_list_prepend(idle, conn);
+	}
+	if (idle != NULL) {
+		g_mutex_unlock(cpool->lock);
+		pk_log(LOG_TRANSPORT, "Closing %u idle connections",
+					g_list_length(idle));
+		for (el = idle; el != NULL; el = g_list_next(el))
+			transport_conn_free(el->data);
+		g_list_free(idle);
+		g_mutex_lock(cpool->lock);
+	}
 	el = g_list_first(cpool->conns);
 	if (el != NULL) {
 		conn = el->data;
@@ -129,6 +131,7 @@ static void transport_conn_put(struct pk_connection *conn)
 {
 	struct pk_connection_pool *cpool = conn->pool;
 
+	conn->idle_since = time(NULL);
 	g_mutex_lock(cpool->lock);
 	cpool->conns = g_list_prepend(conn->pool->conns, conn);
 	g_mutex_unlock(cpool->lock);
@@ -136,81 +139,134 @@ static void transport_conn_put(struct pk_connection *conn)
 
 pk_err_t transport_init(void)
 {
-	if (curl_global_init(CURL_GLOBAL_ALL)) {
-		pk_log(LOG_ERROR, "Couldn't initialize curl library");
-		return PK_CALLFAIL;
-	}
-	return PK_SUCCESS;
+	return transport_http_init();
 }
 
 struct pk_connection_pool *transport_pool_alloc(struct pk_state *state)
 {
 	struct pk_connection_pool *cpool;
+	int i;
 
 	cpool = g_slice_new0(struct pk_connection_pool);
 	cpool->state = state;
 	cpool->lock = g_mutex_new();
+	for (i = 0; backends[i] != NULL; i++) {
+		if (backends[i]->handles(state->parcel->master)) {
+			cpool->backend = backends[i];
+			break;
+		}
+	}
+	g_assert(cpool->backend != NULL);
+	pk_log(LOG_INFO, "Chunk source: %s (%s)", state->parcel->master,
+				cpool->backend->name);
+	if (cpool->backend->pool_init && cpool->backend->pool_init(cpool)) {
+		g_mutex_free(cpool->lock);
+		g_slice_free(struct pk_connection_pool, cpool);
+		return NULL;
+	}
 	return cpool;
 }
 
+static void *transport_warm_thread(void *data)
+{
+	struct pk_connection_pool *cpool = data;
+	struct pk_connection *conn;
+
+	if (transport_pool_stopping(cpool))
+		return NULL;
+	conn = transport_conn_alloc(cpool);
+	if (conn == NULL)
+		return NULL;
+	if (cpool->backend->warm(conn)) {
+		transport_conn_free(conn);
+		return NULL;
+	}
+	transport_conn_put(conn);
+	return NULL;
+}
+
+/* Open connections to the chunk source in the background, so that the
+   first burst of misses after startup doesn't pay for connection setup
+   serially. */
+void transport_warm(struct pk_connection_pool *cpool)
+{
+	GThread *thr;
+	GError *err = NULL;
+	int i;
+
+	if (cpool->backend->warm == NULL)
+		return;
+	pk_log(LOG_TRANSPORT, "Opening %d connections in advance",
+				TRANSPORT_WARM_CONNS);
+	for (i = 0; i < TRANSPORT_WARM_CONNS; i++) {
+		thr = g_thread_create(transport_warm_thread, cpool, TRUE,
+					&err);
+		if (thr == NULL) {
+			/* Not fatal; connections will be opened on demand */
+			pk_log(LOG_ERROR, "Couldn't create connection thread: "
+						"%s", err->message);
+			g_clear_error(&err);
+			break;
+		}
+		cpool->warm_threads = g_list_prepend(cpool->warm_threads,
+					thr);
+	}
+}
+
+/* Backends poll this during warm-up, so that shutdown doesn't have to
+   wait for a slow server */
+gboolean transport_pool_stopping(struct pk_connection_pool *cpool)
+{
+	gboolean ret;
+
+	g_mutex_lock(cpool->lock);
+	ret = cpool->stopping;
+	g_mutex_unlock(cpool->lock);
+	return ret;
+}
+
 void transport_pool_free(struct pk_connection_pool *cpool)
 {
 	GList *el;
 
+	g_mutex_lock(cpool->lock);
+	cpool->stopping = TRUE;
+	g_mutex_unlock(cpool->lock);
+	/* Warm-up threads abort their requests once they see the flag */
+	for (el = g_list_first(cpool->warm_threads); el != NULL;
+				el = g_list_next(el))
+		g_thread_join(el->data);
+	g_list_free(cpool->warm_threads);
+
 	for (el = g_list_first(cpool->conns); el != NULL;
 				el = g_list_next(el))
 		transport_conn_free(el->data);
 	g_list_free(cpool->conns);
+	if (cpool->backend->pool_free)
+		cpool->backend->pool_free(cpool);
 	g_mutex_free(cpool->lock);
 	g_slice_free(struct pk_connection_pool, cpool);
 }
 
+/* On return, @tag contains the digest of whatever was received, even if
+   the transfer failed; this also resets the connection's digest context. */
 static pk_err_t transport_get(struct pk_connection_pool *cpool, void *buf,
-			unsigned chunk, size_t *len)
+			unsigned chunk, size_t *len, void *tag)
 {
 	struct pk_connection *conn;
-	gchar *url;
 	pk_err_t ret;
-	CURLcode err;
 
 	conn = transport_conn_get(cpool);
 	if (conn == NULL)
 		return PK_CALLFAIL;
-	url=form_chunk_path(cpool->state->parcel, cpool->state->parcel->master,
-				chunk);
-	pk_log(LOG_TRANSPORT, "Fetching %s", url);
-	if (curl_easy_setopt(conn->curl, CURLOPT_URL, url)) {
-		pk_log(LOG_ERROR, "Couldn't set connection URL");
-		g_free(url);
-		transport_conn_put(conn);
-		return PK_CALLFAIL;
-	}
 	conn->buf=buf;
 	conn->offset=0;
-	err=curl_easy_perform(conn->curl);
-	if (err)
-		pk_log(LOG_ERROR, "Fetching %s: %s", url, conn->errbuf);
-	switch (err) {
-	case CURLE_OK:
+	xfer_increment(cpool->state, in_flight, 1);
+	ret = cpool->backend->get(conn, chunk);
+	xfer_increment(cpool->state, in_flight, -1);
+	iu_chunk_digest_final(conn->digest, tag);
+	if (ret == PK_SUCCESS)
 		*len=conn->offset;
-		ret=PK_SUCCESS;
-		break;
-	case CURLE_COULDNT_RESOLVE_PROXY:
-	case CURLE_COULDNT_RESOLVE_HOST:
-	case CURLE_COULDNT_CONNECT:
-	case CURLE_HTTP_RETURNED_ERROR:
-	case CURLE_OPERATION_TIMEOUTED:
-	case CURLE_GOT_NOTHING:
-	case CURLE_SEND_ERROR:
-	case CURLE_RECV_ERROR:
-	case CURLE_BAD_CONTENT_ENCODING:
-		ret=PK_NETFAIL;
-		break;
-	default:
-		ret=PK_IOERR;
-		break;
-	}
-	g_free(url);
 	transport_conn_put(conn);
 	return ret;
 }
@@ -220,13 +276,15 @@ pk_err_t transport_fetch_chunk(struct pk_connection_pool *cpool, void *buf,
 {
 	char calctag[cpool->state->parcel->hashlen];
 	size_t len=0;  /* Make compiler happy */
+	uint64_t start = timestamp_usec();
 	int i;
 	pk_err_t ret;
 
 	for (i=0; i<TRANSPORT_TRIES; i++) {
-		ret=transport_get(cpool, buf, chunk, &len);
+		ret=transport_get(cpool, buf, chunk, &len, calctag);
 		if (ret != PK_NETFAIL)
 			break;
+		xfer_increment(cpool->state, retries, 1);
 		pk_log(LOG_ERROR, "Fetching chunk %u failed; retrying in %d "
 					"seconds", chunk,
 					TRANSPORT_RETRY_DELAY);
@@ -234,16 +292,16 @@ pk_err_t transport_fetch_chunk(struct pk_connection_pool *cpool, void *buf,
 	}
 	if (ret != PK_SUCCESS) {
 		pk_log(LOG_ERROR, "Couldn't fetch chunk %u", chunk);
+		xfer_increment(cpool->state, failures, 1);
 		return ret;
 	}
-	if (!iu_chunk_crypto_digest(cpool->state->parcel->crypto, calctag,
-				buf, len))
-		return PK_CALLFAIL;
 	if (memcmp(tag, calctag, cpool->state->parcel->hashlen)) {
 		pk_log(LOG_ERROR, "Invalid tag for retrieved chunk %u", chunk);
 		log_tag_mismatch(tag, calctag, cpool->state->parcel->hashlen);
+		xfer_increment(cpool->state, failures, 1);
 		return PK_TAGFAIL;
 	}
+	xfer_record(cpool->state, XFER_NETWORK, len, start);
 	hoard_put_chunk(cpool->state, tag, buf, len);
 	*length=len;
 	return PK_SUCCESS;
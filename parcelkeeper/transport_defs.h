@@ -0,0 +1,83 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#ifndef PK_TRANSPORT_DEFS_H
+#define PK_TRANSPORT_DEFS_H
+
+/* Shared header for source files in the transport module.  The generic
+   code in transport.c handles connection pooling, retries, and tag
+   verification; a backend only has to move the bytes of one chunk into
+   the connection's buffer. */
+
+/* Close connections that have been idle this long (seconds), since the
+   server has probably timed them out anyway */
+#define TRANSPORT_IDLE_TIMEOUT 120
+
+struct pk_connection_pool {
+	struct pk_state *state;
+	const struct pk_transport_backend *backend;
+	void *data;		/* backend-private */
+	GList *conns;		/* most recently used first */
+	GMutex *lock;
+	GList *warm_threads;
+	gboolean stopping;
+};
+
+struct pk_connection {
+	struct pk_connection_pool *pool;
+	void *data;		/* backend-private */
+	time_t idle_since;
+
+	/* Destination of the current transfer.  Backends must deliver
+	   data through transport_sink_copy() or transport_sink_commit()
+	   so that it is hashed as it arrives. */
+	char *buf;
+	size_t offset;
+	struct iu_chunk_digest *digest;
+};
+
+struct pk_transport_backend {
+	const char *name;
+	/* Return TRUE if this backend handles the specified master URL */
+	gboolean (*handles)(const char *master);
+	/* Optional */
+	pk_err_t (*pool_init)(struct pk_connection_pool *cpool);
+	void (*pool_free)(struct pk_connection_pool *cpool);
+	pk_err_t (*conn_init)(struct pk_connection *conn);
+	void (*conn_free)(struct pk_connection *conn);
+	/* Optional.  Establish the connection to the server ahead of the
+	   first request, without transferring a chunk. */
+	pk_err_t (*warm)(struct pk_connection *conn);
+	/* Required.  Return PK_NETFAIL if a retry might succeed. */
+	pk_err_t (*get)(struct pk_connection *conn, unsigned chunk);
+};
+
+/* transport.c */
+size_t transport_sink_copy(struct pk_connection *conn, const void *data,
+			size_t len);
+void transport_sink_commit(struct pk_connection *conn, size_t len);
+gboolean transport_pool_stopping(struct pk_connection_pool *cpool);
+
+/* transport_http.c */
+pk_err_t transport_http_init(void);
+extern const struct pk_transport_backend transport_http;
+
+/* transport_local.c */
+extern const struct pk_transport_backend transport_file;
+extern const struct pk_transport_backend transport_unix;
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <curl/curl.h>
+#include "defs.h"
+#include "transport_defs.h"
+
+/* HTTP (and anything else libcurl understands) */
+
+/* Timeout for advance connection setup, in seconds */
+#define HTTP_WARM_TIMEOUT 30
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+#define HTTP_PROGRESSFUNCTION CURLOPT_XFERINFOFUNCTION
+#define HTTP_PROGRESSDATA CURLOPT_XFERINFODATA
+typedef curl_off_t progress_t;
+#else
+#define HTTP_PROGRESSFUNCTION CURLOPT_PROGRESSFUNCTION
+#define HTTP_PROGRESSDATA CURLOPT_PROGRESSDATA
+typedef double progress_t;
+#endif
+
+/* Caches shared by all handles in the pool, so that a new handle doesn't
+   repeat the DNS lookup or a full TLS handshake */
+struct http_pool {
+	CURLSH *share;
+	GMutex *locks[CURL_LOCK_DATA_LAST];
+};
+
+struct http_connection {
+	CURL *curl;
+	char errbuf[CURL_ERROR_SIZE];
+};
+
+static size_t curl_callback(void *data, size_t size, size_t nmemb,
+			void *private)
+{
+	return transport_sink_copy(private, data, size * nmemb);
+}
+
+/* Only enabled during warm-up.  Returning nonzero aborts the transfer. */
+static int warm_progress(void *private, progress_t dltotal,
+			progress_t dlnow, progress_t ultotal, progress_t ulnow)
+{
+	struct pk_connection *conn = private;
+
+	return transport_pool_stopping(conn->pool);
+}
+
+pk_err_t transport_http_init(void)
+{
+	if (curl_global_init(CURL_GLOBAL_ALL)) {
+		pk_log(LOG_ERROR, "Couldn't initialize curl library");
+		return PK_CALLFAIL;
+	}
+	return PK_SUCCESS;
+}
+
+static gboolean http_handles(const char *master)
+{
+	/* Fallback */
+	return TRUE;
+}
+
+static void http_share_lock(CURL *handle, curl_lock_data data,
+			curl_lock_access access, void *private)
+{
+	struct http_pool *hpool = private;
+
+	g_mutex_lock(hpool->locks[data]);
+}
+
+static void http_share_unlock(CURL *handle, curl_lock_data data,
+			void *private)
+{
+	struct http_pool *hpool = private;
+
+	g_mutex_unlock(hpool->locks[data]);
+}
+
+static void http_pool_free(struct pk_connection_pool *cpool)
+{
+	struct http_pool *hpool = cpool->data;
+	int i;
+
+	if (hpool->share)
+		curl_share_cleanup(hpool->share);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		g_mutex_free(hpool->locks[i]);
+	g_slice_free(struct http_pool, hpool);
+}
+
+static pk_err_t http_pool_init(struct pk_connection_pool *cpool)
+{
+	struct http_pool *hpool;
+	int i;
+
+	hpool = g_slice_new0(struct http_pool);
+	cpool->data = hpool;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		hpool->locks[i] = g_mutex_new();
+	hpool->share = curl_share_init();
+	if (hpool->share == NULL) {
+		pk_log(LOG_ERROR, "Couldn't initialize CURL share handle");
+		goto bad;
+	}
+	if (curl_share_setopt(hpool->share, CURLSHOPT_LOCKFUNC,
+				http_share_lock) ||
+				curl_share_setopt(hpool->share,
+				CURLSHOPT_UNLOCKFUNC, http_share_unlock) ||
+				curl_share_setopt(hpool->share,
+				CURLSHOPT_USERDATA, hpool)) {
+		pk_log(LOG_ERROR, "Couldn't set share handle locking");
+		goto bad;
+	}
+	if (curl_share_setopt(hpool->share, CURLSHOPT_SHARE,
+				CURL_LOCK_DATA_DNS)) {
+		pk_log(LOG_ERROR, "Couldn't share DNS cache");
+		goto bad;
+	}
+#if LIBCURL_VERSION_NUM >= 0x071700
+	/* Sharing is an optimization, so it's not fatal if libcurl was
+	   built without SSL */
+	if (curl_share_setopt(hpool->share, CURLSHOPT_SHARE,
+				CURL_LOCK_DATA_SSL_SESSION))
+		pk_log(LOG_TRANSPORT, "Couldn't share SSL session cache");
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073900
+	/* Lets a handle reuse a connection opened by another handle,
+	   including one opened by http_warm() */
+	if (curl_share_setopt(hpool->share, CURLSHOPT_SHARE,
+				CURL_LOCK_DATA_CONNECT))
+		pk_log(LOG_TRANSPORT, "Couldn't share connection cache");
+#endif
+	return PK_SUCCESS;
+
+bad:
+	http_pool_free(cpool);
+	return PK_CALLFAIL;
+}
+
+static void http_conn_free(struct pk_connection *conn)
+{
+	struct http_connection *hconn = conn->data;
+
+	if (hconn == NULL)
+		return;
+	if (hconn->curl)
+		curl_easy_cleanup(hconn->curl);
+	g_slice_free(struct http_connection, hconn);
+}
+
+static pk_err_t http_conn_init(struct pk_connection *conn)
+{
+	struct http_pool *hpool = conn->pool->data;
+	struct http_connection *hconn;
+
+	hconn=g_slice_new0(struct http_connection);
+	conn->data=hconn;
+	hconn->curl=curl_easy_init();
+	if (hconn->curl == NULL) {
+		pk_log(LOG_ERROR, "Couldn't initialize CURL handle");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_NOPROGRESS, 1)) {
+		pk_log(LOG_ERROR, "Couldn't disable curl progress meter");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_NOSIGNAL, 1)) {
+		pk_log(LOG_ERROR, "Couldn't disable signals");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_WRITEFUNCTION,
+				curl_callback)) {
+		pk_log(LOG_ERROR, "Couldn't set write callback");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_WRITEDATA, conn)) {
+		pk_log(LOG_ERROR, "Couldn't set write callback data");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_ERRORBUFFER,
+				hconn->errbuf)) {
+		pk_log(LOG_ERROR, "Couldn't set error buffer");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_FAILONERROR, 1)) {
+		pk_log(LOG_ERROR, "Couldn't set fail-on-error flag");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_MAXFILESIZE,
+				conn->pool->state->parcel->chunksize)) {
+		pk_log(LOG_ERROR, "Couldn't set maximum transfer size");
+		return PK_CALLFAIL;
+	}
+	if (curl_easy_setopt(hconn->curl, CURLOPT_SHARE, hpool->share)) {
+		pk_log(LOG_ERROR, "Couldn't set share handle");
+		return PK_CALLFAIL;
+	}
+#if LIBCURL_VERSION_NUM >= 0x071900
+	/* Keep pooled connections from being dropped by NAT boxes and
+	   stateful firewalls while the guest isn't missing */
+	if (curl_easy_setopt(hconn->curl, CURLOPT_TCP_KEEPALIVE, 1L)) {
+		pk_log(LOG_ERROR, "Couldn't enable TCP keepalive");
+		return PK_CALLFAIL;
+	}
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074100
+	/* Connections live in the shared connection cache rather than in
+	   the handle, so the pool's idle reaping doesn't close them.  Have
+	   libcurl close them instead of reusing them once they've been
+	   idle too long. */
+	if (curl_easy_setopt(hconn->curl, CURLOPT_MAXAGE_CONN,
+				(long) TRANSPORT_IDLE_TIMEOUT)) {
+		pk_log(LOG_ERROR, "Couldn't set connection idle timeout");
+		return PK_CALLFAIL;
+	}
+#endif
+	return PK_SUCCESS;
+}
+
+static pk_err_t http_get(struct pk_connection *conn, unsigned chunk)
+{
+	struct http_connection *hconn = conn->data;
+	struct pk_state *state = conn->pool->state;
+	gchar *url;
+	pk_err_t ret;
+	CURLcode err;
+
+	url=form_chunk_path(state->parcel, state->parcel->master, chunk);
+	pk_log(LOG_TRANSPORT, "Fetching %s", url);
+	if (curl_easy_setopt(hconn->curl, CURLOPT_URL, url)) {
+		pk_log(LOG_ERROR, "Couldn't set connection URL");
+		g_free(url);
+		return PK_CALLFAIL;
+	}
+	err=curl_easy_perform(hconn->curl);
+	if (err)
+		pk_log(LOG_ERROR, "Fetching %s: %s", url, hconn->errbuf);
+	switch (err) {
+	case CURLE_OK:
+		ret=PK_SUCCESS;
+		break;
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_HTTP_RETURNED_ERROR:
+	case CURLE_OPERATION_TIMEOUTED:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_BAD_CONTENT_ENCODING:
+		ret=PK_NETFAIL;
+		break;
+	default:
+		ret=PK_IOERR;
+		break;
+	}
+	g_free(url);
+	return ret;
+}
+
+/* libcurl has no portable way to open a connection without making a
+   request, so make a HEAD request for the first chunk */
+static pk_err_t http_warm(struct pk_connection *conn)
+{
+	struct http_connection *hconn = conn->data;
+	struct pk_state *state = conn->pool->state;
+	gchar *url;
+	CURLcode err;
+
+	url=form_chunk_path(state->parcel, state->parcel->master, 0);
+	/* The progress callback lets transport_pool_free() cut the
+	   request short rather than waiting out the timeout */
+	if (curl_easy_setopt(hconn->curl, CURLOPT_URL, url) ||
+				curl_easy_setopt(hconn->curl, CURLOPT_NOBODY,
+				1L) ||
+				curl_easy_setopt(hconn->curl, CURLOPT_TIMEOUT,
+				(long) HTTP_WARM_TIMEOUT) ||
+				curl_easy_setopt(hconn->curl,
+				HTTP_PROGRESSFUNCTION, warm_progress) ||
+				curl_easy_setopt(hconn->curl,
+				HTTP_PROGRESSDATA, conn) ||
+				curl_easy_setopt(hconn->curl,
+				CURLOPT_NOPROGRESS, 0L)) {
+		pk_log(LOG_ERROR, "Couldn't configure connection warm-up");
+		g_free(url);
+		return PK_CALLFAIL;
+	}
+	err=curl_easy_perform(hconn->curl);
+	if (err)
+		pk_log(LOG_TRANSPORT, "Couldn't open connection to %s: %s",
+					url, hconn->errbuf);
+	g_free(url);
+	if (curl_easy_setopt(hconn->curl, CURLOPT_HTTPGET, 1L) ||
+				curl_easy_setopt(hconn->curl, CURLOPT_TIMEOUT,
+				0L) ||
+				curl_easy_setopt(hconn->curl,
+				CURLOPT_NOPROGRESS, 1L)) {
+		pk_log(LOG_ERROR, "Couldn't reset connection after warm-up");
+		return PK_CALLFAIL;
+	}
+	return err ? PK_NETFAIL : PK_SUCCESS;
+}
+
+const struct pk_transport_backend transport_http = {
+	.name = "http",
+	.handles = http_handles,
+	.pool_init = http_pool_init,
+	.pool_free = http_pool_free,
+	.conn_init = http_conn_init,
+	.conn_free = http_conn_free,
+	.warm = http_warm,
+	.get = http_get,
+};
@@ -0,0 +1,344 @@
+/*
+ * Parcelkeeper - support daemon for the OpenISR (R) system virtual disk
+ *
+ * Copyright (C) 2006-2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Chunk sources on the local machine, for when the chunk store is on a
+   local disk or network filesystem.  These avoid the overhead of libcurl
+   and the HTTP stack. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "defs.h"
+#include "transport_defs.h"
+
+#define FILE_PREFIX "file://"
+#define UNIX_PREFIX "unix:"
+#define UNIX_NOT_FOUND 0xffffffff
+
+/***** file:// *****/
+
+static gboolean file_handles(const char *master)
+{
+	return g_str_has_prefix(master, FILE_PREFIX);
+}
+
+static pk_err_t file_pool_init(struct pk_connection_pool *cpool)
+{
+	cpool->data = g_strdup(cpool->state->parcel->master +
+				strlen(FILE_PREFIX));
+	return PK_SUCCESS;
+}
+
+static void file_pool_free(struct pk_connection_pool *cpool)
+{
+	g_free(cpool->data);
+}
+
+static pk_err_t file_get(struct pk_connection *conn, unsigned chunk)
+{
+	struct pk_state *state = conn->pool->state;
+	struct stat st;
+	gchar *path;
+	ssize_t count;
+	int fd;
+	pk_err_t ret = PK_NETFAIL;
+
+	path = form_chunk_path(state->parcel, conn->pool->data, chunk);
+	pk_log(LOG_TRANSPORT, "Reading %s", path);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		pk_log(LOG_ERROR, "Couldn't open %s: %s", path,
+					strerror(errno));
+		goto out;
+	}
+	if (fstat(fd, &st)) {
+		pk_log(LOG_ERROR, "Couldn't stat %s: %s", path,
+					strerror(errno));
+		goto out_close;
+	}
+	if (st.st_size > state->parcel->chunksize) {
+		pk_log(LOG_ERROR, "%s: chunk too large", path);
+		ret = PK_IOERR;
+		goto out_close;
+	}
+	/* Read directly into the transfer buffer */
+	while (conn->offset < (size_t) st.st_size) {
+		count = pread(fd, conn->buf + conn->offset,
+					st.st_size - conn->offset,
+					conn->offset);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0) {
+			pk_log(LOG_ERROR, "Couldn't read %s: %s", path,
+						count ? strerror(errno) :
+						"Unexpected end of file");
+			goto out_close;
+		}
+		transport_sink_commit(conn, count);
+	}
+	ret = PK_SUCCESS;
+out_close:
+	close(fd);
+out:
+	g_free(path);
+	return ret;
+}
+
+const struct pk_transport_backend transport_file = {
+	.name = "file",
+	.handles = file_handles,
+	.pool_init = file_pool_init,
+	.pool_free = file_pool_free,
+	.get = file_get,
+};
+
+/***** unix: *****/
+
+/* The master URL has the form unix:SOCKET/PATH, where SOCKET is the path
+   to a Unix domain socket and PATH is passed to the server.  Since both
+   are filesystem paths, SOCKET is taken to be the shortest prefix which
+   names an existing socket.
+
+   Protocol: the client sends the path of a chunk (PATH/DDDD/FFFF),
+   terminated by a newline.  The server replies with the chunk length as a
+   32-bit big-endian integer, followed by the chunk data, or with a length
+   of 0xffffffff if the chunk could not be read.  The connection can then
+   be reused for another request.  tools/chunksrv implements the server. */
+
+struct unix_pool {
+	struct sockaddr_un addr;
+	gchar *prefix;
+};
+
+struct unix_connection {
+	int fd;
+};
+
+static gboolean unix_handles(const char *master)
+{
+	return g_str_has_prefix(master, UNIX_PREFIX);
+}
+
+static pk_err_t unix_pool_init(struct pk_connection_pool *cpool)
+{
+	const char *master = cpool->state->parcel->master;
+	const char *path = master + strlen(UNIX_PREFIX);
+	struct unix_pool *upool;
+	struct stat st;
+	const char *sep;
+	gchar *sock;
+
+	if (*path == 0) {
+		pk_log(LOG_ERROR, "No chunk server socket in %s", master);
+		return PK_INVALID;
+	}
+	for (sep = strchr(path + 1, '/'); sep != NULL;
+				sep = strchr(sep + 1, '/')) {
+		sock = g_strndup(path, sep - path);
+		if (!stat(sock, &st) && S_ISSOCK(st.st_mode))
+			break;
+		g_free(sock);
+	}
+	if (sep == NULL) {
+		pk_log(LOG_ERROR, "Couldn't find chunk server socket in %s",
+					master);
+		return PK_INVALID;
+	}
+	if (strlen(sock) >= sizeof(upool->addr.sun_path)) {
+		pk_log(LOG_ERROR, "Socket path too long: %s", sock);
+		g_free(sock);
+		return PK_INVALID;
+	}
+	upool = g_slice_new0(struct unix_pool);
+	upool->addr.sun_family = AF_UNIX;
+	strcpy(upool->addr.sun_path, sock);
+	upool->prefix = g_strdup(sep);
+	g_free(sock);
+	cpool->data = upool;
+	return PK_SUCCESS;
+}
+
+static void unix_pool_free(struct pk_connection_pool *cpool)
+{
+	struct unix_pool *upool = cpool->data;
+
+	g_free(upool->prefix);
+	g_slice_free(struct unix_pool, upool);
+}
+
+static pk_err_t unix_conn_init(struct pk_connection *conn)
+{
+	struct unix_connection *uconn;
+
+	uconn = g_slice_new0(struct unix_connection);
+	uconn->fd = -1;  /* connect on first use */
+	conn->data = uconn;
+	return PK_SUCCESS;
+}
+
+static void unix_disconnect(struct unix_connection *uconn)
+{
+	if (uconn->fd != -1) {
+		close(uconn->fd);
+		uconn->fd = -1;
+	}
+}
+
+static void unix_conn_free(struct pk_connection *conn)
+{
+	struct unix_connection *uconn = conn->data;
+
+	if (uconn == NULL)
+		return;
+	unix_disconnect(uconn);
+	g_slice_free(struct unix_connection, uconn);
+}
+
+static pk_err_t unix_connect(struct pk_connection *conn)
+{
+	struct unix_pool *upool = conn->pool->data;
+	struct unix_connection *uconn = conn->data;
+
+	uconn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (uconn->fd == -1) {
+		pk_log(LOG_ERROR, "Couldn't create socket: %s",
+					strerror(errno));
+		return PK_CALLFAIL;
+	}
+	if (connect(uconn->fd, (struct sockaddr *) &upool->addr,
+				sizeof(upool->addr))) {
+		pk_log(LOG_ERROR, "Couldn't connect to %s: %s",
+					upool->addr.sun_path, strerror(errno));
+		unix_disconnect(uconn);
+		return PK_NETFAIL;
+	}
+	return PK_SUCCESS;
+}
+
+static pk_err_t unix_send(int fd, const char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = send(fd, buf, len, MSG_NOSIGNAL);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count == -1)
+			return PK_NETFAIL;
+		buf += count;
+		len -= count;
+	}
+	return PK_SUCCESS;
+}
+
+/* If @conn is non-NULL, the data is delivered to its transfer buffer */
+static pk_err_t unix_recv(int fd, void *_buf, size_t len,
+			struct pk_connection *conn)
+{
+	char *buf = _buf;
+	ssize_t count;
+
+	while (len > 0) {
+		count = read(fd, buf, len);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return PK_NETFAIL;
+		if (conn != NULL)
+			transport_sink_commit(conn, count);
+		buf += count;
+		len -= count;
+	}
+	return PK_SUCCESS;
+}
+
+static pk_err_t unix_warm(struct pk_connection *conn)
+{
+	return unix_connect(conn);
+}
+
+static pk_err_t unix_get(struct pk_connection *conn, unsigned chunk)
+{
+	struct pk_state *state = conn->pool->state;
+	struct unix_pool *upool = conn->pool->data;
+	struct unix_connection *uconn = conn->data;
+	gchar *path;
+	gchar *req;
+	uint32_t hdr;
+	unsigned len;
+	pk_err_t ret;
+
+	if (uconn->fd == -1) {
+		ret = unix_connect(conn);
+		if (ret)
+			return ret;
+	}
+	path = form_chunk_path(state->parcel, upool->prefix, chunk);
+	pk_log(LOG_TRANSPORT, "Fetching %s from %s", path,
+				upool->addr.sun_path);
+	req = g_strdup_printf("%s\n", path);
+	ret = unix_send(uconn->fd, req, strlen(req));
+	g_free(req);
+	if (ret)
+		goto bad;
+	ret = unix_recv(uconn->fd, &hdr, sizeof(hdr), NULL);
+	if (ret)
+		goto bad;
+	len = ntohl(hdr);
+	if (len == UNIX_NOT_FOUND) {
+		pk_log(LOG_ERROR, "Fetching %s: server couldn't read chunk",
+					path);
+		g_free(path);
+		return PK_NETFAIL;
+	}
+	if (len > state->parcel->chunksize) {
+		pk_log(LOG_ERROR, "Fetching %s: invalid chunk length %u",
+					path, len);
+		ret = PK_PROTOFAIL;
+		goto bad_quiet;
+	}
+	ret = unix_recv(uconn->fd, conn->buf, len, conn);
+	if (ret)
+		goto bad;
+	g_free(path);
+	return PK_SUCCESS;
+
+bad:
+	pk_log(LOG_ERROR, "Fetching %s: connection failed", path);
+bad_quiet:
+	/* The stream is no longer in a known state */
+	unix_disconnect(uconn);
+	g_free(path);
+	return ret;
+}
+
+const struct pk_transport_backend transport_unix = {
+	.name = "unix",
+	.handles = unix_handles,
+	.pool_init = unix_pool_init,
+	.pool_free = unix_pool_free,
+	.conn_init = unix_conn_init,
+	.conn_free = unix_conn_free,
+	.warm = unix_warm,
+	.get = unix_get,
+};
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,6 +32,9 @@
 #include "defs.h"
 
 #define UUID_STR_LEN 36  /* not including trailing NUL */
+#define ZERO_PAGE_SIZE 4096
+/* Vectors per pwritev() in pwrite_padded(); well under IOV_MAX */
+#define PADDED_IOV 64
 
 struct pk_lockfile {
 	gchar *path;
@@ -377,6 +381,82 @@ pk_err_t fork_and_wait(int *status_fd)
 	return PK_SUCCESS;
 }
 
+/* Chunk buffers are page-aligned so that the kernel can copy into and out
+   of them a page at a time */
+void *chunk_buf_alloc(struct pk_parcel *parcel)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, getpagesize(), parcel->chunksize))
+		g_error("Couldn't allocate %u-byte chunk buffer",
+					parcel->chunksize);
+	return buf;
+}
+
+void chunk_buf_free(void *buf)
+{
+	free(buf);
+}
+
+/* Write @len bytes from @buf at @offset, followed by zeroes out to
+   @padded_len, without first copying @buf into a padded bounce buffer.
+   Short writes are continued, and each pwritev() is limited to
+   PADDED_IOV vectors. */
+pk_err_t pwrite_padded(int fd, const void *buf, unsigned len,
+			unsigned padded_len, off64_t offset)
+{
+	static const char zero[ZERO_PAGE_SIZE];
+	struct iovec iov[PADDED_IOV];
+	const char *data = buf;
+	unsigned data_left;
+	unsigned zero_left;
+	unsigned remaining;
+	unsigned niov;
+	unsigned count;
+	ssize_t ret;
+
+	if (len > padded_len)
+		return PK_INVALID;
+	data_left = len;
+	zero_left = padded_len - len;
+	while (data_left > 0 || zero_left > 0) {
+		niov = 0;
+		if (data_left > 0) {
+			iov[0].iov_base = (void *) data;
+			iov[0].iov_len = data_left;
+			niov++;
+		}
+		for (remaining = zero_left; remaining > 0 &&
+					niov < PADDED_IOV; niov++) {
+			iov[niov].iov_base = (void *) zero;
+			iov[niov].iov_len = MIN(remaining, ZERO_PAGE_SIZE);
+			remaining -= iov[niov].iov_len;
+		}
+		ret = pwritev(fd, iov, niov, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return PK_IOERR;
+		offset += ret;
+		count = MIN((unsigned) ret, data_left);
+		data += count;
+		data_left -= count;
+		zero_left -= ret - count;
+	}
+	return PK_SUCCESS;
+}
+
+/* Return TRUE if all @len bytes of @buf are zero.  Each byte is compared
+   with its successor, so this only has to walk the buffer once. */
+gboolean buf_is_zero(const void *buf, unsigned len)
+{
+	const char *cbuf = buf;
+
+	if (len == 0)
+		return TRUE;
+	return cbuf[0] == 0 && !memcmp(cbuf, cbuf + 1, len - 1);
+}
+
 gchar *form_chunk_path(struct pk_parcel *parcel, const char *prefix,
 			unsigned chunk)
 {
@@ -448,3 +528,28 @@ void _stats_increment(struct pk_state *state, uint64_t *var, uint64_t val)
 	*var += val;
 	g_mutex_unlock(state->stats_lock);
 }
+
+uint64_t timestamp_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Record a transfer of @bytes from @src which began at @start_usec */
+void xfer_record(struct pk_state *state, enum pk_xfer_source src,
+			unsigned bytes, uint64_t start_usec)
+{
+	uint64_t elapsed = timestamp_usec() - start_usec;
+	unsigned bucket;
+
+	/* Bucket n holds latencies in [2^n, 2^(n+1)) usec */
+	bucket = 0;
+	while (bucket < XFER_LATENCY_BUCKETS - 1 && elapsed >> (bucket + 1))
+		bucket++;
+	xfer_increment(state, chunks[src], 1);
+	xfer_increment(state, bytes[src], bytes);
+	xfer_increment(state, usec[src], elapsed);
+	xfer_increment(state, latency[src][bucket], 1);
+}
@@ -0,0 +1,218 @@
+/*
+ * chunksrv - Serve chunks to Parcelkeeper over a Unix domain socket
+ *
+ * Copyright (C) 2011 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * LICENSE.GPL.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* This is the server side of Parcelkeeper's unix: chunk source.  A parcel
+   whose master URL is unix:SOCKET/PATH fetches chunk DDDD/FFFF by sending
+   "PATH/DDDD/FFFF\n"; we reply with the length of the file ROOT/PATH/DDDD/
+   FFFF as a 32-bit big-endian integer followed by its contents, or with a
+   length of 0xffffffff if it can't be read.  Each client connection is
+   handled by a child process and can carry any number of requests. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <glib.h>
+
+#define NOT_FOUND 0xffffffff
+/* Largest chunk we will send, to bound the client's buffer */
+#define MAX_CHUNK (16 << 20)
+#define COPY_BUF 65536
+
+static const char *root;
+
+static void __attribute__((noreturn)) die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static void __attribute__((noreturn)) usage(void)
+{
+	die("Usage: %s <socket> [root]", g_get_prgname());
+}
+
+static int write_all(int fd, const void *_buf, size_t len)
+{
+	const char *buf = _buf;
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return -1;
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/* Don't let clients escape the root directory */
+static gboolean path_ok(const char *path)
+{
+	gchar **parts;
+	gboolean ret = TRUE;
+	int i;
+
+	parts = g_strsplit(path, "/", 0);
+	for (i = 0; parts[i] != NULL; i++)
+		if (!strcmp(parts[i], ".."))
+			ret = FALSE;
+	g_strfreev(parts);
+	return ret;
+}
+
+/* Returns -1 if the connection failed, 0 otherwise */
+static int send_chunk(int sock, const char *path)
+{
+	char buf[COPY_BUF];
+	struct stat st;
+	gchar *file;
+	uint32_t hdr = htonl(NOT_FOUND);
+	off_t offset = 0;
+	ssize_t count;
+	int fd = -1;
+	int ret = -1;
+
+	if (!path_ok(path)) {
+		fprintf(stderr, "Rejecting request for %s\n", path);
+		return write_all(sock, &hdr, sizeof(hdr));
+	}
+	/* Request paths are absolute */
+	file = g_strdup_printf("%s%s", root, path);
+	fd = open(file, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+				st.st_size > MAX_CHUNK) {
+		fprintf(stderr, "Couldn't read %s\n", file);
+		ret = write_all(sock, &hdr, sizeof(hdr));
+		goto out;
+	}
+	hdr = htonl(st.st_size);
+	if (write_all(sock, &hdr, sizeof(hdr)))
+		goto out;
+	/* Once the length is sent we can't report errors, so a short file
+	   ends the connection */
+	while (offset < st.st_size) {
+		count = pread(fd, buf, MIN((off_t) sizeof(buf),
+					st.st_size - offset), offset);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0) {
+			fprintf(stderr, "Couldn't read %s\n", file);
+			goto out;
+		}
+		if (write_all(sock, buf, count))
+			goto out;
+		offset += count;
+	}
+	ret = 0;
+out:
+	if (fd != -1)
+		close(fd);
+	g_free(file);
+	return ret;
+}
+
+static void serve(int sock)
+{
+	char line[PATH_MAX + 2];
+	FILE *fp;
+	size_t len;
+
+	fp = fdopen(sock, "r");
+	if (fp == NULL)
+		die("Couldn't open client stream");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n') {
+			fprintf(stderr, "Malformed request\n");
+			break;
+		}
+		line[len - 1] = 0;
+		if (send_chunk(sock, line))
+			break;
+	}
+	fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	int lsock;
+	int sock;
+
+	g_set_prgname(argv[0]);
+	if (argc < 2 || argc > 3)
+		usage();
+	root = argc > 2 ? argv[2] : "";
+	if (strlen(argv[1]) >= sizeof(addr.sun_path))
+		die("Socket path too long: %s", argv[1]);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[1]);
+
+	/* Children are never waited for */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock == -1)
+		die("Couldn't create socket: %s", strerror(errno));
+	unlink(argv[1]);
+	if (bind(lsock, (struct sockaddr *) &addr, sizeof(addr)))
+		die("Couldn't bind %s: %s", argv[1], strerror(errno));
+	if (listen(lsock, 16))
+		die("Couldn't listen on %s: %s", argv[1], strerror(errno));
+
+	while (1) {
+		sock = accept(lsock, NULL, NULL);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			die("Couldn't accept connection: %s",
+						strerror(errno));
+		}
+		switch (fork()) {
+		case -1:
+			fprintf(stderr, "Couldn't fork: %s\n",
+						strerror(errno));
+			break;
+		case 0:
+			close(lsock);
+			serve(sock);
+			exit(0);
+		}
+		close(sock);
+	}
+}